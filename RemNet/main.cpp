@@ -15,7 +15,8 @@ int ReverseInt(int i) { // Data conversion
 	return ((int)ch1 << 24) + ((int)ch2 << 16) + ((int)ch3 << 8) + ch4;
 }
 
-void ReadMnistData(string path, shared_ptr<Blob>& images) {
+template<typename Dtype>
+void ReadMnistData(string path, shared_ptr<Blob<Dtype>>& images) {
 	ifstream file(path, ios::binary);
 	if (file.is_open()) {
 		int magic_number = 0;
@@ -39,7 +40,7 @@ void ReadMnistData(string path, shared_ptr<Blob>& images) {
 				for (int w = 0; w < n_cols; w++) {
 					unsigned char temp = 0;
 					file.read((char*)&temp, sizeof(temp));		
-					(*images)[i](h, w, 0) = (double)temp / 255;
+					(*images)[i](h, w, 0) = (Dtype)temp / 255;
 				}
 			}
 		}
@@ -48,7 +49,8 @@ void ReadMnistData(string path, shared_ptr<Blob>& images) {
 		cout << "no data file found :-(" << endl;
 
 }
-void ReadMnistLabel(string path, shared_ptr<Blob>& labels) {
+template<typename Dtype>
+void ReadMnistLabel(string path, shared_ptr<Blob<Dtype>>& labels) {
 	ifstream file(path, ios::binary);
 	if (file.is_open()) {
 		int magic_number = 0;
@@ -68,24 +70,25 @@ void ReadMnistLabel(string path, shared_ptr<Blob>& labels) {
 		cout << "no label file found :-(" << endl;
 }
 
-void trainModel(NetParam& net_param, shared_ptr<Blob> x_train_ori, shared_ptr<Blob> y_train_ori) {
+template<typename Dtype>
+void trainModel(NetParam& net_param, shared_ptr<Blob<Dtype>> x_train_ori, shared_ptr<Blob<Dtype>> y_train_ori) {
 
 	vector<string> layers = net_param.layers;
 	vector<string> ltypes = net_param.ltypes;
 
 
 	// 1. The 60,000 pictures were divided into training set and test set at a ratio of 59:1
-	shared_ptr<Blob> x_train(new Blob(x_train_ori->subBlob(0, 59000)));
-	shared_ptr<Blob> y_train(new Blob(y_train_ori->subBlob(0, 59000)));
+	shared_ptr<Blob<Dtype>> x_train(new Blob<Dtype>(x_train_ori->subBlob(0, 59000)));
+	shared_ptr<Blob<Dtype>> y_train(new Blob<Dtype>(y_train_ori->subBlob(0, 59000)));
 
-	shared_ptr<Blob> x_val(new Blob(x_train_ori->subBlob(59000, 60000)));
-	shared_ptr<Blob> y_val(new Blob(y_train_ori->subBlob(59000, 60000)));
+	shared_ptr<Blob<Dtype>> x_val(new Blob<Dtype>(x_train_ori->subBlob(59000, 60000)));
+	shared_ptr<Blob<Dtype>> y_val(new Blob<Dtype>(y_train_ori->subBlob(59000, 60000)));
 
-	vector<shared_ptr<Blob>> xx{ x_train, x_val };
-	vector<shared_ptr<Blob>> yy{ y_train, y_val };
+	vector<shared_ptr<Blob<Dtype>>> xx{ x_train, x_val };
+	vector<shared_ptr<Blob<Dtype>>> yy{ y_train, y_val };
 
 	// 2. Initializes the network structure
-	Net myModel;
+	Net<Dtype> myModel;
 	myModel.initNet(net_param, xx, yy);
 
 	// 3. Train start
@@ -96,16 +99,17 @@ void trainModel(NetParam& net_param, shared_ptr<Blob> x_train_ori, shared_ptr<Bl
 	cout << "----------------Train end...----------------" << endl;
 }
 
-void trainModel_with_exVal(NetParam& net_param, shared_ptr<Blob> x_train_ori, shared_ptr<Blob> y_trian_ori, 
-								shared_ptr<Blob> x_val_ori, shared_ptr<Blob> y_val_ori) {
+template<typename Dtype>
+void trainModel_with_exVal(NetParam& net_param, shared_ptr<Blob<Dtype>> x_train_ori, shared_ptr<Blob<Dtype>> y_trian_ori, 
+								shared_ptr<Blob<Dtype>> x_val_ori, shared_ptr<Blob<Dtype>> y_val_ori) {
 	vector<string> layers = net_param.layers;
 	vector<string> ltypes = net_param.ltypes;
 
-	vector<shared_ptr<Blob>> xx{ x_train_ori, x_val_ori };
-	vector<shared_ptr<Blob>> yy{ y_trian_ori, y_val_ori };
+	vector<shared_ptr<Blob<Dtype>>> xx{ x_train_ori, x_val_ori };
+	vector<shared_ptr<Blob<Dtype>>> yy{ y_trian_ori, y_val_ori };
 
 	// Initializes the network structure
-	Net myModel;
+	Net<Dtype> myModel;
 	myModel.initNet(net_param, xx, yy);
 
 	// Train start
@@ -116,30 +120,38 @@ void trainModel_with_exVal(NetParam& net_param, shared_ptr<Blob> x_train_ori, sh
 	cout << "----------------Train end...----------------" << endl;
 }
 
-int main(int argc, char** argv) {
-	string configFile = "./myModel.json";
-	NetParam net_param;
-
-	// 0. Read myModel.json, and parse
-	net_param.readNetParam(configFile);
-
+template<typename Dtype>
+void runModel(NetParam& net_param) {
 	// create two Blob objectone save imagesone save labels
-	shared_ptr<Blob> images_train(new Blob(60000, 1, 28, 28, TZEROS));
-	shared_ptr<Blob> labels_train(new Blob(60000, 10, 1, 1, TZEROS)); // one-hot
+	shared_ptr<Blob<Dtype>> images_train(new Blob<Dtype>(60000, 1, 28, 28, TZEROS));
+	shared_ptr<Blob<Dtype>> labels_train(new Blob<Dtype>(60000, 10, 1, 1, TZEROS)); // one-hot
 	ReadMnistData("mnist_data/train/train-images.idx3-ubyte", images_train);
 	ReadMnistLabel("mnist_data/train/train-labels.idx1-ubyte", labels_train);
 
-	shared_ptr<Blob> images_test(new Blob(10000, 1, 28, 28, TZEROS));
-	shared_ptr<Blob> labels_test(new Blob(10000, 10, 1, 1, TZEROS)); // one-hot
+	shared_ptr<Blob<Dtype>> images_test(new Blob<Dtype>(10000, 1, 28, 28, TZEROS));
+	shared_ptr<Blob<Dtype>> labels_test(new Blob<Dtype>(10000, 10, 1, 1, TZEROS)); // one-hot
 	ReadMnistData("mnist_data/test/t10k-images.idx3-ubyte", images_test);
 	ReadMnistLabel("mnist_data/test/t10k-labels.idx1-ubyte", labels_test);
 
 	int samples_num = 1000;
-	shared_ptr<Blob> x_train(new Blob(images_train->subBlob(0, samples_num)));
-	shared_ptr<Blob> y_train(new Blob(labels_train->subBlob(0, samples_num)));
-	shared_ptr<Blob> x_test(new Blob(images_test->subBlob(0, samples_num)));
-	shared_ptr<Blob> y_test(new Blob(labels_test->subBlob(0, samples_num)));
+	shared_ptr<Blob<Dtype>> x_train(new Blob<Dtype>(images_train->subBlob(0, samples_num)));
+	shared_ptr<Blob<Dtype>> y_train(new Blob<Dtype>(labels_train->subBlob(0, samples_num)));
+	shared_ptr<Blob<Dtype>> x_test(new Blob<Dtype>(images_test->subBlob(0, samples_num)));
+	shared_ptr<Blob<Dtype>> y_test(new Blob<Dtype>(labels_test->subBlob(0, samples_num)));
 	
 	trainModel_with_exVal(net_param, x_train, y_train, x_test, y_test);
+}
 
-}
\ No newline at end of file
+int main(int argc, char** argv) {
+	string configFile = "./myModel.json";
+	NetParam net_param;
+
+	// 0. Read myModel.json, and parse
+	net_param.readNetParam(configFile);
+
+	// 1. Build and train the pipeline in the configured precision
+	if (net_param.precision == "float")
+		runModel<float>(net_param);
+	else
+		runModel<double>(net_param);
+}
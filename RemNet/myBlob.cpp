@@ -1,217 +1,436 @@
 #include "myBlob.hpp"
 #include "cassert"
+#include <cstring>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
 using namespace std;
 using namespace arma;
 
-Blob::Blob(const int n, const int c, const int h, const int w, int type) :N(n), C(c), H(h), W(w) {
+// Heap allocations of the process: everything that goes through operator new, plus the Blob buffers
+static std::atomic<long long> heap_allocs(0);
+
+long long heapAllocCount() {
+	return heap_allocs.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t n) {
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = malloc(n ? n : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t n) {
+	return operator new(n);
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept {
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	return malloc(n ? n : 1);
+}
+
+void* operator new[](size_t n, const std::nothrow_t& tag) noexcept {
+	return operator new(n, tag);
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	free(p);
+}
+
+// Allocate n bytes aligned to BLOB_ALIGN
+static void* aligned_acquire(size_t n) {
+	if (n == 0)
+		return NULL;
+	void* p = NULL;
+#ifdef _MSC_VER
+	p = _aligned_malloc(n, BLOB_ALIGN);
+#else
+	if (posix_memalign(&p, BLOB_ALIGN, n) != 0)
+		p = NULL;
+#endif
+	if (!p)
+		throw std::bad_alloc();
+	heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	return p;
+}
+
+static void aligned_release(void* p) {
+#ifdef _MSC_VER
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+template<typename Dtype>
+Blob<Dtype>::Blob(const int n, const int c, const int h, const int w, int type) :N(n), C(c), H(h), W(w), mem(NULL), wrap(NULL), split(0), own(true) {
 	arma_rng::set_seed_random(); //	System randomly generates seeds
 	init(N, C, H, W, type);
 }
 
-void Blob::init(const int n, const int c, const int h, const int w, int type) {
-	if (type == TZEROS) {
-		blob_data = vector<cube>(n, cube(h, w, c, fill::zeros)); // Manage n cubes with vector
-		return;
-	}
-	if (type == TONES) {
-		blob_data = vector<cube>(n, cube(h, w, c, fill::ones));
+template<typename Dtype>
+void Blob<Dtype>::allocate(const int n, const int c, const int h, const int w) {
+	N = n;
+	C = c;
+	H = h;
+	W = w;
+	size_t num = (size_t)n * c * h * w;
+	mem = static_cast<Dtype*>(aligned_acquire(num * sizeof(Dtype))); // One block for the whole batch
+	wrap = NULL;
+	split = n;
+	own = true;
+	bind();
+}
+
+// Buffer or view changed: the cubes are rebuilt on the next operator[]
+template<typename Dtype>
+void Blob<Dtype>::bind() {
+	blob_data.clear();
+	built.store(false, std::memory_order_relaxed);
+}
+
+// Serializes the first operator[] on a Blob, which layer threads may reach together
+static std::mutex cube_lock;
+
+template<typename Dtype>
+void Blob<Dtype>::buildCubes() const {
+	std::lock_guard<std::mutex> g(cube_lock);
+	if (built.load(std::memory_order_relaxed))
 		return;
+	blob_data.clear();
+	blob_data.reserve(N);
+	// Every cube is a fixed-size view over its own sample (no copy, no ownership)
+	for (int i = 0; i < N; i++)
+		blob_data.emplace_back(const_cast<Dtype*>(sample(i)), H, W, C, false, true);
+	built.store(true, std::memory_order_release);
+}
+
+template<typename Dtype>
+void Blob<Dtype>::release() {
+	blob_data.clear();
+	built.store(false, std::memory_order_relaxed);
+	if (own)
+		aligned_release(mem);
+	mem = NULL;
+	wrap = NULL;
+	split = 0;
+	own = true;
+}
+
+template<typename Dtype>
+void Blob<Dtype>::init(const int n, const int c, const int h, const int w, int type) {
+	allocate(n, c, h, w);
+	if (type != TDEFAULT) // TDEFAULT is left uninitialized
+		fill(type);
+}
+
+template<typename Dtype>
+void Blob<Dtype>::fill(int type) {
+	int chw = C * H * W;
+	for (int i = 0; i < N; i++) {
+		arma::Col<Dtype> v(sample(i), chw, false, true); // the sample as one vector, no cube needed
+		if (type == TZEROS)
+			v.zeros();
+		if (type == TONES)
+			v.ones();
+		if (type == TRANDU)
+			v.randu(); // Uniform distribution
+		if (type == TRANDN)
+			v.randn(); // Standard normal distribution
 	}
-	if (type == TDEFAULT) {
-		blob_data = vector<cube>(n, cube(h, w, c));
+}
+
+// Copying always yields an owning, contiguous Blob (a copied view gathers its segments)
+template<typename Dtype>
+Blob<Dtype>::Blob(const Blob& other) :N(0), C(0), H(0), W(0), mem(NULL), wrap(NULL), split(0), own(true) {
+	allocate(other.N, other.C, other.H, other.W);
+	copyData(other);
+}
+
+template<typename Dtype>
+Blob<Dtype>::Blob(Blob&& other) noexcept :N(other.N), C(other.C), H(other.H), W(other.W), mem(other.mem),
+	wrap(other.wrap), split(other.split), own(other.own),
+	blob_data(std::move(other.blob_data)), built(other.built.load()) { // The views keep pointing at the stolen buffer
+	other.N = other.C = other.H = other.W = 0;
+	other.mem = NULL;
+	other.wrap = NULL;
+	other.split = 0;
+	other.own = true;
+	other.blob_data.clear();
+	other.built.store(false, std::memory_order_relaxed);
+}
+
+template<typename Dtype>
+void Blob<Dtype>::copyData(const Blob& other) {
+	size_t chw = (size_t)C * H * W;
+	if (isContiguous() && other.isContiguous()) {
+		if (mem)
+			memcpy(mem, other.mem, sizeof(Dtype) * count());
 		return;
 	}
-	if (type == TRANDU) {
-		for (int i = 0; i < n; i++) // generate n cubes
-			blob_data.push_back(arma::randu<cube>(h, w, c)); // Uniform distribution
-		return;
+	for (int n = 0; n < N; n++)
+		memcpy(sample(n), other.sample(n), sizeof(Dtype) * chw);
+}
+
+template<typename Dtype>
+Blob<Dtype>::~Blob() {
+	release();
+}
+
+template<typename Dtype>
+Blob<Dtype>& Blob<Dtype>::operator=(const Blob& other) {
+	if (this == &other)
+		return *this;
+	// Reuse the current buffer when the shape already matches
+	if (size() != other.size()) {
+		release();
+		allocate(other.N, other.C, other.H, other.W);
 	}
+	copyData(other);
+	return *this;
+}
 
-	if (type == TRANDN) {
-		for (int i = 0; i < n; i++)
-			blob_data.push_back(arma::randn<cube>(h, w, c)); // Standard normal distribution
-		return;
+template<typename Dtype>
+Blob<Dtype>& Blob<Dtype>::operator=(Blob&& other) noexcept {
+	if (this == &other)
+		return *this;
+	// A view keeps its memory: assigning a same-shaped Blob writes through instead of rebinding
+	if (!own && size() == other.size()) {
+		copyData(other);
+		return *this;
 	}
+	release();
+	N = other.N;
+	C = other.C;
+	H = other.H;
+	W = other.W;
+	mem = other.mem;
+	wrap = other.wrap;
+	split = other.split;
+	own = other.own;
+	blob_data = std::move(other.blob_data);
+	built.store(other.built.load(), std::memory_order_relaxed);
+	other.N = other.C = other.H = other.W = 0;
+	other.mem = NULL;
+	other.wrap = NULL;
+	other.split = 0;
+	other.own = true;
+	other.blob_data.clear();
+	other.built.store(false, std::memory_order_relaxed);
+	return *this;
 }
 
-void Blob::print(string str) {
-	assert(!blob_data.empty());
+template<typename Dtype>
+void Blob<Dtype>::print(string str) {
+	assert(mem);
 	cout << str << endl;
 	for (int i = 0; i < N; i++) { // N is the number of cubes in the blob
 		printf("N = %d\n", i);
-		this->blob_data[i].print(); // Call cube's own print method
+		(*this)[i].print(); // Call cube's own print method
 	}
 }
 
-cube& Blob::operator[] (int i) {
+template<typename Dtype>
+typename Blob<Dtype>::cube_type& Blob<Dtype>::operator[] (int i) {
+	if (!built.load(std::memory_order_acquire))
+		buildCubes();
 	return blob_data[i];
 }
 
-vector<cube>& Blob::get_data() {
+template<typename Dtype>
+const typename Blob<Dtype>::cube_type& Blob<Dtype>::operator[] (int i) const {
+	if (!built.load(std::memory_order_acquire))
+		buildCubes();
+	return blob_data[i];
+}
+
+template<typename Dtype>
+vector<typename Blob<Dtype>::cube_type>& Blob<Dtype>::get_data() {
+	if (!built.load(std::memory_order_acquire))
+		buildCubes();
 	return blob_data;
 }
 
-Blob Blob::subBlob(int start, int end) {
+template<typename Dtype>
+Blob<Dtype> Blob<Dtype>::subBlob(int start, int end) {
+	// Deep copy, the result owns its data. Use view() to avoid the copy
+	return Blob(view(start, end));
+}
+
+template<typename Dtype>
+Blob<Dtype> Blob<Dtype>::view(int start, int end) {
+	Blob v;
+	v.viewOf(*this, start, end);
+	return v;
+}
+
+template<typename Dtype>
+void Blob<Dtype>::viewOf(Blob& src, int start, int end) {
+	assert(src.isContiguous()); // no views of wrap-around views
+	release();
+	C = src.C;
+	H = src.H;
+	W = src.W;
+	own = false;
+	mem = src.sample(start);
+	wrap = NULL;
 	if (end > start) {
-		Blob tmp(end - start, C, H, W);
-		for (int i = start; i < end; i++)
-			tmp[i - start] = (*this)[i];
-		return tmp;
-	} else {
-		Blob tmp(N-start+end, C, H, W);
-		for (int i = start; i < N; i++)
-			tmp[i - start] = (*this)[i];
-		for (int i = 0; i < end; i++)
-			tmp[i + N - start] = (*this)[i];
-		return tmp;
+		N = end - start;
+		split = N;
+	} else { // Wrap around the end: [start, N) followed by [0, end)
+		N = src.N - start + end;
+		split = src.N - start;
+		wrap = src.mem;
 	}
+	bind();
 }
 
-Blob& Blob::operator*=(double k) {
-	for (int i = 0; i < N; i++)
-		blob_data[i] = blob_data[i] * k;
+template<typename Dtype>
+Blob<Dtype>& Blob<Dtype>::operator*=(double k) {
+	Dtype s = (Dtype)k;
+	int chw = C * H * W;
+	for (int n = 0; n < N; n++) {
+		Dtype* p = sample(n);
+		for (int i = 0; i < chw; i++)
+			p[i] *= s;
+	}
 	return *this;
 }
 
-Blob Blob::pad(int pad, double val) {
-	assert(!blob_data.empty());
-	Blob padX(N, C, H + (pad << 1), W + (pad << 1));
-	padX = val;
-
-	for (int n = 0; n < N; n++) 
-		for (int c = 0; c < C; c++) 
-			for (int h = 0; h < H; h++) 
-				for (int w = 0; w < W; w++) 
-					padX[n](h + pad, w + pad, c) = blob_data[n](h, w, c);
-	return padX;
-}
-void Blob::maxIn(double val) {
-	assert(!blob_data.empty());
-	for (int i = 0; i < N; i++) {
-		blob_data[i].transform([val](double e) {return e > val ? e : val; });
-		// clipping
-		double clipped = 6.0;
-		blob_data[i].transform([clipped](double e) {return e > clipped ? clipped : e; });
+template<typename Dtype>
+Blob<Dtype>& Blob<Dtype>::operator+=(double val) {
+	Dtype s = (Dtype)val;
+	int chw = C * H * W;
+	for (int n = 0; n < N; n++) {
+		Dtype* p = sample(n);
+		for (int i = 0; i < chw; i++)
+			p[i] += s;
 	}
-	return;
+	return *this;
 }
 
-void Blob::convertIn(double val) {
-	assert(!blob_data.empty());
-	for (int i = 0; i < N; i++)
-		blob_data[i].transform([val](double e) {return e > val ? 0 : 1; });
-	return;
+template<typename Dtype>
+Blob<Dtype>& Blob<Dtype>::operator=(double val) {
+	int chw = C * H * W;
+	for (int n = 0; n < N; n++)
+		std::fill(sample(n), sample(n) + chw, (Dtype)val);
+	return *this;
 }
 
-vector<int> Blob::size() const {
-	vector<int> shape{N, C, H, W};
-	return shape;
+template<typename Dtype>
+Blob<Dtype> Blob<Dtype>::pad(int pad, double val) {
+	Blob padX(N, C, H + (pad << 1), W + (pad << 1));
+	padTo(padX, pad, val);
+	return padX;
 }
 
-Blob::Blob(const vector<int> shape, int type) : N(shape[0]), C(shape[1]), H(shape[2]), W(shape[3]) {
-	arma_rng::set_seed_random();
-	init(N, C, H, W, type);
-}
+template<typename Dtype>
+void Blob<Dtype>::padTo(Blob& padX, int pad, double val) const {
+	assert(mem);
+	int Hp = H + (pad << 1);
+	int Wp = W + (pad << 1);
+	assert(padX.getN() == N && padX.getC() == C && padX.getH() == Hp && padX.getW() == Wp);
+	padX = val;
 
-Blob operator*(Blob A, Blob B) {
-	// Make sure both input blobs are the same size
-	vector<int> size_A = A.size();
-	vector<int> size_B = B.size();
-	for (int i = 0; i < 4; i++)
-		assert(size_A[i] == size_B[i]);
-	Blob C(A.size());
-	int N = size_A[0];
-	// Traverse all cubes and multiply the corresponding positions of each cube (cube % cube)
-	for (int i = 0; i < N; i++)
-		C[i] = A[i] % B[i];
-	return C;
+	// Copy column by column: each column of H values is contiguous in both Blobs
+	for (int n = 0; n < N; n++)
+		for (int c = 0; c < C; c++) {
+			const Dtype* src = sample(n) + (size_t)c * H * W;
+			Dtype* dst = padX.sample(n) + (size_t)c * Hp * Wp;
+			for (int w = 0; w < W; w++)
+				memcpy(dst + (size_t)(w + pad) * Hp + pad, src + (size_t)w * H, sizeof(Dtype) * H);
+		}
 }
-
-Blob Blob::unPad(int pad) {
-	assert(!blob_data.empty());
-	Blob out(N, C, H - (pad << 1), W - (pad << 1));
-	for (int n = 0; n < N; n++) 
-		for (int c = 0; c < C; c++)
-			for (int h = pad; h < H - pad; h++) 
-				for (int w = pad; w < W - pad; w++)
-					out[n](h - pad, w - pad, c) = blob_data[n](h, w, c);
-	return out;
+template<typename Dtype>
+void Blob<Dtype>::maxIn(double val) {
+	assert(mem);
+	// clipping
+	Dtype clipped = RELU_CLIP;
+	Dtype lo = (Dtype)val;
+	int chw = C * H * W;
+	for (int n = 0; n < N; n++) {
+		Dtype* p = sample(n);
+		for (int i = 0; i < chw; i++) {
+			Dtype e = p[i] > lo ? p[i] : lo;
+			p[i] = e > clipped ? clipped : e;
+		}
+	}
+	return;
 }
 
-Blob operator*(double num, Blob B) {
-	// Iterate over all cubes, multiplying each cube by a value
-	int N = B.getN();
-	Blob out(B.size());
-	for (int i = 0; i < N; i++)
-		out[i] = num * B[i];
-	return out;
+template<typename Dtype>
+void Blob<Dtype>::convertIn(double val) {
+	assert(mem);
+	Dtype t = (Dtype)val;
+	int chw = C * H * W;
+	for (int n = 0; n < N; n++) {
+		Dtype* p = sample(n);
+		for (int i = 0; i < chw; i++)
+			p[i] = p[i] > t ? 0 : 1;
+	}
+	return;
 }
 
-Blob operator+(Blob A, Blob B) {
-	// Make sure both input blobs are the same size
-	vector<int> size_A = A.size();
-	vector<int> size_B = B.size();
-	for (int i = 0; i < 4; ++i)
-		assert(size_A[i] == size_B[i]);
-	int N = size_A[0];
-	// Traverse all cubes and add the corresponding positions of each cube (cube + cube)
-	Blob C(A.size());
-	for (int i = 0; i < N; ++i)
-		C[i] = A[i] + B[i];
-	return C;
-}
-
-Blob operator+(Blob A, double val) {
-	int N = A.getN();
-	Blob out(A.size());
-	for (int i = 0; i < N; ++i)
-		out[i] = A[i] + val;
-	return out;
+template<typename Dtype>
+BlobShape Blob<Dtype>::size() const {
+	return {N, C, H, W};
 }
 
-Blob operator/(Blob A, Blob B) {
-	vector<int> size_A = A.size();
-	vector<int> size_B = B.size();
-	for (int i = 0; i < 4; i++)
-		assert(size_A[i] == size_B[i]);
-	Blob C(A.size());
-	// Traverse all cubes and do phase division for each cube corresponding position (cube / cube)
-	int N = size_A[0];
-	for (int i = 0; i < N; i++)
-		C[i] = A[i] / B[i];
-	return C;
+template<typename Dtype>
+vector<int> Blob<Dtype>::strides() const {
+	// Element strides of (n, c, h, w)
+	vector<int> stride{C * H * W, H * W, 1, H};
+	return stride;
 }
 
+template<typename Dtype>
+Blob<Dtype>::Blob(const BlobShape& shape, int type) : N(shape[0]), C(shape[1]), H(shape[2]), W(shape[3]), mem(NULL), wrap(NULL), split(0), own(true) {
+	arma_rng::set_seed_random();
+	init(N, C, H, W, type);
+}
 
-Blob sqrt(Blob A) {
-	int N = A.getN();
-	Blob out(A.size());
-	for (int i = 0; i < N; ++i)
-		out[i] = arma::sqrt(A[i]);
-	return out;
+template<typename Dtype>
+Blob<Dtype>::Blob(Dtype* ext, const BlobShape& shape) : N(shape[0]), C(shape[1]), H(shape[2]), W(shape[3]), mem(ext), wrap(NULL), split(shape[0]), own(false) {
+	bind();
 }
 
-Blob operator/(Blob A, double val) {
-	int N = A.getN();
-	Blob out(A.size());
-	for (int i = 0; i < N; i++)
-		out[i] = A[i] / val;
+template<typename Dtype>
+Blob<Dtype> Blob<Dtype>::unPad(int pad) {
+	Blob out(N, C, H - (pad << 1), W - (pad << 1));
+	unPadTo(out, pad);
 	return out;
 }
 
-Blob square(Blob A) {
-	int N = A.getN();
-	Blob out(A.size());
-	for (int i = 0; i < N; i++)
-		out[i] = arma::square(A[i]);
-	return out;
+template<typename Dtype>
+void Blob<Dtype>::unPadTo(Blob& out, int pad) const {
+	assert(mem);
+	int Ho = H - (pad << 1);
+	int Wo = W - (pad << 1);
+	assert(out.getN() == N && out.getC() == C && out.getH() == Ho && out.getW() == Wo);
+	for (int n = 0; n < N; n++)
+		for (int c = 0; c < C; c++) {
+			const Dtype* src = sample(n) + (size_t)c * H * W;
+			Dtype* dst = out.sample(n) + (size_t)c * Ho * Wo;
+			for (int w = 0; w < Wo; w++)
+				memcpy(dst + (size_t)w * Ho, src + (size_t)(w + pad) * H + pad, sizeof(Dtype) * Ho);
+		}
 }
 
-double accu(Blob A) {
-	double res = 0;
-	int N = A.getN();
-	Blob out(A.size());
-	for (int i = 0; i < N; i++)
-		res += arma::accu(A[i]);
-	return res;
-}
\ No newline at end of file
+template class Blob<float>;
+template class Blob<double>;
@@ -2,11 +2,18 @@
 #define __MYBLOB_HPP__
 #include <vector>
 #include <armadillo>
+#include <atomic>
+#include <cassert>
+#include <algorithm>
+#include <initializer_list>
 
 using std::vector;
 using std::string;
 using arma::cube;
 
+// The ReLU layers are clipped at RELU_CLIP (ReLU6): y = min(max(x, 0), RELU_CLIP)
+#define RELU_CLIP 6
+
 enum FillType {
 	TZEROS = 0,  // Use 0 to fill the cube
 	TONES = 1,   // Use 1 to fill the cube
@@ -15,47 +22,375 @@ enum FillType {
 	TDEFAULT = 4
 };
 
-class Blob {
+// Alignment (in bytes) of the Blob storage, wide enough for a full AVX-512 register / cache line
+const int BLOB_ALIGN = 64;
+
+// Heap allocations made so far by the process (operator new and the Blob buffers; memory armadillo
+// takes for its own temporaries is not seen), used to check that steady-state training does not allocate
+long long heapAllocCount();
+
+// Base of the lazy Blob expressions built by the arithmetic operators (see the end of this file)
+template<typename E>
+struct BlobExpr {
+	inline const E& self() const { return static_cast<const E&>(*this); }
+};
+
+// The (N, C, H, W) of a Blob, held by value so shapes can be passed around without heap allocations.
+// It converts to and from vector<int>, the form the layer setup code works with.
+struct BlobShape {
+	int d[4];
+	BlobShape() :d{0, 0, 0, 0} {}
+	BlobShape(std::initializer_list<int> s) { assert(s.size() == 4); std::copy(s.begin(), s.end(), d); }
+	BlobShape(const vector<int>& s) { assert(s.size() == 4); std::copy(s.begin(), s.end(), d); }
+	operator vector<int>() const { return {d[0], d[1], d[2], d[3]}; }
+	inline int& operator[](int i) { return d[i]; }
+	inline int operator[](int i) const { return d[i]; }
+	inline bool operator==(const BlobShape& o) const { return d[0] == o.d[0] && d[1] == o.d[1] && d[2] == o.d[2] && d[3] == o.d[3]; }
+	inline bool operator!=(const BlobShape& o) const { return !(*this == o); }
+};
+
+// A Blob holds N samples of shape (C, H, W) in one aligned, contiguous buffer.
+// Dtype is the element type: float or double (the two instantiations in myBlob.cpp).
+// Memory order is NCHW with each H x W plane stored column-major (armadillo order),
+// i.e. element (n, c, h, w) lives at n * C*H*W + c * H*W + w * H + h.
+// operator[] returns an armadillo cube that aliases sample n inside the buffer. Those cubes are only
+// built on the first operator[], so making a Blob or a view costs no per-sample work or allocation.
+// A Blob may also be a non-owning view (see view()) over samples of another Blob, made of at
+// most two contiguous segments; every sample is always contiguous, so use sample(n) to walk it.
+// Views can also be laid over external memory, which is how the Net workspace hands out Blobs.
+template<typename Dtype>
+class Blob : public BlobExpr<Blob<Dtype>> {
 
 public:
-	Blob() :N(0), C(0), H(0), W(0) {};
+	typedef Dtype elem_type;
+	typedef arma::Cube<Dtype> cube_type;
+
+	Blob() :N(0), C(0), H(0), W(0), mem(NULL), wrap(NULL), split(0), own(true) {};
 	Blob(const int n, const int c, const int h, const int w, int type = TDEFAULT);
-	Blob(const vector<int> shape, int type = TDEFAULT);
+	Blob(const BlobShape& shape, int type = TDEFAULT);
+	Blob(Dtype* ext, const BlobShape& shape); // non-owning view over ext
+	Blob(const Blob& other);
+	Blob(Blob&& other) noexcept;
+	template<typename E> Blob(const BlobExpr<E>& expr);
+	~Blob();
+	Blob& operator=(const Blob& other);
+	Blob& operator=(Blob&& other) noexcept;
+	template<typename E> Blob& operator=(const BlobExpr<E>& expr);
 	void print(string str = "");
-	cube& operator[](int i);
+	void fill(int type); // refill in place according to FillType
+	cube_type& operator[](int i);
+	const cube_type& operator[](int i) const;
 	Blob& operator*=(double i);
+	Blob& operator+=(double val);
 	Blob& operator=(double val);
-	friend Blob operator*(Blob A, Blob B);
-	friend Blob operator*(double num, Blob B);
-	friend Blob operator+(Blob A, Blob B);
-	friend Blob operator+(Blob A, double val);
-	friend Blob operator/(Blob A, Blob B);
-	friend Blob sqrt(Blob A);
-	friend Blob square(Blob A);
-	friend double accu(Blob A);
-	friend Blob operator/(Blob A, double val);
-	vector<cube>& get_data();
+	// In-place updates, evaluated in one pass without temporaries (the destination may appear in the expression)
+	template<typename E> Blob& operator+=(const BlobExpr<E>& expr);
+	template<typename E> Blob& operator-=(const BlobExpr<E>& expr);
+	Blob& axpy(double a, const Blob& x); // this += a * x
+	Blob& axpby(double a, const Blob& x, double b); // this = a * x + b * this
+	Blob& fma(double a, const Blob& x, const Blob& y, double b = 1); // this = b * this + a * x * y (element-wise)
+	vector<cube_type>& get_data();
 	Blob subBlob(int start, int end);
+	Blob view(int start, int end);
+	void viewOf(Blob& src, int start, int end); // make this Blob view(start, end) of src, without allocating
 	Blob pad(int pad, double val = 0);
-	void maxIn(double val = 0);
+	void padTo(Blob& padX, int pad, double val = 0) const;
+	void maxIn(double val = 0); // ReLU: clip to [val, RELU_CLIP]
 	void convertIn(double val = 0);
-	vector<int> size() const;
+	BlobShape size() const;
+	vector<int> strides() const;
 	Blob unPad(int pad);
+	void unPadTo(Blob& out, int pad) const;
 	inline int getN() const { return N; }
 	inline int getC() const { return C; }
 	inline int getH() const { return H; }
 	inline int getW() const { return W; }
+	inline int count() const { return N * C * H * W; } // total number of elements
+	inline bool sameShape(const Blob& o) const { return N == o.N && C == o.C && H == o.H && W == o.W; }
+	inline bool isView() const { return !own; }
+	inline bool isContiguous() const { return split == N; }
+	// Whole-batch pointer, only valid when the Blob is a single segment
+	inline Dtype* memptr() { assert(isContiguous()); return mem; }
+	inline const Dtype* memptr() const { assert(isContiguous()); return mem; }
+	// Start of sample n, valid for owning Blobs and views alike
+	inline Dtype* sample(int n) { return n < split ? mem + (size_t)n * C * H * W : wrap + (size_t)(n - split) * C * H * W; }
+	inline const Dtype* sample(int n) const { return n < split ? mem + (size_t)n * C * H * W : wrap + (size_t)(n - split) * C * H * W; }
 
 private:
 	int N; // number of cube(feature map)
 	int C; // channels
 	int H; // height
 	int W; // width
-	vector<cube> blob_data;
+	Dtype* mem; // contiguous storage of all N cubes (first segment of a view)
+	Dtype* wrap; // second segment of a wrap-around view, NULL otherwise
+	int split; // number of samples in the first segment (N when contiguous)
+	bool own; // false for views, which never free mem
+	mutable vector<cube_type> blob_data; // per-sample views into mem, built by the first operator[]
+	mutable std::atomic<bool> built{false}; // blob_data matches the current buffer
 
 	void init(const int n, const int c, const int h, const int w, int type);
+	void allocate(const int n, const int c, const int h, const int w);
+	void bind();
+	void buildCubes() const;
+	void copyData(const Blob& other);
+	template<typename Op, typename E> void apply(E expr);
+	void release();
+
+};
+
+// Lazy Blob arithmetic.
+// A * B (element-wise), A + B, A - B, A / B, the scalar forms, sqrt() and square() only build a
+// small expression object holding pointers to their operands. The work happens when the
+// expression is assigned to a Blob or reduced with accu(): one fused loop reads every operand
+// once and writes the destination once, so e.g. the RMSprop update creates no temporaries.
+// Expressions must be consumed in the statement that builds them (they refer to their operands).
+// Scalars are converted to the element type of the expression.
+
+// Leaf: one Blob, read sample by sample so that views work too
+template<typename Dtype>
+struct BlobLeaf : BlobExpr<BlobLeaf<Dtype>> {
+	typedef Dtype elem_type;
+	const Blob<Dtype>* b;
+	const Dtype* p;
+	explicit BlobLeaf(const Blob<Dtype>& blob) :b(&blob), p(NULL) {}
+	inline const Blob<Dtype>& shape() const { return *b; }
+	inline bool contiguous() const { return b->isContiguous(); }
+	inline void bind(int n) { p = b->sample(n); }
+	inline Dtype operator[](int i) const { return p[i]; }
+};
+
+// Blobs enter an expression as leaves, sub-expressions are stored by value
+template<typename E>
+struct BlobOperand {
+	typedef E type;
+	static inline const E& wrap(const BlobExpr<E>& e) { return e.self(); }
+};
+template<typename Dtype>
+struct BlobOperand<Blob<Dtype>> {
+	typedef BlobLeaf<Dtype> type;
+	static inline BlobLeaf<Dtype> wrap(const BlobExpr<Blob<Dtype>>& e) { return BlobLeaf<Dtype>(e.self()); }
+};
+
+template<typename L, typename R, typename Op>
+struct BlobBinary : BlobExpr<BlobBinary<L, R, Op>> {
+	typedef typename L::elem_type elem_type;
+	L l;
+	R r;
+	BlobBinary(const L& a, const R& b) :l(a), r(b) { assert(a.shape().sameShape(b.shape())); }
+	inline const Blob<elem_type>& shape() const { return l.shape(); }
+	inline bool contiguous() const { return l.contiguous() && r.contiguous(); }
+	inline void bind(int n) { l.bind(n); r.bind(n); }
+	inline elem_type operator[](int i) const { return Op::apply(l[i], r[i]); }
+};
+
+// expr (op) scalar, or scalar (op) expr when Left is true
+template<typename E, typename Op, bool Left>
+struct BlobScalar : BlobExpr<BlobScalar<E, Op, Left>> {
+	typedef typename E::elem_type elem_type;
+	E e;
+	elem_type s;
+	BlobScalar(const E& a, double val) :e(a), s((elem_type)val) {}
+	inline const Blob<elem_type>& shape() const { return e.shape(); }
+	inline bool contiguous() const { return e.contiguous(); }
+	inline void bind(int n) { e.bind(n); }
+	inline elem_type operator[](int i) const { return Left ? Op::apply(s, e[i]) : Op::apply(e[i], s); }
+};
 
+template<typename E, typename Op>
+struct BlobUnary : BlobExpr<BlobUnary<E, Op>> {
+	typedef typename E::elem_type elem_type;
+	E e;
+	explicit BlobUnary(const E& a) :e(a) {}
+	inline const Blob<elem_type>& shape() const { return e.shape(); }
+	inline bool contiguous() const { return e.contiguous(); }
+	inline void bind(int n) { e.bind(n); }
+	inline elem_type operator[](int i) const { return Op::apply(e[i]); }
 };
 
+struct BlobAdd { template<typename T> static inline T apply(T a, T b) { return a + b; } };
+struct BlobSub { template<typename T> static inline T apply(T a, T b) { return a - b; } };
+struct BlobMul { template<typename T> static inline T apply(T a, T b) { return a * b; } };
+struct BlobDiv { template<typename T> static inline T apply(T a, T b) { return a / b; } };
+struct BlobSqrt { template<typename T> static inline T apply(T a) { return std::sqrt(a); } };
+struct BlobSquare { template<typename T> static inline T apply(T a) { return a * a; } };
+struct BlobAssign { template<typename T> static inline T apply(T a, T b) { return b; } };
+
+#define BLOB_BINARY_OPERATOR(op, Op) \
+	template<typename A, typename B> \
+	inline BlobBinary<typename BlobOperand<A>::type, typename BlobOperand<B>::type, Op> \
+	operator op(const BlobExpr<A>& a, const BlobExpr<B>& b) { \
+		return BlobBinary<typename BlobOperand<A>::type, typename BlobOperand<B>::type, Op>(BlobOperand<A>::wrap(a), BlobOperand<B>::wrap(b)); \
+	} \
+	template<typename A> \
+	inline BlobScalar<typename BlobOperand<A>::type, Op, false> operator op(const BlobExpr<A>& a, double val) { \
+		return BlobScalar<typename BlobOperand<A>::type, Op, false>(BlobOperand<A>::wrap(a), val); \
+	} \
+	template<typename B> \
+	inline BlobScalar<typename BlobOperand<B>::type, Op, true> operator op(double val, const BlobExpr<B>& b) { \
+		return BlobScalar<typename BlobOperand<B>::type, Op, true>(BlobOperand<B>::wrap(b), val); \
+	}
+
+BLOB_BINARY_OPERATOR(+, BlobAdd)
+BLOB_BINARY_OPERATOR(-, BlobSub)
+BLOB_BINARY_OPERATOR(*, BlobMul) // element-wise, like cube % cube
+BLOB_BINARY_OPERATOR(/, BlobDiv)
+#undef BLOB_BINARY_OPERATOR
+
+// A temporary Blob on the left is updated in place and moved into the result instead of
+// allocating a new one, e.g. x.pad(1) * 2 reuses the padded buffer. Views are never reused.
+template<typename Dtype, typename E>
+inline Blob<Dtype> blob_reuse(Blob<Dtype>&& a, const E& e) {
+	if (a.isView())
+		return Blob<Dtype>(e);
+	a = e;
+	return std::move(a);
+}
+
+#define BLOB_RVALUE_OPERATOR(op, Op) \
+	template<typename Dtype, typename B> \
+	inline Blob<Dtype> operator op(Blob<Dtype>&& a, const BlobExpr<B>& b) { \
+		return blob_reuse(std::move(a), BlobBinary<BlobLeaf<Dtype>, typename BlobOperand<B>::type, Op>(BlobLeaf<Dtype>(a), BlobOperand<B>::wrap(b))); \
+	} \
+	template<typename Dtype> \
+	inline Blob<Dtype> operator op(Blob<Dtype>&& a, double val) { \
+		return blob_reuse(std::move(a), BlobScalar<BlobLeaf<Dtype>, Op, false>(BlobLeaf<Dtype>(a), val)); \
+	} \
+	template<typename Dtype> \
+	inline Blob<Dtype> operator op(double val, Blob<Dtype>&& a) { \
+		return blob_reuse(std::move(a), BlobScalar<BlobLeaf<Dtype>, Op, true>(BlobLeaf<Dtype>(a), val)); \
+	}
+
+BLOB_RVALUE_OPERATOR(+, BlobAdd)
+BLOB_RVALUE_OPERATOR(-, BlobSub)
+BLOB_RVALUE_OPERATOR(*, BlobMul)
+BLOB_RVALUE_OPERATOR(/, BlobDiv)
+#undef BLOB_RVALUE_OPERATOR
+
+template<typename A>
+inline BlobUnary<typename BlobOperand<A>::type, BlobSqrt> sqrt(const BlobExpr<A>& a) {
+	return BlobUnary<typename BlobOperand<A>::type, BlobSqrt>(BlobOperand<A>::wrap(a));
+}
+
+template<typename A>
+inline BlobUnary<typename BlobOperand<A>::type, BlobSquare> square(const BlobExpr<A>& a) {
+	return BlobUnary<typename BlobOperand<A>::type, BlobSquare>(BlobOperand<A>::wrap(a));
+}
+
+template<typename Dtype>
+inline Blob<Dtype> sqrt(Blob<Dtype>&& a) {
+	return blob_reuse(std::move(a), BlobUnary<BlobLeaf<Dtype>, BlobSqrt>(BlobLeaf<Dtype>(a)));
+}
+
+template<typename Dtype>
+inline Blob<Dtype> square(Blob<Dtype>&& a) {
+	return blob_reuse(std::move(a), BlobUnary<BlobLeaf<Dtype>, BlobSquare>(BlobLeaf<Dtype>(a)));
+}
+
+// Sum of all elements, evaluated in one pass without materializing the expression (accumulated in double)
+template<typename A>
+inline double accu(const BlobExpr<A>& a) {
+	typename BlobOperand<A>::type e = BlobOperand<A>::wrap(a);
+	const auto& s = e.shape();
+	double res = 0;
+	if (e.contiguous()) {
+		e.bind(0);
+		int num = s.count();
+		for (int i = 0; i < num; i++)
+			res += e[i];
+		return res;
+	}
+	int chw = s.getC() * s.getH() * s.getW();
+	for (int n = 0; n < s.getN(); n++) {
+		e.bind(n);
+		for (int i = 0; i < chw; i++)
+			res += e[i];
+	}
+	return res;
+}
+
+template<typename Dtype>
+template<typename E>
+Blob<Dtype>::Blob(const BlobExpr<E>& expr) :N(0), C(0), H(0), W(0), mem(NULL), wrap(NULL), split(0), own(true) {
+	typename BlobOperand<E>::type e = BlobOperand<E>::wrap(expr);
+	const Blob& s = e.shape();
+	allocate(s.N, s.C, s.H, s.W);
+	apply<BlobAssign>(e);
+}
+
+template<typename Dtype>
+template<typename E>
+Blob<Dtype>& Blob<Dtype>::operator=(const BlobExpr<E>& expr) {
+	typename BlobOperand<E>::type e = BlobOperand<E>::wrap(expr);
+	const Blob& s = e.shape();
+	// Element-wise evaluation, so the destination may also appear in the expression;
+	// only a shape change needs a fresh buffer (and then this cannot be an operand)
+	if (!sameShape(s)) {
+		int n = s.N, c = s.C, h = s.H, w = s.W;
+		release();
+		allocate(n, c, h, w);
+	}
+	apply<BlobAssign>(e);
+	return *this;
+}
+
+template<typename Dtype>
+template<typename E>
+Blob<Dtype>& Blob<Dtype>::operator+=(const BlobExpr<E>& expr) {
+	typename BlobOperand<E>::type e = BlobOperand<E>::wrap(expr);
+	assert(sameShape(e.shape()));
+	apply<BlobAdd>(e);
+	return *this;
+}
+
+template<typename Dtype>
+template<typename E>
+Blob<Dtype>& Blob<Dtype>::operator-=(const BlobExpr<E>& expr) {
+	typename BlobOperand<E>::type e = BlobOperand<E>::wrap(expr);
+	assert(sameShape(e.shape()));
+	apply<BlobSub>(e);
+	return *this;
+}
+
+template<typename Dtype>
+inline Blob<Dtype>& Blob<Dtype>::axpy(double a, const Blob& x) {
+	return *this += a * x;
+}
+
+template<typename Dtype>
+inline Blob<Dtype>& Blob<Dtype>::axpby(double a, const Blob& x, double b) {
+	return *this = a * x + b * (*this);
+}
+
+template<typename Dtype>
+inline Blob<Dtype>& Blob<Dtype>::fma(double a, const Blob& x, const Blob& y, double b) {
+	return *this = b * (*this) + a * x * y;
+}
+
+// dst = Op(dst, expr), element by element
+template<typename Dtype>
+template<typename Op, typename E>
+void Blob<Dtype>::apply(E e) {
+	if (isContiguous() && e.contiguous()) {
+		e.bind(0);
+		int num = count();
+		for (int i = 0; i < num; i++)
+			mem[i] = Op::apply(mem[i], e[i]);
+		return;
+	}
+	int chw = C * H * W;
+	for (int n = 0; n < N; n++) {
+		e.bind(n);
+		Dtype* dst = sample(n);
+		for (int i = 0; i < chw; i++)
+			dst[i] = Op::apply(dst[i], e[i]);
+	}
+}
+
+// y += a * x over num raw elements, for kernels that work on single samples or channels
+template<typename Dtype>
+inline void axpy(int num, Dtype a, const Dtype* x, Dtype* y) {
+	for (int i = 0; i < num; i++)
+		y[i] += a * x[i];
+}
 
-#endif
\ No newline at end of file
+#endif
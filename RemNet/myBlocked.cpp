@@ -0,0 +1,489 @@
+#include "myBlocked.hpp"
+#include "myThread.hpp"
+#include <cstring>
+#include <cassert>
+using namespace std;
+
+// Output pixels kept in registers by one convolution tile
+#define BLOCKED_TILE 6
+
+template<typename Dtype>
+void toBlocked(const Blob<Dtype>& src, Blob<Dtype>& dst) {
+	int C = src.getC();
+	size_t HW = (size_t)src.getH() * src.getW();
+	assert(dst.getN() == src.getN() && dst.getC() == blockedChannels(C) && dst.getH() == src.getH() && dst.getW() == src.getW());
+	parallelFor(src.getN(), [&](int n0, int n1, int) {
+		for (int n = n0; n < n1; n++) {
+			const Dtype* s = src.sample(n);
+			Dtype* d = dst.sample(n);
+			if (dst.getC() != C) // keep the padding channels at zero
+				std::fill(d, d + dst.getC() * HW, Dtype(0));
+			for (int c = 0; c < C; c++) {
+				const Dtype* sc = s + c * HW;
+				Dtype* dc = d + (c / CBLOCK) * HW * CBLOCK + c % CBLOCK;
+				for (size_t q = 0; q < HW; q++)
+					dc[q * CBLOCK] = sc[q];
+			}
+		}
+	});
+}
+
+template<typename Dtype>
+void fromBlocked(const Blob<Dtype>& src, Blob<Dtype>& dst) {
+	int C = dst.getC();
+	size_t HW = (size_t)dst.getH() * dst.getW();
+	assert(src.getN() == dst.getN() && src.getC() == blockedChannels(C) && dst.getH() == src.getH() && dst.getW() == src.getW());
+	parallelFor(dst.getN(), [&](int n0, int n1, int) {
+		for (int n = n0; n < n1; n++) {
+			const Dtype* s = src.sample(n);
+			Dtype* d = dst.sample(n);
+			for (int c = 0; c < C; c++) {
+				const Dtype* sc = s + (c / CBLOCK) * HW * CBLOCK + c % CBLOCK;
+				Dtype* dc = d + c * HW;
+				for (size_t q = 0; q < HW; q++)
+					dc[q] = sc[q * CBLOCK];
+			}
+		}
+	});
+}
+
+// First and one-past-last output index o whose input index o * stride + k - pad falls inside [0, len)
+static inline void tapRange(int len, int k, const ConvShape& s, int out, int& lo, int& hi) {
+	int first = s.pad - k; // o * stride >= pad - k
+	lo = first <= 0 ? 0 : (first + s.stride - 1) / s.stride;
+	int last = len - 1 + s.pad - k; // o * stride <= len - 1 + pad - k
+	hi = last < 0 ? 0 : std::min(out, last / s.stride + 1);
+}
+
+// R consecutive output pixels (oh0 .. oh0+R-1) of column ow for the CBLOCK kernels of one block.
+// wfb is the block's packed weights: one lane vector per (kw, kh, c).
+template<typename Dtype, int R>
+static inline void convTile(const Dtype* xn, const Dtype* wfb, const Dtype* bias, Dtype* ob, int ow, int oh0, const ConvShape& s) {
+	typedef BlockVec<Dtype> V;
+	size_t HW = (size_t)s.H * s.W;
+	V acc[R];
+	for (int j = 0; j < R; j++)
+		acc[j] = V::load(bias);
+	for (int kw = 0; kw < s.Ww; kw++) {
+		int iw = ow * s.stride + kw - s.pad;
+		if (iw < 0 || iw >= s.W)
+			continue;
+		for (int kh = 0; kh < s.Hw; kh++) {
+			int ih0 = oh0 * s.stride + kh - s.pad;
+			const Dtype* wk = wfb + (size_t)(kw * s.Hw + kh) * s.C * CBLOCK;
+			if (ih0 >= 0 && ih0 + (R - 1) * s.stride < s.H) {
+				// Whole tile inside the input: no bounds checks in the channel loop
+				for (int c = 0; c < s.C; c++) {
+					const Dtype* xp = xn + (c / CBLOCK) * HW * CBLOCK + ((size_t)iw * s.H + ih0) * CBLOCK + c % CBLOCK;
+					V wv = V::load(wk + (size_t)c * CBLOCK);
+					for (int j = 0; j < R; j++)
+						acc[j].madd(wv, xp[(size_t)j * s.stride * CBLOCK]);
+				}
+			} else {
+				for (int c = 0; c < s.C; c++) {
+					const Dtype* xc = xn + (c / CBLOCK) * HW * CBLOCK + (size_t)iw * s.H * CBLOCK + c % CBLOCK;
+					V wv = V::load(wk + (size_t)c * CBLOCK);
+					for (int j = 0; j < R; j++) {
+						int ih = ih0 + j * s.stride;
+						if (ih >= 0 && ih < s.H)
+							acc[j].madd(wv, xc[(size_t)ih * CBLOCK]);
+					}
+				}
+			}
+		}
+	}
+	for (int j = 0; j < R; j++)
+		acc[j].store(ob + ((size_t)ow * s.Ho + oh0 + j) * CBLOCK);
+}
+
+// Packs w (F, C, Hw, Ww) as [F / CBLOCK][Ww][Hw][C][CBLOCK], kernels in the lanes, padding kernels zero
+template<typename Dtype>
+static void packByKernel(const Blob<Dtype>& w, Dtype* wf, const ConvShape& s) {
+	int kk = s.Hw * s.Ww;
+	std::fill(wf, wf + (size_t)blockedChannels(s.F) * kk * s.C, Dtype(0));
+	for (int f = 0; f < s.F; f++)
+		for (int c = 0; c < s.C; c++)
+			for (int kw = 0; kw < s.Ww; kw++)
+				for (int kh = 0; kh < s.Hw; kh++)
+					wf[(((size_t)(f / CBLOCK) * kk + kw * s.Hw + kh) * s.C + c) * CBLOCK + f % CBLOCK] = w.sample(f)[c * kk + kw * s.Hw + kh];
+}
+
+// Packs w as [Cp / CBLOCK][Ww][Hw][F][CBLOCK], input channels in the lanes, padding channels zero
+template<typename Dtype>
+static void packByChannel(const Blob<Dtype>& w, Dtype* wt, const ConvShape& s) {
+	int kk = s.Hw * s.Ww;
+	std::fill(wt, wt + (size_t)blockedChannels(s.C) * kk * s.F, Dtype(0));
+	for (int f = 0; f < s.F; f++)
+		for (int c = 0; c < s.C; c++)
+			for (int kw = 0; kw < s.Ww; kw++)
+				for (int kh = 0; kh < s.Hw; kh++)
+					wt[(((size_t)(c / CBLOCK) * kk + kw * s.Hw + kh) * s.F + f) * CBLOCK + c % CBLOCK] = w.sample(f)[c * kk + kw * s.Hw + kh];
+}
+
+template<typename Dtype>
+void convForwardBlocked(const Blob<Dtype>& x, const Blob<Dtype>& w, const Blob<Dtype>& b, Blob<Dtype>& out,
+	Dtype* wf, const ConvShape& s) {
+	int FB = blockedChannels(s.F) / CBLOCK;
+	int kk = s.Hw * s.Ww;
+	size_t P = s.P();
+	int N = x.getN();
+	packByKernel(w, wf, s);
+	// Every (kernel block, sample) pair writes its own output block; a thread takes a run of them, kernel block outermost
+	parallelFor(FB * N, [&](int i0, int i1, int) {
+		for (int i = i0; i < i1; i++) {
+			int fb = i / N, n = i % N;
+			Dtype bias[CBLOCK] = {0};
+			for (int l = 0; l < CBLOCK && fb * CBLOCK + l < s.F; l++)
+				bias[l] = b.sample(fb * CBLOCK + l)[0];
+			const Dtype* wfb = wf + (size_t)fb * kk * s.C * CBLOCK;
+			const Dtype* xn = x.sample(n);
+			Dtype* ob = out.sample(n) + fb * P * CBLOCK;
+			for (int ow = 0; ow < s.Wo; ow++) {
+				int oh = 0;
+				for (; oh + BLOCKED_TILE <= s.Ho; oh += BLOCKED_TILE)
+					convTile<Dtype, BLOCKED_TILE>(xn, wfb, bias, ob, ow, oh, s);
+				for (; oh < s.Ho; oh++)
+					convTile<Dtype, 1>(xn, wfb, bias, ob, ow, oh, s);
+			}
+		}
+	});
+}
+
+// dw of R channels c0 .. c0+R-1 (inside one input block) for tap (kh, kw) and the kernels of one block:
+// R independent accumulators share every output-gradient vector
+template<typename Dtype, int R>
+static inline void dwTile(const Dtype* dyb, const Dtype* xn, Dtype* dwk, int kh, int kw, int c0, const ConvShape& s) {
+	typedef BlockVec<Dtype> V;
+	size_t HW = (size_t)s.H * s.W;
+	V acc[R];
+	for (int j = 0; j < R; j++)
+		acc[j] = V::zero();
+	int ohLo, ohHi, owLo, owHi;
+	tapRange(s.H, kh, s, s.Ho, ohLo, ohHi);
+	tapRange(s.W, kw, s, s.Wo, owLo, owHi);
+	const Dtype* xb = xn + (c0 / CBLOCK) * HW * CBLOCK + c0 % CBLOCK;
+	for (int ow = owLo; ow < owHi; ow++) {
+		int iw = ow * s.stride + kw - s.pad;
+		for (int oh = ohLo; oh < ohHi; oh++) {
+			int ih = oh * s.stride + kh - s.pad;
+			V dv = V::load(dyb + ((size_t)ow * s.Ho + oh) * CBLOCK);
+			const Dtype* xp = xb + ((size_t)iw * s.H + ih) * CBLOCK;
+			for (int j = 0; j < R; j++)
+				acc[j].madd(dv, xp[j]);
+		}
+	}
+	for (int j = 0; j < R; j++) {
+		V d = V::load(dwk + (size_t)(c0 + j) * CBLOCK);
+		d.add(acc[j]);
+		d.store(dwk + (size_t)(c0 + j) * CBLOCK);
+	}
+}
+
+// R consecutive input-gradient pixels (ih0 .. ih0+R-1) of column iw for the CBLOCK channels of one block,
+// gathered from every output pixel whose window covers them. wtb is the block's packed weights.
+template<typename Dtype, int R>
+static inline void dxTile(const Dtype* dyn, const Dtype* wtb, Dtype* dxb, int iw, int ih0, const ConvShape& s) {
+	typedef BlockVec<Dtype> V;
+	size_t P = s.P();
+	V acc[R];
+	for (int j = 0; j < R; j++)
+		acc[j] = V::zero();
+	for (int kw = 0; kw < s.Ww; kw++) {
+		int owNum = iw + s.pad - kw;
+		if (owNum < 0 || owNum % s.stride)
+			continue;
+		int ow = owNum / s.stride;
+		if (ow >= s.Wo)
+			continue;
+		for (int kh = 0; kh < s.Hw; kh++) {
+			int oh0 = ih0 + s.pad - kh;
+			const Dtype* wk = wtb + (size_t)(kw * s.Hw + kh) * s.F * CBLOCK;
+			const Dtype* dcol = dyn + (size_t)ow * s.Ho * CBLOCK;
+			if (s.stride == 1 && oh0 >= 0 && oh0 + R - 1 < s.Ho) {
+				for (int f = 0; f < s.F; f++) {
+					const Dtype* dp = dcol + (f / CBLOCK) * P * CBLOCK + (size_t)oh0 * CBLOCK + f % CBLOCK;
+					V wv = V::load(wk + (size_t)f * CBLOCK);
+					for (int j = 0; j < R; j++)
+						acc[j].madd(wv, dp[(size_t)j * CBLOCK]);
+				}
+			} else {
+				for (int f = 0; f < s.F; f++) {
+					const Dtype* dp = dcol + (f / CBLOCK) * P * CBLOCK + f % CBLOCK;
+					V wv = V::load(wk + (size_t)f * CBLOCK);
+					for (int j = 0; j < R; j++) {
+						int ohNum = oh0 + j;
+						if (ohNum < 0 || ohNum % s.stride || ohNum / s.stride >= s.Ho)
+							continue;
+						acc[j].madd(wv, dp[(size_t)(ohNum / s.stride) * CBLOCK]);
+					}
+				}
+			}
+		}
+	}
+	for (int j = 0; j < R; j++)
+		acc[j].store(dxb + ((size_t)iw * s.H + ih0 + j) * CBLOCK);
+}
+
+template<typename Dtype>
+void convBackwardBlocked(const Blob<Dtype>& din, const Blob<Dtype>& x, const Blob<Dtype>& w, Blob<Dtype>& dx, Blob<Dtype>& dw, Blob<Dtype>& db,
+	Dtype* wt, Dtype* dwf, const ConvShape& s, int parts) {
+	typedef BlockVec<Dtype> V;
+	int N = x.getN();
+	int FB = blockedChannels(s.F) / CBLOCK;
+	int CB = blockedChannels(s.C) / CBLOCK;
+	int kk = s.Hw * s.Ww;
+	size_t P = s.P();
+	size_t HW = (size_t)s.H * s.W;
+	bool wantDx = parts & CONV_GRAD_DATA, wantDw = parts & CONV_GRAD_WEIGHTS;
+	if (wantDx)
+		packByChannel(w, wt, s);
+	if (wantDw) {
+		std::fill(dwf, dwf + (size_t)FB * CBLOCK * kk * s.C, Dtype(0));
+		db = 0;
+	}
+	Dtype* dbp = db.memptr();
+
+	// 1. dw and db: every (kernel block, tap) owns its slice of dwf, so the threads split those and each
+	// runs over the whole batch (no two write the same accumulator, and the sum over samples keeps its order)
+	parallelFor(wantDw ? FB * kk : 0, [&](int i0, int i1, int) {
+		for (int i = i0; i < i1; i++) {
+			int fb = i / kk, kw = i % kk / s.Hw, kh = i % kk % s.Hw;
+			Dtype* dwk = dwf + ((size_t)fb * kk + kw * s.Hw + kh) * s.C * CBLOCK;
+			for (int n = 0; n < N; n++) {
+				const Dtype* xn = x.sample(n);
+				const Dtype* dyb = din.sample(n) + fb * P * CBLOCK;
+				// db: one vector sum per kernel block, taken with the first tap
+				if (i % kk == 0) {
+					V sum = V::zero();
+					for (size_t q = 0; q < P; q++)
+						sum.add(V::load(dyb + q * CBLOCK));
+					Dtype lanes[CBLOCK];
+					sum.store(lanes);
+					for (int l = 0; l < CBLOCK && fb * CBLOCK + l < s.F; l++)
+						dbp[fb * CBLOCK + l] += lanes[l];
+				}
+
+				// dw, tiled over the input channels of each block
+				for (int c0 = 0; c0 < s.C; c0 += CBLOCK) {
+					int c = c0, cEnd = std::min(s.C, c0 + CBLOCK);
+					for (; c + 4 <= cEnd; c += 4)
+						dwTile<Dtype, 4>(dyb, xn, dwk, kh, kw, c, s);
+					for (; c < cEnd; c++)
+						dwTile<Dtype, 1>(dyb, xn, dwk, kh, kw, c, s);
+				}
+			}
+		}
+	});
+
+	// 2. dx, every pixel of every (sample, channel block) is written once
+	parallelFor(wantDx ? N * CB : 0, [&](int i0, int i1, int) {
+		for (int i = i0; i < i1; i++) {
+			int n = i / CB, cb = i % CB;
+			const Dtype* dyn = din.sample(n);
+			const Dtype* wtb = wt + (size_t)cb * kk * s.F * CBLOCK;
+			Dtype* dxb = dx.sample(n) + cb * HW * CBLOCK;
+			for (int iw = 0; iw < s.W; iw++) {
+				int ih = 0;
+				for (; ih + BLOCKED_TILE <= s.H; ih += BLOCKED_TILE)
+					dxTile<Dtype, BLOCKED_TILE>(dyn, wtb, dxb, iw, ih, s);
+				for (; ih < s.H; ih++)
+					dxTile<Dtype, 1>(dyn, wtb, dxb, iw, ih, s);
+			}
+		}
+	});
+
+	// 3. Unpack dw, averaged over the batch like the other paths
+	if (!wantDw)
+		return;
+	Dtype scale = Dtype(1.0 / N);
+	parallelFor(s.F, [&](int f0, int f1, int) {
+		for (int f = f0; f < f1; f++)
+			for (int c = 0; c < s.C; c++)
+				for (int kw = 0; kw < s.Ww; kw++)
+					for (int kh = 0; kh < s.Hw; kh++)
+						dw.sample(f)[c * kk + kw * s.Hw + kh] = dwf[(((size_t)(f / CBLOCK) * kk + kw * s.Hw + kh) * s.C + c) * CBLOCK + f % CBLOCK] * scale;
+	});
+	db *= 1.0 / N;
+}
+
+// One channel block, window KH x KW fixed at compile time (0: use the runtime Hp, Wp)
+template<typename Dtype, int KH, int KW>
+static void poolBlockPlane(const Dtype* xb, Dtype* ob, unsigned char* ab, int H, int Ho, int Wo, int Hp, int Wp, int stride, bool relu) {
+	typedef BlockVec<Dtype> V;
+	const int hp = KH ? KH : Hp, wp = KW ? KW : Wp;
+	for (int ow = 0; ow < Wo; ow++)
+		for (int oh = 0; oh < Ho; oh++) {
+			const Dtype* xw = xb + ((size_t)ow * stride * H + oh * stride) * CBLOCK;
+			V m = V::load(xw), arg = V::zero();
+			for (int kw = 0; kw < wp; kw++)
+				for (int kh = 0; kh < hp; kh++)
+					if (kw || kh)
+						m.maxArg(V::load(xw + ((size_t)kw * H + kh) * CBLOCK), Dtype(kw * hp + kh), arg);
+			size_t q = ((size_t)ow * Ho + oh) * CBLOCK;
+			if (ab) {
+				Dtype t[CBLOCK], mv[CBLOCK];
+				arg.store(t);
+				m.store(mv);
+				for (int l = 0; l < CBLOCK; l++)
+					ab[q + l] = relu && !(mv[l] > 0 && mv[l] < RELU_CLIP) ? POOL_NO_TAP : (unsigned char)t[l];
+			}
+			if (relu) {
+				m.max(V::zero());
+				m.min(V::set(RELU_CLIP));
+			}
+			m.store(ob + q);
+		}
+}
+
+template<typename Dtype>
+void poolForwardBlocked(const Blob<Dtype>& x, Blob<Dtype>& out, unsigned char* taps, int Hp, int Wp, int stride, bool relu) {
+	assert(Hp * Wp <= POOL_MAX_TAPS);
+	int H = x.getH(), W = x.getW();
+	int Ho = out.getH(), Wo = out.getW();
+	size_t blocks = (size_t)x.getN() * (x.getC() / CBLOCK);
+	size_t HW = (size_t)H * W * CBLOCK, P = (size_t)Ho * Wo * CBLOCK;
+	auto plane = poolBlockPlane<Dtype, 0, 0>;
+	if (Hp == 2 && Wp == 2)
+		plane = poolBlockPlane<Dtype, 2, 2>;
+	else if (Hp == 3 && Wp == 3)
+		plane = poolBlockPlane<Dtype, 3, 3>;
+	parallelFor((int)blocks, [&](int i0, int i1, int) {
+		for (size_t i = i0; i < (size_t)i1; i++)
+			plane(x.memptr() + i * HW, out.memptr() + i * P, taps ? taps + i * P : NULL, H, Ho, Wo, Hp, Wp, stride, relu);
+	});
+}
+
+template<typename Dtype>
+void poolBackwardBlocked(const Blob<Dtype>& din, const unsigned char* taps, Blob<Dtype>& dx, int Hp, int Wp, int stride) {
+	int H = dx.getH(), W = dx.getW();
+	int Ho = din.getH(), Wo = din.getW();
+	size_t tapOff[POOL_MAX_TAPS];
+	for (int kw = 0; kw < Wp; kw++)
+		for (int kh = 0; kh < Hp; kh++)
+			tapOff[kw * Hp + kh] = ((size_t)kw * H + kh) * CBLOCK;
+
+	size_t blocks = (size_t)din.getN() * (din.getC() / CBLOCK);
+	size_t HW = (size_t)H * W * CBLOCK, P = (size_t)Ho * Wo * CBLOCK;
+	parallelFor((int)blocks, [&](int i0, int i1, int) {
+		for (size_t i = i0; i < (size_t)i1; i++) {
+			const Dtype* db = din.memptr() + i * P;
+			const unsigned char* ab = taps + i * P;
+			Dtype* dxb = dx.memptr() + i * HW;
+			std::fill(dxb, dxb + HW, Dtype(0));
+			for (int ow = 0; ow < Wo; ow++)
+				for (int oh = 0; oh < Ho; oh++) {
+					size_t q = ((size_t)ow * Ho + oh) * CBLOCK;
+					Dtype* g = dxb + ((size_t)ow * stride * H + oh * stride) * CBLOCK;
+					for (int l = 0; l < CBLOCK; l++)
+						if (ab[q + l] != POOL_NO_TAP)
+							g[tapOff[ab[q + l]] + l] += db[q + l];
+				}
+		}
+	});
+}
+
+template<typename Dtype>
+void avgPoolForwardBlocked(const Blob<Dtype>& x, Blob<Dtype>& out, int Hp, int Wp, int stride) {
+	typedef BlockVec<Dtype> V;
+	int H = x.getH(), W = x.getW();
+	int Ho = out.getH(), Wo = out.getW();
+	size_t blocks = (size_t)x.getN() * (x.getC() / CBLOCK);
+	size_t HW = (size_t)H * W * CBLOCK, P = (size_t)Ho * Wo * CBLOCK;
+	Dtype scale = Dtype(1.0 / (Hp * Wp));
+	parallelFor((int)blocks, [&](int i0, int i1, int) {
+		for (size_t i = i0; i < (size_t)i1; i++) {
+			const Dtype* xb = x.memptr() + i * HW;
+			Dtype* ob = out.memptr() + i * P;
+			for (int ow = 0; ow < Wo; ow++)
+				for (int oh = 0; oh < Ho; oh++) {
+					const Dtype* xw = xb + ((size_t)ow * stride * H + oh * stride) * CBLOCK;
+					V s = V::zero();
+					for (int kw = 0; kw < Wp; kw++)
+						for (int kh = 0; kh < Hp; kh++)
+							s.madd(V::load(xw + ((size_t)kw * H + kh) * CBLOCK), scale);
+					s.store(ob + ((size_t)ow * Ho + oh) * CBLOCK);
+				}
+		}
+	});
+}
+
+template<typename Dtype>
+void avgPoolBackwardBlocked(const Blob<Dtype>& din, Blob<Dtype>& dx, int Hp, int Wp, int stride) {
+	typedef BlockVec<Dtype> V;
+	int H = dx.getH(), W = dx.getW();
+	int Ho = din.getH(), Wo = din.getW();
+	size_t blocks = (size_t)din.getN() * (din.getC() / CBLOCK);
+	size_t HW = (size_t)H * W * CBLOCK, P = (size_t)Ho * Wo * CBLOCK;
+	Dtype scale = Dtype(1.0 / (Hp * Wp));
+	parallelFor((int)blocks, [&](int i0, int i1, int) {
+		for (size_t i = i0; i < (size_t)i1; i++) {
+			const Dtype* db = din.memptr() + i * P;
+			Dtype* dxb = dx.memptr() + i * HW;
+			std::fill(dxb, dxb + HW, Dtype(0));
+			for (int ow = 0; ow < Wo; ow++)
+				for (int oh = 0; oh < Ho; oh++) {
+					V g = V::zero();
+					g.madd(V::load(db + ((size_t)ow * Ho + oh) * CBLOCK), scale);
+					Dtype* gw = dxb + ((size_t)ow * stride * H + oh * stride) * CBLOCK;
+					for (int kw = 0; kw < Wp; kw++)
+						for (int kh = 0; kh < Hp; kh++) {
+							Dtype* p = gw + ((size_t)kw * H + kh) * CBLOCK;
+							V v = V::load(p);
+							v.add(g);
+							v.store(p);
+						}
+				}
+		}
+	});
+}
+
+template<typename Dtype>
+void globalAvgPoolForwardBlocked(const Blob<Dtype>& x, Blob<Dtype>& out) {
+	typedef BlockVec<Dtype> V;
+	size_t blocks = (size_t)x.getN() * (x.getC() / CBLOCK);
+	size_t HW = (size_t)x.getH() * x.getW();
+	Dtype scale = Dtype(1.0 / HW);
+	for (size_t i = 0; i < blocks; i++) {
+		const Dtype* xb = x.memptr() + i * HW * CBLOCK;
+		V s = V::zero();
+		for (size_t q = 0; q < HW; q++)
+			s.madd(V::load(xb + q * CBLOCK), scale);
+		s.store(out.memptr() + i * CBLOCK);
+	}
+}
+
+template<typename Dtype>
+void globalAvgPoolBackwardBlocked(const Blob<Dtype>& din, Blob<Dtype>& dx) {
+	typedef BlockVec<Dtype> V;
+	size_t blocks = (size_t)dx.getN() * (dx.getC() / CBLOCK);
+	size_t HW = (size_t)dx.getH() * dx.getW();
+	Dtype scale = Dtype(1.0 / HW);
+	for (size_t i = 0; i < blocks; i++) {
+		V g = V::zero();
+		g.madd(V::load(din.memptr() + i * CBLOCK), scale);
+		Dtype* dxb = dx.memptr() + i * HW * CBLOCK;
+		for (size_t q = 0; q < HW; q++)
+			g.store(dxb + q * CBLOCK);
+	}
+}
+
+template void toBlocked<float>(const Blob<float>&, Blob<float>&);
+template void toBlocked<double>(const Blob<double>&, Blob<double>&);
+template void fromBlocked<float>(const Blob<float>&, Blob<float>&);
+template void fromBlocked<double>(const Blob<double>&, Blob<double>&);
+template void convForwardBlocked<float>(const Blob<float>&, const Blob<float>&, const Blob<float>&, Blob<float>&, float*, const ConvShape&);
+template void convForwardBlocked<double>(const Blob<double>&, const Blob<double>&, const Blob<double>&, Blob<double>&, double*, const ConvShape&);
+template void convBackwardBlocked<float>(const Blob<float>&, const Blob<float>&, const Blob<float>&, Blob<float>&, Blob<float>&, Blob<float>&, float*, float*, const ConvShape&, int);
+template void convBackwardBlocked<double>(const Blob<double>&, const Blob<double>&, const Blob<double>&, Blob<double>&, Blob<double>&, Blob<double>&, double*, double*, const ConvShape&, int);
+template void poolForwardBlocked<float>(const Blob<float>&, Blob<float>&, unsigned char*, int, int, int, bool);
+template void poolForwardBlocked<double>(const Blob<double>&, Blob<double>&, unsigned char*, int, int, int, bool);
+template void poolBackwardBlocked<float>(const Blob<float>&, const unsigned char*, Blob<float>&, int, int, int);
+template void poolBackwardBlocked<double>(const Blob<double>&, const unsigned char*, Blob<double>&, int, int, int);
+template void avgPoolForwardBlocked<float>(const Blob<float>&, Blob<float>&, int, int, int);
+template void avgPoolForwardBlocked<double>(const Blob<double>&, Blob<double>&, int, int, int);
+template void avgPoolBackwardBlocked<float>(const Blob<float>&, Blob<float>&, int, int, int);
+template void avgPoolBackwardBlocked<double>(const Blob<double>&, Blob<double>&, int, int, int);
+template void globalAvgPoolForwardBlocked<float>(const Blob<float>&, Blob<float>&);
+template void globalAvgPoolForwardBlocked<double>(const Blob<double>&, Blob<double>&);
+template void globalAvgPoolBackwardBlocked<float>(const Blob<float>&, Blob<float>&);
+template void globalAvgPoolBackwardBlocked<double>(const Blob<double>&, Blob<double>&);
@@ -0,0 +1,61 @@
+#ifndef __MYBLOCKED_HPP__
+#define __MYBLOCKED_HPP__
+#include "myBlob.hpp"
+#include "myConv.hpp"
+#include "myPool.hpp"
+#include "mySimd.hpp"
+
+// Channel-blocked NCHWc layout. The channels of a sample are split into blocks of CBLOCK, and inside
+// a block the CBLOCK channels of one pixel sit next to each other (pixels keep the column-major plane
+// order q = w * H + h). Element (n, c, h, w) lives at
+//   n * Cp*H*W + (c / CBLOCK) * H*W*CBLOCK + (w * H + h) * CBLOCK + c % CBLOCK
+// where Cp is C rounded up to whole blocks; the extra channels are kept at zero. A blocked Blob is
+// stored with the shape {N, Cp, H, W}, so it has the right size but must not be read through operator[].
+
+inline int blockedChannels(int C) { return (C + CBLOCK - 1) / CBLOCK * CBLOCK; }
+
+// Storage shape of a blocked Blob holding the NCHW shape {N, C, H, W}
+inline BlobShape blockedShape(const BlobShape& shape) { return {shape[0], blockedChannels(shape[1]), shape[2], shape[3]}; }
+
+// NCHW -> NCHWc (dst has the blocked shape of src) and back (dst has the NCHW shape)
+template<typename Dtype>
+void toBlocked(const Blob<Dtype>& src, Blob<Dtype>& dst);
+template<typename Dtype>
+void fromBlocked(const Blob<Dtype>& src, Blob<Dtype>& dst);
+
+// Direct convolution on blocked x and out. Output channels ride in the vector lanes: every weight tap
+// is a vector of CBLOCK kernels, multiplied by one broadcast input value and added to a tile of output
+// pixels held in registers. wf is the packed weights, blockedChannels(F) * C * Hw*Ww values.
+template<typename Dtype>
+void convForwardBlocked(const Blob<Dtype>& x, const Blob<Dtype>& w, const Blob<Dtype>& b, Blob<Dtype>& out,
+	Dtype* wf, const ConvShape& s);
+
+// dx (blocked, input channels in the lanes), dw and db (plain layout, averaged over the batch).
+// wt is the weights packed by input channel (blockedChannels(C) * F * Hw*Ww values) and dwf the dw
+// accumulator packed like wf. parts selects dx and/or dw, db as in the other backward kernels.
+template<typename Dtype>
+void convBackwardBlocked(const Blob<Dtype>& din, const Blob<Dtype>& x, const Blob<Dtype>& w, Blob<Dtype>& dx, Blob<Dtype>& dw, Blob<Dtype>& db,
+	Dtype* wt, Dtype* dwf, const ConvShape& s, int parts = CONV_GRAD_ALL);
+
+// Max pooling on blocked Blobs, one vector max per window tap; taps (one byte per output lane, may be NULL)
+// gets the window tap of every max and relu clamps as in maxPoolForward. 2x2 and 3x3 windows run unrolled kernels.
+template<typename Dtype>
+void poolForwardBlocked(const Blob<Dtype>& x, Blob<Dtype>& out, unsigned char* taps, int Hp, int Wp, int stride, bool relu = false);
+
+// Sends each output gradient to the input its tap points at (same rule as the NCHW path)
+template<typename Dtype>
+void poolBackwardBlocked(const Blob<Dtype>& din, const unsigned char* taps, Blob<Dtype>& dx, int Hp, int Wp, int stride);
+
+// Average pooling on blocked Blobs: CBLOCK channels per vector, any window and stride
+template<typename Dtype>
+void avgPoolForwardBlocked(const Blob<Dtype>& x, Blob<Dtype>& out, int Hp, int Wp, int stride);
+template<typename Dtype>
+void avgPoolBackwardBlocked(const Blob<Dtype>& din, Blob<Dtype>& dx, int Hp, int Wp, int stride);
+
+// Global average pooling on blocked Blobs (out has the blocked shape of {N, C, 1, 1})
+template<typename Dtype>
+void globalAvgPoolForwardBlocked(const Blob<Dtype>& x, Blob<Dtype>& out);
+template<typename Dtype>
+void globalAvgPoolBackwardBlocked(const Blob<Dtype>& din, Blob<Dtype>& dx);
+
+#endif
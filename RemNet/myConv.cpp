@@ -0,0 +1,672 @@
+#include "myConv.hpp"
+#include "myThread.hpp"
+#include <cstring>
+using namespace std;
+using namespace arma;
+
+// Smallest size >= n (and >= 2) with no prime factor above 5, which the FFT handles with its fast radices
+static int fftSize(int n) {
+	for (n = std::max(n, 2);; n++) {
+		int m = n;
+		for (int p : {2, 3, 5})
+			while (m % p == 0)
+				m /= p;
+		if (m == 1)
+			return n;
+	}
+}
+
+ConvShape::ConvShape(const BlobShape& inShape, const BlobShape& wShape, int pad, int stride)
+	:C(inShape[1]), H(inShape[2]), W(inShape[3]), F(wShape[0]), Hw(wShape[2]), Ww(wShape[3]), pad(pad), stride(stride) {
+	Ho = (H + (pad << 1) - Hw) / stride + 1;
+	Wo = (W + (pad << 1) - Ww) / stride + 1;
+	FH = fftSize(H + (pad << 1));
+	FW = fftSize(W + (pad << 1));
+}
+
+// First and one-past-last output index whose input index o * stride + k - pad falls inside [0, len)
+static inline void validRange(int len, int k, const ConvShape& s, int out, int& lo, int& hi) {
+	lo = 0;
+	while (lo < out && lo * s.stride + k - s.pad < 0)
+		lo++;
+	hi = out;
+	while (hi > lo && (hi - 1) * s.stride + k - s.pad >= len)
+		hi--;
+}
+
+template<typename Dtype>
+void im2col(const Dtype* x, const ConvShape& s, Dtype* col) {
+	int P = s.P();
+	for (int c = 0; c < s.C; c++) {
+		const Dtype* xc = x + (size_t)c * s.H * s.W;
+		for (int kw = 0; kw < s.Ww; kw++) {
+			int wlo, whi;
+			validRange(s.W, kw, s, s.Wo, wlo, whi);
+			for (int kh = 0; kh < s.Hw; kh++) {
+				int hlo, hhi;
+				validRange(s.H, kh, s, s.Ho, hlo, hhi);
+				Dtype* dst = col + (size_t)((c * s.Ww + kw) * s.Hw + kh) * P;
+				for (int ow = 0; ow < s.Wo; ow++) {
+					Dtype* d = dst + (size_t)ow * s.Ho;
+					if (ow < wlo || ow >= whi || hlo >= hhi) {
+						std::fill(d, d + s.Ho, Dtype(0));
+						continue;
+					}
+					// One output column reads one input column (contiguous when stride is 1)
+					const Dtype* xcol = xc + (size_t)(ow * s.stride + kw - s.pad) * s.H + kh - s.pad;
+					std::fill(d, d + hlo, Dtype(0));
+					if (s.stride == 1)
+						memcpy(d + hlo, xcol + hlo, sizeof(Dtype) * (hhi - hlo));
+					else
+						for (int oh = hlo; oh < hhi; oh++)
+							d[oh] = xcol[oh * s.stride];
+					std::fill(d + hhi, d + s.Ho, Dtype(0));
+				}
+			}
+		}
+	}
+}
+
+template<typename Dtype>
+void col2im(const Dtype* col, const ConvShape& s, Dtype* dx) {
+	int P = s.P();
+	for (int c = 0; c < s.C; c++) {
+		Dtype* xc = dx + (size_t)c * s.H * s.W;
+		for (int kw = 0; kw < s.Ww; kw++) {
+			int wlo, whi;
+			validRange(s.W, kw, s, s.Wo, wlo, whi);
+			for (int kh = 0; kh < s.Hw; kh++) {
+				int hlo, hhi;
+				validRange(s.H, kh, s, s.Ho, hlo, hhi);
+				const Dtype* src = col + (size_t)((c * s.Ww + kw) * s.Hw + kh) * P;
+				for (int ow = wlo; ow < whi; ow++) {
+					// Entries that came from the padding are dropped
+					const Dtype* d = src + (size_t)ow * s.Ho;
+					Dtype* xcol = xc + (size_t)(ow * s.stride + kw - s.pad) * s.H + kh - s.pad;
+					if (s.stride == 1)
+						for (int oh = hlo; oh < hhi; oh++)
+							xcol[oh] += d[oh];
+					else
+						for (int oh = hlo; oh < hhi; oh++)
+							xcol[oh * s.stride] += d[oh];
+				}
+			}
+		}
+	}
+}
+
+template<typename Dtype>
+void convForwardGemm(const Blob<Dtype>& x, const Blob<Dtype>& w, const Blob<Dtype>& b, Blob<Dtype>& out,
+	Dtype* col, const ConvShape& s) {
+	int P = s.P();
+	int K = s.K();
+	// The weights are already a (K x F) column-major matrix: kernel f is column f
+	Mat<Dtype> Wm(const_cast<Dtype*>(w.memptr()), K, s.F, false, true);
+	parallelFor(x.getN(), [&](int n0, int n1, int t) {
+		Mat<Dtype> colM(col + (size_t)t * P * K, P, K, false, true);
+		for (int n = n0; n < n1; n++) {
+			im2col(x.sample(n), s, colM.memptr());
+			// Sample n of out is a (P x F) column-major matrix; start from the bias and let GEMM accumulate
+			Mat<Dtype> O(out.sample(n), P, s.F, false, true);
+			for (int f = 0; f < s.F; f++)
+				O.col(f).fill(b.sample(f)[0]);
+			O += colM * Wm;
+		}
+	});
+}
+
+template<typename Dtype>
+void convBackwardGemm(const Blob<Dtype>& din, const Blob<Dtype>& x, const Blob<Dtype>& w, Blob<Dtype>& dx, Blob<Dtype>& dw, Blob<Dtype>& db,
+	Dtype* col, Dtype* dcol, Dtype* acc, const ConvShape& s, int parts) {
+	int N = x.getN();
+	int P = s.P();
+	int K = s.K();
+	size_t PK = (size_t)P * K, KF = (size_t)K * s.F;
+	bool wantDx = parts & CONV_GRAD_DATA, wantDw = parts & CONV_GRAD_WEIGHTS;
+	Mat<Dtype> Wm(const_cast<Dtype*>(w.memptr()), K, s.F, false, true);
+
+	// 1. Every thread takes a run of samples with its own col, dcol and dw / db accumulator
+	int used = parallelFor(N, [&](int n0, int n1, int t) {
+		Mat<Dtype> colM(col + t * PK, P, K, false, true);
+		Mat<Dtype> dcolM(dcol + t * PK, P, K, false, true);
+		Dtype* dwt = acc + t * (KF + s.F);
+		Dtype* dbt = dwt + KF;
+		Mat<Dtype> dWm(dwt, K, s.F, false, true);
+		if (wantDw)
+			std::fill(dwt, dbt + s.F, Dtype(0));
+		for (int n = n0; n < n1; n++) {
+			Mat<Dtype> dO(const_cast<Dtype*>(din.sample(n)), P, s.F, false, true);
+			if (wantDw) {
+				// db: sum of every output-gradient column
+				for (int f = 0; f < s.F; f++) {
+					const Dtype* g = dO.colptr(f);
+					Dtype sum = 0;
+					for (int p = 0; p < P; p++)
+						sum += g[p];
+					dbt[f] += sum;
+				}
+				// dw += col^T * dout
+				im2col(x.sample(n), s, colM.memptr());
+				dWm += colM.t() * dO;
+			}
+			if (wantDx) {
+				// dx = col2im(dout * w^T)
+				Dtype* dxn = dx.sample(n);
+				std::fill(dxn, dxn + (size_t)s.C * s.H * s.W, Dtype(0));
+				dcolM = dO * Wm.t();
+				col2im(dcolM.memptr(), s, dxn);
+			}
+		}
+	});
+	if (!wantDw)
+		return;
+
+	// 2. dw and db are the sums of the accumulators in thread order, averaged over the batch
+	Dtype scale = Dtype(1.0 / N);
+	parallelFor((int)(KF + s.F), [&](int i0, int i1, int) {
+		for (int i = i0; i < i1; i++) {
+			Dtype sum = acc[i];
+			for (int t = 1; t < used; t++)
+				sum += acc[t * (KF + s.F) + i];
+			(i < (int)KF ? dw.memptr()[i] : db.memptr()[i - KF]) = sum * scale;
+		}
+	});
+}
+
+// 1-D Winograd F(2, 3) transforms, applied along both axes of a tile
+template<typename Dtype>
+static inline void transBT(const Dtype* d, int sd, Dtype* o, int so) { // B^T d (4 -> 4)
+	o[0] = d[0] - d[2 * sd];
+	o[so] = d[sd] + d[2 * sd];
+	o[2 * so] = d[2 * sd] - d[sd];
+	o[3 * so] = d[sd] - d[3 * sd];
+}
+template<typename Dtype>
+static inline void transB(const Dtype* d, int sd, Dtype* o, int so) { // B d (4 -> 4), adjoint of transBT
+	o[0] = d[0];
+	o[so] = d[sd] - d[2 * sd] + d[3 * sd];
+	o[2 * so] = d[sd] + d[2 * sd] - d[0];
+	o[3 * so] = -d[3 * sd];
+}
+template<typename Dtype>
+static inline void transG(const Dtype* g, int sg, Dtype* o, int so) { // G g (3 -> 4)
+	o[0] = g[0];
+	o[so] = (g[0] + g[sg] + g[2 * sg]) * Dtype(0.5);
+	o[2 * so] = (g[0] - g[sg] + g[2 * sg]) * Dtype(0.5);
+	o[3 * so] = g[2 * sg];
+}
+template<typename Dtype>
+static inline void transGT(const Dtype* u, int su, Dtype* o, int so) { // G^T u (4 -> 3), adjoint of transG
+	o[0] = u[0] + (u[su] + u[2 * su]) * Dtype(0.5);
+	o[so] = (u[su] - u[2 * su]) * Dtype(0.5);
+	o[2 * so] = (u[su] + u[2 * su]) * Dtype(0.5) + u[3 * su];
+}
+template<typename Dtype>
+static inline void transAT(const Dtype* m, int sm, Dtype* o, int so) { // A^T m (4 -> 2)
+	o[0] = m[0] + m[sm] + m[2 * sm];
+	o[so] = m[sm] - m[2 * sm] - m[3 * sm];
+}
+template<typename Dtype>
+static inline void transA(const Dtype* y, int sy, Dtype* o, int so) { // A y (2 -> 4), adjoint of transAT
+	o[0] = y[0];
+	o[so] = y[0] + y[sy];
+	o[2 * so] = y[0] - y[sy];
+	o[3 * so] = -y[sy];
+}
+
+// Tiles are stored column-major like the planes: t[j * rows + i] is row i, column j.
+// U(xi) for every (c, f), xi = j * 4 + i
+template<typename Dtype>
+static void winogradKernels(const Blob<Dtype>& w, Dtype* U, const ConvShape& s) {
+	size_t CF = (size_t)s.C * s.F;
+	parallelFor(s.F, [&](int f0, int f1, int) {
+		for (int f = f0; f < f1; f++)
+			for (int c = 0; c < s.C; c++) {
+				const Dtype* g = w.sample(f) + c * 9;
+				Dtype t[12], u[16];
+				for (int j = 0; j < 3; j++)
+					transG(g + j * 3, 1, t + j * 4, 1); // columns
+				for (int i = 0; i < 4; i++)
+					transG(t + i, 4, u + i, 4);         // rows
+				for (int xi = 0; xi < 16; xi++)
+					U[xi * CF + (size_t)f * s.C + c] = u[xi];
+			}
+	});
+}
+
+// V(xi)(r, c) = (B^T d B)(xi) for the 4x4 input tile d of every tile t and channel c,
+// V holds R rows per position and this sample's tiles start at row r0 (r = r0 + t)
+template<typename Dtype>
+static void winogradInput(const Dtype* x, Dtype* V, int R, int r0, const ConvShape& s) {
+	int TH = s.TH(), TW = s.TW();
+	size_t RC = (size_t)R * s.C;
+	for (int c = 0; c < s.C; c++) {
+		const Dtype* xc = x + (size_t)c * s.H * s.W;
+		for (int tw = 0; tw < TW; tw++)
+			for (int th = 0; th < TH; th++) {
+				Dtype d[16], t[16], v[16];
+				for (int j = 0; j < 4; j++) {
+					int iw = 2 * tw + j - s.pad;
+					for (int i = 0; i < 4; i++) {
+						int ih = 2 * th + i - s.pad;
+						d[j * 4 + i] = (iw >= 0 && iw < s.W && ih >= 0 && ih < s.H) ? xc[(size_t)iw * s.H + ih] : Dtype(0);
+					}
+				}
+				for (int j = 0; j < 4; j++)
+					transBT(d + j * 4, 1, t + j * 4, 1);
+				for (int i = 0; i < 4; i++)
+					transBT(t + i, 4, v + i, 4);
+				size_t base = (size_t)c * R + r0 + tw * TH + th;
+				for (int xi = 0; xi < 16; xi++)
+					V[xi * RC + base] = v[xi];
+			}
+	}
+}
+
+// dx += (B dV B^T) of every tile, dropping what falls into the padding
+template<typename Dtype>
+static void winogradInputAdjoint(const Dtype* dV, Dtype* dx, int R, int r0, const ConvShape& s) {
+	int TH = s.TH(), TW = s.TW();
+	size_t RC = (size_t)R * s.C;
+	for (int c = 0; c < s.C; c++) {
+		Dtype* xc = dx + (size_t)c * s.H * s.W;
+		for (int tw = 0; tw < TW; tw++)
+			for (int th = 0; th < TH; th++) {
+				Dtype v[16], t[16], d[16];
+				size_t base = (size_t)c * R + r0 + tw * TH + th;
+				for (int xi = 0; xi < 16; xi++)
+					v[xi] = dV[xi * RC + base];
+				for (int j = 0; j < 4; j++)
+					transB(v + j * 4, 1, t + j * 4, 1);
+				for (int i = 0; i < 4; i++)
+					transB(t + i, 4, d + i, 4);
+				for (int j = 0; j < 4; j++) {
+					int iw = 2 * tw + j - s.pad;
+					if (iw < 0 || iw >= s.W)
+						continue;
+					for (int i = 0; i < 4; i++) {
+						int ih = 2 * th + i - s.pad;
+						if (ih >= 0 && ih < s.H)
+							xc[(size_t)iw * s.H + ih] += d[j * 4 + i];
+					}
+				}
+			}
+	}
+}
+
+// out = (A^T M A) + b for every (tile, kernel) of one sample, the last tile row/column may be cut off
+template<typename Dtype>
+static void winogradOutput(const Dtype* M, int R, int r0, const Blob<Dtype>& b, Dtype* o, const ConvShape& s) {
+	int TH = s.TH(), TW = s.TW();
+	size_t RF = (size_t)R * s.F;
+	for (int f = 0; f < s.F; f++) {
+		Dtype bias = b.sample(f)[0];
+		Dtype* of = o + (size_t)f * s.Ho * s.Wo;
+		for (int tw = 0; tw < TW; tw++)
+			for (int th = 0; th < TH; th++) {
+				Dtype m[16], t[8], y[4];
+				size_t base = (size_t)f * R + r0 + tw * TH + th;
+				for (int xi = 0; xi < 16; xi++)
+					m[xi] = M[xi * RF + base];
+				for (int j = 0; j < 4; j++)
+					transAT(m + j * 4, 1, t + j * 2, 1);
+				for (int i = 0; i < 2; i++)
+					transAT(t + i, 2, y + i, 2);
+				for (int j = 0; j < 2 && 2 * tw + j < s.Wo; j++)
+					for (int i = 0; i < 2 && 2 * th + i < s.Ho; i++)
+						of[(size_t)(2 * tw + j) * s.Ho + 2 * th + i] = y[j * 2 + i] + bias;
+			}
+	}
+}
+
+// dM = A dY A^T for every (tile, kernel) of one sample (outputs cut off in forward contribute zero)
+template<typename Dtype>
+static void winogradOutputAdjoint(const Dtype* g, Dtype* M, int R, int r0, const ConvShape& s) {
+	int TH = s.TH(), TW = s.TW();
+	size_t RF = (size_t)R * s.F;
+	for (int f = 0; f < s.F; f++) {
+		const Dtype* gf = g + (size_t)f * s.Ho * s.Wo;
+		for (int tw = 0; tw < TW; tw++)
+			for (int th = 0; th < TH; th++) {
+				Dtype y[4] = {0, 0, 0, 0}, t[8], m[16];
+				for (int j = 0; j < 2 && 2 * tw + j < s.Wo; j++)
+					for (int i = 0; i < 2 && 2 * th + i < s.Ho; i++)
+						y[j * 2 + i] = gf[(size_t)(2 * tw + j) * s.Ho + 2 * th + i];
+				for (int j = 0; j < 2; j++)
+					transA(y + j * 2, 1, t + j * 4, 1);
+				for (int i = 0; i < 4; i++)
+					transA(t + i, 4, m + i, 4);
+				size_t base = (size_t)f * R + r0 + tw * TH + th;
+				for (int xi = 0; xi < 16; xi++)
+					M[xi * RF + base] = m[xi];
+			}
+	}
+}
+
+// One GEMM per transform position: O(xi) = op(L(xi)) * op(Rm(xi)), or O(xi) += L(xi)^T * Rm(xi) when accumulating.
+// The 16 positions are independent and go to different threads.
+template<typename Dtype>
+static void winogradGemms(Dtype* L, int lr, int lc, Dtype* Rm, int rr, int rc, Dtype* O, int orr, int orc, char mode) {
+	parallelFor(16, [&](int x0, int x1, int) {
+		for (int xi = x0; xi < x1; xi++) {
+			Mat<Dtype> A(L + (size_t)xi * lr * lc, lr, lc, false, true);
+			Mat<Dtype> B(Rm + (size_t)xi * rr * rc, rr, rc, false, true);
+			Mat<Dtype> Om(O + (size_t)xi * orr * orc, orr, orc, false, true);
+			if (mode == 'a')
+				Om += A.t() * B;
+			else if (mode == 't')
+				Om = A * B.t();
+			else
+				Om = A * B;
+		}
+	});
+}
+
+int winogradGroup(const ConvShape& s, int N) {
+	int g = (WINOGRAD_ROWS + s.T() - 1) / s.T();
+	return g < N ? g : N;
+}
+
+template<typename Dtype>
+void convForwardWinograd(const Blob<Dtype>& x, const Blob<Dtype>& w, const Blob<Dtype>& b, Blob<Dtype>& out,
+	Dtype* U, Dtype* V, Dtype* M, const ConvShape& s) {
+	int N = x.getN(), T = s.T();
+	int G = winogradGroup(s, N);
+	winogradKernels(w, U, s);
+	for (int n0 = 0; n0 < N; n0 += G) {
+		// 1. Transform the input tiles of G samples (each sample fills its own rows), then 16 GEMMs (G*T x C) * (C x F)
+		int g = std::min(G, N - n0), R = g * T;
+		parallelFor(g, [&](int i0, int i1, int) {
+			for (int i = i0; i < i1; i++)
+				winogradInput(x.sample(n0 + i), V, R, i * T, s);
+		});
+		winogradGemms(V, R, s.C, U, s.C, s.F, M, R, s.F, 'n');
+
+		// 2. Output transform
+		parallelFor(g, [&](int i0, int i1, int) {
+			for (int i = i0; i < i1; i++)
+				winogradOutput(M, R, i * T, b, out.sample(n0 + i), s);
+		});
+	}
+}
+
+template<typename Dtype>
+void convBackwardWinograd(const Blob<Dtype>& din, const Blob<Dtype>& x, const Blob<Dtype>& w, Blob<Dtype>& dx, Blob<Dtype>& dw, Blob<Dtype>& db,
+	Dtype* U, Dtype* V, Dtype* M, Dtype* dU, const ConvShape& s, int parts) {
+	int N = x.getN(), T = s.T();
+	int G = winogradGroup(s, N);
+	size_t CF = (size_t)s.C * s.F;
+	bool wantDx = parts & CONV_GRAD_DATA, wantDw = parts & CONV_GRAD_WEIGHTS;
+	if (wantDx)
+		winogradKernels(w, U, s);
+	if (wantDw)
+		std::fill(dU, dU + 16 * CF, Dtype(0));
+	for (int n0 = 0; n0 < N; n0 += G) {
+		int g = std::min(G, N - n0), R = g * T;
+		// 1. dM = A dY A^T and the input tiles V again, each sample in its own rows
+		parallelFor(g, [&](int i0, int i1, int) {
+			for (int i = i0; i < i1; i++) {
+				winogradOutputAdjoint(din.sample(n0 + i), M, R, i * T, s);
+				if (wantDw)
+					winogradInput(x.sample(n0 + i), V, R, i * T, s);
+			}
+		});
+
+		// 2. dU += V^T dM (C x F), then dV = dM U^T (R x C) overwrites V and goes back to dx
+		if (wantDw)
+			winogradGemms(V, R, s.C, M, R, s.F, dU, s.C, s.F, 'a');
+		if (wantDx) {
+			winogradGemms(M, R, s.F, U, s.C, s.F, V, R, s.C, 't');
+			parallelFor(g, [&](int i0, int i1, int) {
+				for (int i = i0; i < i1; i++) {
+					Dtype* dxn = dx.sample(n0 + i);
+					std::fill(dxn, dxn + (size_t)s.C * s.H * s.W, Dtype(0));
+					winogradInputAdjoint(V, dxn, R, i * T, s);
+				}
+			});
+		}
+	}
+	if (!wantDw)
+		return;
+
+	// 3. dw = G^T dU G and db = sums of dY, per kernel and averaged over the batch like the other paths
+	Dtype scale = Dtype(1.0 / N);
+	parallelFor(s.F, [&](int f0, int f1, int) {
+		for (int f = f0; f < f1; f++) {
+			for (int c = 0; c < s.C; c++) {
+				Dtype u[16], t[12], gw[9];
+				for (int xi = 0; xi < 16; xi++)
+					u[xi] = dU[xi * CF + (size_t)f * s.C + c];
+				for (int j = 0; j < 4; j++)
+					transGT(u + j * 4, 1, t + j * 3, 1);
+				for (int i = 0; i < 3; i++)
+					transGT(t + i, 3, gw + i, 3);
+				Dtype* o = dw.sample(f) + c * 9;
+				for (int k = 0; k < 9; k++)
+					o[k] = gw[k] * scale;
+			}
+			Dtype sum = 0;
+			for (int n = 0; n < N; n++) {
+				const Dtype* gf = din.sample(n) + (size_t)f * s.P();
+				Dtype acc = 0;
+				for (int p = 0; p < s.P(); p++)
+					acc += gf[p];
+				sum += acc;
+			}
+			db.memptr()[f] = sum * scale;
+		}
+	});
+}
+
+// The complex planes live in Dtype buffers (std::complex is laid out as two Dtype), plane i starts at 2*i*FH*FW
+template<typename Dtype>
+static inline std::complex<Dtype>* cxPlane(Dtype* base, size_t i, const ConvShape& s) {
+	return reinterpret_cast<std::complex<Dtype>*>(base) + i * s.FH * s.FW;
+}
+
+// In-place 2-D FFT of FH x FW column-major complex planes. Built on Armadillo's 1-D engine so the
+// twiddle factors are computed once per pass instead of once per plane, and the rows are gathered one
+// at a time instead of transposing the plane. The inverse is not scaled by 1/(FH*FW).
+template<typename Dtype, bool inverse>
+class Fft2 {
+public:
+	typedef std::complex<Dtype> cx;
+	Fft2(const ConvShape& s) :FH(s.FH), FW(s.FW), colEng(s.FH), rowEng(s.FW), line(std::max(s.FH, s.FW) << 1) {}
+	// Transform the first cols columns (the others must be zero and stay zero), then only the
+	// first rows rows (the others are not read afterwards)
+	void run(cx* p, int cols, int rows) {
+		cx* l = line.memptr();
+		cx* r = l + std::max(FH, FW);
+		for (int w = 0; w < cols; w++) {
+			colEng.run(l, p + (size_t)w * FH);
+			memcpy(p + (size_t)w * FH, l, sizeof(cx) * FH);
+		}
+		for (int h = 0; h < rows; h++) {
+			for (int w = 0; w < FW; w++)
+				r[w] = p[(size_t)w * FH + h];
+			rowEng.run(l, r);
+			for (int w = 0; w < FW; w++)
+				p[(size_t)w * FH + h] = l[w];
+		}
+	}
+private:
+	int FH, FW;
+	fft_engine<cx, inverse> colEng, rowEng;
+	podarray<cx> line; // output line and gathered row
+};
+
+// acc += a . b (or a . conj(b)) over n complex values, written out on the real and imaginary parts
+// because std::complex products go through the slow inf/nan-checking path on some compilers
+template<typename Dtype, bool conjB>
+static inline void cmulAdd(std::complex<Dtype>* acc, const std::complex<Dtype>* a, const std::complex<Dtype>* b, size_t n) {
+	Dtype* o = reinterpret_cast<Dtype*>(acc);
+	const Dtype* x = reinterpret_cast<const Dtype*>(a);
+	const Dtype* y = reinterpret_cast<const Dtype*>(b);
+	for (size_t i = 0; i < (n << 1); i += 2) {
+		Dtype ar = x[i], ai = x[i + 1];
+		Dtype br = y[i], bi = conjB ? -y[i + 1] : y[i + 1];
+		o[i] += ar * br - ai * bi;
+		o[i + 1] += ar * bi + ai * br;
+	}
+}
+
+// Kf(f, c) = fft2 of kernel (f, c), zero-extended from its top-left corner
+template<typename Dtype>
+static void fftKernels(const Blob<Dtype>& w, Dtype* Kf, Fft2<Dtype, false>& fft, const ConvShape& s) {
+	size_t FP = (size_t)s.FH * s.FW;
+	for (int f = 0; f < s.F; f++)
+		for (int c = 0; c < s.C; c++) {
+			const Dtype* g = w.sample(f) + (size_t)c * s.Hw * s.Ww;
+			std::complex<Dtype>* K = cxPlane(Kf, (size_t)f * s.C + c, s);
+			std::fill(K, K + FP, std::complex<Dtype>(0));
+			for (int kw = 0; kw < s.Ww; kw++)
+				for (int kh = 0; kh < s.Hw; kh++)
+					K[(size_t)kw * s.FH + kh] = g[(size_t)kw * s.Hw + kh];
+			fft.run(K, s.Ww, s.FH);
+		}
+}
+
+// Xf(c) = fft2 of channel c of one sample, placed at (pad, pad) so the zero border is the padding
+template<typename Dtype>
+static void fftInput(const Dtype* x, Dtype* Xf, Fft2<Dtype, false>& fft, const ConvShape& s) {
+	size_t FP = (size_t)s.FH * s.FW;
+	for (int c = 0; c < s.C; c++) {
+		const Dtype* xc = x + (size_t)c * s.H * s.W;
+		std::complex<Dtype>* X = cxPlane(Xf, c, s);
+		std::fill(X, X + FP, std::complex<Dtype>(0));
+		for (int w = 0; w < s.W; w++)
+			for (int h = 0; h < s.H; h++)
+				X[(size_t)(w + s.pad) * s.FH + h + s.pad] = xc[(size_t)w * s.H + h];
+		fft.run(X, s.W + s.pad, s.FH);
+	}
+}
+
+template<typename Dtype>
+void convForwardFft(const Blob<Dtype>& x, const Blob<Dtype>& w, const Blob<Dtype>& b, Blob<Dtype>& out,
+	Dtype* Kf, Dtype* Xf, Dtype* buf, const ConvShape& s) {
+	typedef std::complex<Dtype> cx;
+	size_t FP = (size_t)s.FH * s.FW;
+	cx* acc = reinterpret_cast<cx*>(buf);
+	Fft2<Dtype, false> fft(s);
+	Fft2<Dtype, true> ifft(s);
+	Dtype scale = Dtype(1.0 / FP);
+
+	// 1. The kernels are transformed once for the whole batch
+	fftKernels(w, Kf, fft, s);
+	for (int n = 0; n < x.getN(); n++) {
+		// 2. Transform the input planes of this sample
+		fftInput(x.sample(n), Xf, fft, s);
+
+		// 3. Correlation in the frequency domain: sum over channels of X(c) . conj(K(f, c)),
+		// transformed back only as far as the rows that hold outputs
+		Dtype* o = out.sample(n);
+		for (int f = 0; f < s.F; f++) {
+			std::fill(acc, acc + FP, cx(0));
+			for (int c = 0; c < s.C; c++) {
+				cmulAdd<Dtype, true>(acc, cxPlane(Xf, c, s), cxPlane(Kf, (size_t)f * s.C + c, s), FP);
+			}
+			ifft.run(acc, s.FW, (s.Ho - 1) * s.stride + 1);
+			Dtype bias = b.sample(f)[0];
+			Dtype* of = o + (size_t)f * s.Ho * s.Wo;
+			for (int ow = 0; ow < s.Wo; ow++)
+				for (int oh = 0; oh < s.Ho; oh++)
+					of[(size_t)ow * s.Ho + oh] = acc[(size_t)ow * s.stride * s.FH + oh * s.stride].real() * scale + bias;
+		}
+	}
+}
+
+template<typename Dtype>
+void convBackwardFft(const Blob<Dtype>& din, const Blob<Dtype>& x, const Blob<Dtype>& w, Blob<Dtype>& dx, Blob<Dtype>& dw, Blob<Dtype>& db,
+	Dtype* Kf, Dtype* Xf, Dtype* Yf, Dtype* dWf, Dtype* buf, const ConvShape& s, int parts) {
+	typedef std::complex<Dtype> cx;
+	int N = x.getN();
+	size_t FP = (size_t)s.FH * s.FW;
+	bool wantDx = parts & CONV_GRAD_DATA, wantDw = parts & CONV_GRAD_WEIGHTS;
+	cx* acc = reinterpret_cast<cx*>(buf);
+	Fft2<Dtype, false> fft(s);
+	Fft2<Dtype, true> ifft(s);
+	Dtype scale = Dtype(1.0 / FP);
+	cx* dW = cxPlane(dWf, 0, s);
+	Dtype* dbp = db.memptr();
+	if (wantDw) {
+		std::fill(dW, dW + FP * s.F * s.C, cx(0));
+		db = 0;
+	}
+
+	if (wantDx)
+		fftKernels(w, Kf, fft, s);
+	for (int n = 0; n < N; n++) {
+		// 1. Transform the input planes and the output gradients spread onto the stride grid, db = sums of dY
+		if (wantDw)
+			fftInput(x.sample(n), Xf, fft, s);
+		const Dtype* g = din.sample(n);
+		for (int f = 0; f < s.F; f++) {
+			const Dtype* gf = g + (size_t)f * s.Ho * s.Wo;
+			cx* Y = cxPlane(Yf, f, s);
+			std::fill(Y, Y + FP, cx(0));
+			Dtype sum = 0;
+			for (int ow = 0; ow < s.Wo; ow++)
+				for (int oh = 0; oh < s.Ho; oh++) {
+					Dtype v = gf[(size_t)ow * s.Ho + oh];
+					Y[(size_t)ow * s.stride * s.FH + oh * s.stride] = v;
+					sum += v;
+				}
+			if (wantDw)
+				dbp[f] += sum;
+			fft.run(Y, (s.Wo - 1) * s.stride + 1, s.FH);
+		}
+
+		// 2. dW(f, c) += conj(dY(f)) . X(c), kept in the frequency domain until the batch is done
+		for (int f = 0; f < s.F && wantDw; f++) {
+			const cx* Y = cxPlane(Yf, f, s);
+			for (int c = 0; c < s.C; c++) {
+				cmulAdd<Dtype, true>(dW + ((size_t)f * s.C + c) * FP, cxPlane(Xf, c, s), Y, FP);
+			}
+		}
+
+		// 3. dx(c) = sum over kernels of dY(f) . K(f, c), cropped back from the padded plane
+		Dtype* dxn = dx.sample(n);
+		for (int c = 0; c < s.C && wantDx; c++) {
+			std::fill(acc, acc + FP, cx(0));
+			for (int f = 0; f < s.F; f++)
+				cmulAdd<Dtype, false>(acc, cxPlane(Yf, f, s), cxPlane(Kf, (size_t)f * s.C + c, s), FP);
+			ifft.run(acc, s.FW, s.H + s.pad);
+			Dtype* dxc = dxn + (size_t)c * s.H * s.W;
+			for (int w = 0; w < s.W; w++)
+				for (int h = 0; h < s.H; h++)
+					dxc[(size_t)w * s.H + h] = acc[(size_t)(w + s.pad) * s.FH + h + s.pad].real() * scale;
+		}
+	}
+
+	// 4. One inverse transform per kernel for dw, averaged over the batch like the other paths
+	if (!wantDw)
+		return;
+	scale *= Dtype(1.0 / N);
+	for (int f = 0; f < s.F; f++)
+		for (int c = 0; c < s.C; c++) {
+			cx* D = dW + ((size_t)f * s.C + c) * FP;
+			ifft.run(D, s.FW, s.Hw);
+			Dtype* o = dw.sample(f) + (size_t)c * s.Hw * s.Ww;
+			for (int kw = 0; kw < s.Ww; kw++)
+				for (int kh = 0; kh < s.Hw; kh++)
+					o[(size_t)kw * s.Hw + kh] = D[(size_t)kw * s.FH + kh].real() * scale;
+		}
+	db *= 1.0 / N;
+}
+
+template void im2col<float>(const float*, const ConvShape&, float*);
+template void im2col<double>(const double*, const ConvShape&, double*);
+template void convForwardGemm<float>(const Blob<float>&, const Blob<float>&, const Blob<float>&, Blob<float>&, float*, const ConvShape&);
+template void convForwardGemm<double>(const Blob<double>&, const Blob<double>&, const Blob<double>&, Blob<double>&, double*, const ConvShape&);
+template void col2im<float>(const float*, const ConvShape&, float*);
+template void col2im<double>(const double*, const ConvShape&, double*);
+template void convBackwardGemm<float>(const Blob<float>&, const Blob<float>&, const Blob<float>&, Blob<float>&, Blob<float>&, Blob<float>&, float*, float*, float*, const ConvShape&, int);
+template void convBackwardGemm<double>(const Blob<double>&, const Blob<double>&, const Blob<double>&, Blob<double>&, Blob<double>&, Blob<double>&, double*, double*, double*, const ConvShape&, int);
+template void convForwardWinograd<float>(const Blob<float>&, const Blob<float>&, const Blob<float>&, Blob<float>&, float*, float*, float*, const ConvShape&);
+template void convForwardWinograd<double>(const Blob<double>&, const Blob<double>&, const Blob<double>&, Blob<double>&, double*, double*, double*, const ConvShape&);
+template void convBackwardWinograd<float>(const Blob<float>&, const Blob<float>&, const Blob<float>&, Blob<float>&, Blob<float>&, Blob<float>&, float*, float*, float*, float*, const ConvShape&, int);
+template void convBackwardWinograd<double>(const Blob<double>&, const Blob<double>&, const Blob<double>&, Blob<double>&, Blob<double>&, Blob<double>&, double*, double*, double*, double*, const ConvShape&, int);
+template void convForwardFft<float>(const Blob<float>&, const Blob<float>&, const Blob<float>&, Blob<float>&, float*, float*, float*, const ConvShape&);
+template void convForwardFft<double>(const Blob<double>&, const Blob<double>&, const Blob<double>&, Blob<double>&, double*, double*, double*, const ConvShape&);
+template void convBackwardFft<float>(const Blob<float>&, const Blob<float>&, const Blob<float>&, Blob<float>&, Blob<float>&, Blob<float>&, float*, float*, float*, float*, float*, const ConvShape&, int);
+template void convBackwardFft<double>(const Blob<double>&, const Blob<double>&, const Blob<double>&, Blob<double>&, Blob<double>&, Blob<double>&, double*, double*, double*, double*, double*, const ConvShape&, int);
@@ -0,0 +1,101 @@
+#ifndef __MYCONV_HPP__
+#define __MYCONV_HPP__
+#include "myBlob.hpp"
+
+// Geometry of one convolution layer, shared by the convolution kernels below
+struct ConvShape {
+	int C, H, W;    // input channels, height, width
+	int F, Hw, Ww;  // number of kernels, kernel height, kernel width
+	int pad, stride;
+	int Ho, Wo;     // output height, width
+	ConvShape(const BlobShape& inShape, const BlobShape& wShape, int pad, int stride);
+	inline int K() const { return C * Hw * Ww; } // length of one unfolded receptive field
+	inline int P() const { return Ho * Wo; }     // output pixels per sample
+	// Winograd F(2x2, 3x3): each 2x2 output tile is computed from a 4x4 input tile
+	inline int TH() const { return (Ho + 1) / 2; } // tile rows
+	inline int TW() const { return (Wo + 1) / 2; } // tile columns
+	inline int T() const { return TH() * TW(); }   // tiles per sample
+	// FFT convolution: planes are transformed at a size covering the padded input, so no valid output wraps around
+	int FH, FW;
+};
+
+// Winograd F(2x2, 3x3) applies to 3x3 kernels with stride 1 (any padding)
+inline bool winogradEligible(const ConvShape& s) { return s.Hw == 3 && s.Ww == 3 && s.stride == 1; }
+
+// FFT convolution pays off for large kernels on large feature maps (stride 1, where no output is thrown away)
+#define FFT_MIN_KERNEL 7
+#define FFT_MIN_MAP 16
+inline bool fftEligible(const ConvShape& s) {
+	return s.stride == 1 && s.Hw >= FFT_MIN_KERNEL && s.Ww >= FFT_MIN_KERNEL && s.H + (s.pad << 1) >= FFT_MIN_MAP && s.W + (s.pad << 1) >= FFT_MIN_MAP;
+}
+
+// Samples whose tiles share one set of Winograd GEMMs, so that each GEMM has about WINOGRAD_ROWS rows
+#define WINOGRAD_ROWS 256
+int winogradGroup(const ConvShape& s, int N);
+
+// Largest relative difference from the reference path at which the Winograd result is accepted
+template<typename Dtype>
+inline double winogradTolerance() { return sizeof(Dtype) == sizeof(float) ? 1e-3 : 1e-8; }
+
+// Parts of the gradient a backward kernel computes, so that dx and dw can come from different algorithms.
+// A part left out is not written.
+#define CONV_GRAD_DATA 1    // dx
+#define CONV_GRAD_WEIGHTS 2 // dw and db
+#define CONV_GRAD_ALL (CONV_GRAD_DATA | CONV_GRAD_WEIGHTS)
+
+// Unfold one sample x (C, H, W) into col, a column-major (P x K) matrix:
+// col(p, k) is the input seen by kernel tap k at output pixel p, zero inside the padding.
+// Rows follow the output memory order (p = ow * Ho + oh) and columns follow the weight
+// memory order (k = c * Hw*Ww + kw * Hw + kh), so a conv is one GEMM with no reshuffling.
+template<typename Dtype>
+void im2col(const Dtype* x, const ConvShape& s, Dtype* col);
+
+// Adjoint of im2col: adds every entry of col back onto the input pixel it was read from (dx must be zeroed first)
+template<typename Dtype>
+void col2im(const Dtype* col, const ConvShape& s, Dtype* dx);
+
+// The gemm, Winograd and blocked kernels split their work over the threads of ThreadPool (myThread.hpp):
+// samples, kernels or transform positions, whichever a stage has independent outputs for. FFT runs on one thread.
+
+// out = x * w + b through im2col and one GEMM per sample (col holds one P*K buffer per thread)
+template<typename Dtype>
+void convForwardGemm(const Blob<Dtype>& x, const Blob<Dtype>& w, const Blob<Dtype>& b, Blob<Dtype>& out,
+	Dtype* col, const ConvShape& s);
+
+// dx, dw and db (dw and db averaged over the batch) with two GEMMs per sample:
+// dw += col^T * dout, and dcol = dout * w^T scattered back by col2im. Every thread has a P*K col and dcol
+// and a K*F + F accumulator for the dw and db of its samples; the accumulators are summed in thread order.
+template<typename Dtype>
+void convBackwardGemm(const Blob<Dtype>& din, const Blob<Dtype>& x, const Blob<Dtype>& w, Blob<Dtype>& dx, Blob<Dtype>& dw, Blob<Dtype>& db,
+	Dtype* col, Dtype* dcol, Dtype* acc, const ConvShape& s, int parts = CONV_GRAD_ALL);
+
+// Winograd F(2x2, 3x3) forward: Y = A^T [ (G g G^T) . (B^T d B) ] A for every tile.
+// The element-wise products summed over channels become 16 GEMMs per sample:
+// M(xi) = V(xi) * U(xi), with U the 16 (C x F) transformed kernels, V the 16 (R x C)
+// transformed input tiles and M the 16 (R x F) products, R = winogradGroup() * T rows
+// (buffers of 16*C*F, 16*R*C and 16*R*F).
+template<typename Dtype>
+void convForwardWinograd(const Blob<Dtype>& x, const Blob<Dtype>& w, const Blob<Dtype>& b, Blob<Dtype>& out,
+	Dtype* U, Dtype* V, Dtype* M, const ConvShape& s);
+
+// Exact adjoint of the forward transform: dU(xi) = V(xi)^T * dM(xi) and dV(xi) = dM(xi) * U(xi)^T,
+// mapped back to dw through G and to dx through B (dU is one more 16*C*F buffer)
+template<typename Dtype>
+void convBackwardWinograd(const Blob<Dtype>& din, const Blob<Dtype>& x, const Blob<Dtype>& w, Blob<Dtype>& dx, Blob<Dtype>& dw, Blob<Dtype>& db,
+	Dtype* U, Dtype* V, Dtype* M, Dtype* dU, const ConvShape& s, int parts = CONV_GRAD_ALL);
+
+// FFT forward: out(f) = real(ifft2(sum_c X(c) . conj(K(f, c)))) sampled at the output pixels, plus the bias.
+// Kf holds the F*C transformed kernels (2*F*C*FH*FW values, computed once and shared by the whole batch),
+// Xf the C transformed input planes of one sample (2*C*FH*FW) and buf one complex work plane (2*FH*FW).
+template<typename Dtype>
+void convForwardFft(const Blob<Dtype>& x, const Blob<Dtype>& w, const Blob<Dtype>& b, Blob<Dtype>& out,
+	Dtype* Kf, Dtype* Xf, Dtype* buf, const ConvShape& s);
+
+// FFT backward: dx(c) = ifft2(sum_f dY(f) . K(f, c)) and dw(f, c) = ifft2(sum_n conj(dY(f)) . X(c)),
+// with dY the output gradient spread back onto the stride grid. dw stays in the frequency domain (dWf, 2*F*C*FH*FW)
+// until every sample has been added; Yf holds the F transformed gradient planes of one sample (2*F*FH*FW).
+template<typename Dtype>
+void convBackwardFft(const Blob<Dtype>& din, const Blob<Dtype>& x, const Blob<Dtype>& w, Blob<Dtype>& dx, Blob<Dtype>& dw, Blob<Dtype>& db,
+	Dtype* Kf, Dtype* Xf, Dtype* Yf, Dtype* dWf, Dtype* buf, const ConvShape& s, int parts = CONV_GRAD_ALL);
+
+#endif
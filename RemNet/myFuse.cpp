@@ -0,0 +1,133 @@
+#include "myFuse.hpp"
+#include "mySimd.hpp"
+#include <cmath>
+#include <algorithm>
+
+template<typename Dtype>
+void reluMaskForward(Dtype* y, unsigned char* mask, size_t n) {
+	const Dtype clip = RELU_CLIP;
+	if (mask)
+		for (size_t i = 0; i < n; i++) {
+			Dtype v = y[i] > 0 ? y[i] : Dtype(0);
+			mask[i] = v > 0 && v < clip;
+			y[i] = v < clip ? v : clip;
+		}
+	else
+		for (size_t i = 0; i < n; i++) {
+			Dtype v = y[i] > 0 ? y[i] : Dtype(0);
+			y[i] = v < clip ? v : clip;
+		}
+}
+
+template<typename Dtype>
+void reluMaskBackward(const Dtype* din, const unsigned char* mask, Dtype* dx, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dx[i] = mask[i] ? din[i] : Dtype(0);
+}
+
+template<typename Dtype>
+void reluForward(const Dtype* x, Dtype* y, size_t n) {
+	// Whole vectors through max / min, compilers tend to branch on the scalar clamp
+	typedef BlockVec<Dtype> V;
+	const Dtype clip = RELU_CLIP;
+	const V lo = V::zero(), hi = V::set(clip);
+	size_t i = 0;
+	for (; i + CBLOCK <= n; i += CBLOCK) {
+		V v = V::load(x + i);
+		v.max(lo);
+		v.min(hi);
+		v.store(y + i);
+	}
+	for (; i < n; i++) {
+		y[i] = std::min(std::max(x[i], Dtype(0)), clip);
+	}
+}
+
+template<typename Dtype>
+void reluBackward(const Dtype* x, const Dtype* din, Dtype* dx, size_t n) {
+	const Dtype clip = RELU_CLIP;
+	for (size_t i = 0; i < n; i++)
+		dx[i] = din[i] * Dtype((x[i] > 0) & (x[i] < clip));
+}
+
+template<typename Dtype>
+void tanhBackward(const Dtype* y, const Dtype* din, Dtype* dx, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dx[i] = din[i] * (1 - y[i] * y[i]);
+}
+
+template<typename Dtype>
+void dropoutForward(const Dtype* x, Dtype* y, unsigned char* mask, const Dtype* r, double rate, size_t n) {
+	const Dtype t = (Dtype)rate, scale = (Dtype)(1 / (1 - rate));
+	if (r)
+		for (size_t i = 0; i < n; i++)
+			mask[i] = !(r[i] > t);
+	for (size_t i = 0; i < n; i++)
+		y[i] = x[i] * (scale * mask[i]);
+}
+
+template<typename Dtype>
+void dropoutBackward(const unsigned char* mask, const Dtype* din, Dtype* dx, double rate, size_t n) {
+	const Dtype scale = (Dtype)(1 / (1 - rate));
+	for (size_t i = 0; i < n; i++)
+		dx[i] = din[i] * (scale * mask[i]);
+}
+
+template<typename Dtype>
+void channelAffine(const Dtype* x, Dtype* y, const Dtype* a, const Dtype* b, size_t j, size_t n, size_t HW) {
+	if (HW == 1) { // one value per channel (FC outputs)
+		for (size_t i = 0; i < n; i++)
+			y[i] = a[j + i] * x[i] + b[j + i];
+		return;
+	}
+	// one run of values per channel
+	for (size_t i = 0; i < n;) {
+		size_t c = (j + i) / HW, e = std::min(n, (c + 1) * HW - j);
+		const Dtype ac = a[c], bc = b[c];
+		for (; i < e; i++)
+			y[i] = ac * x[i] + bc;
+	}
+}
+
+template<typename Dtype>
+void channelAffineBackward(const Dtype* x, const Dtype* din, Dtype* dx, const Dtype* a, Dtype* da, Dtype* db, Dtype s, size_t j, size_t n, size_t HW) {
+	for (size_t i = 0; i < n;) {
+		size_t c = (j + i) / HW, e = std::min(n, (c + 1) * HW - j);
+		const Dtype ac = a[c];
+		Dtype sx = 0, sd = 0;
+		for (; i < e; i++) {
+			sx += din[i] * x[i];
+			sd += din[i];
+			dx[i] = ac * din[i];
+		}
+		da[c] += s * sx;
+		db[c] += s * sd;
+	}
+}
+
+template<typename Dtype>
+void bnInference(const Dtype* x, Dtype* y, const Dtype* m, const Dtype* std, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		y[i] = (x[i] + m[i]) / std[i];
+}
+
+template void reluMaskForward<float>(float*, unsigned char*, size_t);
+template void reluMaskForward<double>(double*, unsigned char*, size_t);
+template void reluMaskBackward<float>(const float*, const unsigned char*, float*, size_t);
+template void reluMaskBackward<double>(const double*, const unsigned char*, double*, size_t);
+template void reluForward<float>(const float*, float*, size_t);
+template void reluForward<double>(const double*, double*, size_t);
+template void reluBackward<float>(const float*, const float*, float*, size_t);
+template void reluBackward<double>(const double*, const double*, double*, size_t);
+template void tanhBackward<float>(const float*, const float*, float*, size_t);
+template void tanhBackward<double>(const double*, const double*, double*, size_t);
+template void dropoutForward<float>(const float*, float*, unsigned char*, const float*, double, size_t);
+template void dropoutForward<double>(const double*, double*, unsigned char*, const double*, double, size_t);
+template void dropoutBackward<float>(const unsigned char*, const float*, float*, double, size_t);
+template void dropoutBackward<double>(const unsigned char*, const double*, double*, double, size_t);
+template void channelAffine<float>(const float*, float*, const float*, const float*, size_t, size_t, size_t);
+template void channelAffine<double>(const double*, double*, const double*, const double*, size_t, size_t, size_t);
+template void channelAffineBackward<float>(const float*, const float*, float*, const float*, float*, float*, float, size_t, size_t, size_t);
+template void channelAffineBackward<double>(const double*, const double*, double*, const double*, double*, double*, double, size_t, size_t, size_t);
+template void bnInference<float>(const float*, float*, const float*, const float*, size_t);
+template void bnInference<double>(const double*, double*, const double*, const double*, size_t);
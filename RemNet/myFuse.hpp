@@ -0,0 +1,54 @@
+#ifndef __MYFUSE_HPP__
+#define __MYFUSE_HPP__
+#include <cstddef>
+#include "myBlob.hpp"
+
+// Kernels of the layer groups the Net fuses into one layer (see Net::fuseLayers)
+
+// Conv output bytes per chunk of a fused Conv forward, so that ReLU and pooling read a chunk that is still cached
+#define FUSE_CHUNK_BYTES (512 * 1024)
+
+// ReLU in place that keeps what backward needs: y = min(max(y, 0), RELU_CLIP) and mask[i] = (0 < y[i] < RELU_CLIP) (mask may be NULL)
+template<typename Dtype>
+void reluMaskForward(Dtype* y, unsigned char* mask, size_t n);
+
+// dx = din where the mask is set, 0 elsewhere
+template<typename Dtype>
+void reluMaskBackward(const Dtype* din, const unsigned char* mask, Dtype* dx, size_t n);
+
+// Pointwise layers a ChainLayer runs together
+enum ChainOpType { CHAIN_RELU, CHAIN_TANH, CHAIN_DROPOUT, CHAIN_SCALE, CHAIN_BN };
+
+// Elements of a sample a chain takes through all of its layers at a time (one tile per layer stays in L1/L2)
+#define FUSE_TILE 2048
+
+// The tile kernels below read x (or din) and write y (or dx) over n values; the two may be the same array.
+// y = min(max(x, 0), RELU_CLIP), and back: dx = din where 0 < x < RELU_CLIP, else 0
+template<typename Dtype>
+void reluForward(const Dtype* x, Dtype* y, size_t n);
+template<typename Dtype>
+void reluBackward(const Dtype* x, const Dtype* din, Dtype* dx, size_t n);
+
+// Tanh (forward is vecTanh) taken back from its output: dx = din * (1 - y^2)
+template<typename Dtype>
+void tanhBackward(const Dtype* y, const Dtype* din, Dtype* dx, size_t n);
+
+// Dropout as DropoutLayer does it: keep x[i] (scaled by 1 / (1 - rate)) where r[i] <= rate, recording that in mask.
+// With r NULL the mask of an earlier call is applied again.
+template<typename Dtype>
+void dropoutForward(const Dtype* x, Dtype* y, unsigned char* mask, const Dtype* r, double rate, size_t n);
+template<typename Dtype>
+void dropoutBackward(const unsigned char* mask, const Dtype* din, Dtype* dx, double rate, size_t n);
+
+// Per channel y = a[c] * x + b[c] over the n values starting at offset j of a sample (channel c = j / HW)
+template<typename Dtype>
+void channelAffine(const Dtype* x, Dtype* y, const Dtype* a, const Dtype* b, size_t j, size_t n, size_t HW);
+// dx = a[c] * din, and da[c] += s * sum(din * x), db[c] += s * sum(din)
+template<typename Dtype>
+void channelAffineBackward(const Dtype* x, const Dtype* din, Dtype* dx, const Dtype* a, Dtype* da, Dtype* db, Dtype s, size_t j, size_t n, size_t HW);
+
+// Inference BN with the running statistics of BNLayer (negative mean, std), given from the same sample offset: y = (x + m) / std
+template<typename Dtype>
+void bnInference(const Dtype* x, Dtype* y, const Dtype* m, const Dtype* std, size_t n);
+
+#endif
@@ -1,5 +1,11 @@
 #include "myLayer.hpp"
+#include "myTune.hpp"
+#include "myThread.hpp"
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <opencv2/opencv.hpp>
 
 using namespace std;
@@ -28,8 +34,37 @@ void visiable(const cube& in, vector<cv::Mat_<double>>& vec_mat) {
 	return;
 }
 
+template<typename Dtype>
+void ensureBlob(shared_ptr<Blob<Dtype>>& blob, const BlobShape& shape, int type) {
+	if (!blob || blob->size() != shape) {
+		blob.reset(new Blob<Dtype>(shape, type));
+		return;
+	}
+	if (type == TZEROS)
+		(*blob) = 0;
+	else if (type == TONES)
+		(*blob) = 1;
+}
+
+template<typename Dtype>
+Blob<Dtype>& Layer<Dtype>::getScratch(int i, const BlobShape& shape) {
+	// Normally bound from the Net workspace; standalone layers allocate it here once
+	if ((int)scratch.size() <= i)
+		scratch.resize(i + 1);
+	ensureBlob(scratch[i], shape);
+	return *scratch[i];
+}
+
+// Per-thread loss sums of the loss layers, zeroed. Kept by the calling thread, so a batch costs no allocation
+static double* lossPartials() {
+	static thread_local vector<double> parts;
+	parts.assign(ThreadPool::get().threads(), 0);
+	return parts.data();
+}
+
 ///////////////////////////////////initLayer/////////////////////////////////////////
-void ConvLayer::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) {
+template<typename Dtype>
+void ConvLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
 	// 1. Get conv kernel shape (F, C, H, W)
 	int tF = param.conv_kernels;
 	int tC = inShape[1];
@@ -38,28 +73,36 @@ void ConvLayer::initLayer(const vector<int>& inShape, const string& lname, vecto
 	
 	// 2. Initializes the Blob that stores weight and bias (in[1], in[2]) = (w, b)
 	if (!in[1]) { // The blob that stores weight is not empty
-		in[1].reset(new Blob(tF, tC, tH, tW, TRANDN));
+		in[1].reset(new Blob<Dtype>(tF, tC, tH, tW, TRANDN));
 		if (param.conv_weight_init == "msra")
 			(*in[1]) *= std::sqrt(2 / (double)(inShape[1] * inShape[2] * inShape[3]));
 		else
 			(*in[1]) *= 1e-2;
 	}
 	if (!in[2]) { // The blob that stores bias is not empty
-		in[2].reset(new Blob(tF, 1, 1, 1, TRANDN));
+		in[2].reset(new Blob<Dtype>(tF, 1, 1, 1, TRANDN));
 		(*in[2]) *= 1e-2;	
 	}
 	return;
 }
 
-void ReLULayer::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) {
+template<typename Dtype>
+void ReLULayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
 	return;
 }
 
-void PoolLayer::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) {
+template<typename Dtype>
+void PoolLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
 	return;
 }
 
-void FCLayer::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) {
+template<typename Dtype>
+void GlobalAvgPoolLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
+	return;
+}
+
+template<typename Dtype>
+void FCLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
 		// 1. Get FC shape(F, C, H, W)
 		int tF = param.fc_kernels;
 		int tC = inShape[1];
@@ -68,18 +111,19 @@ void FCLayer::initLayer(const vector<int>& inShape, const string& lname, vector<
 
 		// 2. Initializes the Blob that stores weight and bias (in[1], in[2]) = (w, b)
 		if (!in[1]) { // The blob that stores weight is not empty
-			in[1].reset(new Blob(tF, tC, tH, tW, TRANDN));
+			in[1].reset(new Blob<Dtype>(tF, tC, tH, tW, TRANDN));
 			if (param.fc_weight_init == "msra")
 				(*in[1]) *= std::sqrt(2 / (double)(inShape[1] * inShape[2] * inShape[3]));
 			else
 				(*in[1]) *= 1e-2;
 		}
 		if (!in[2])// The blob that stores bias is not empty
-			in[2].reset(new Blob(tF, 1, 1, 1, TZEROS));
+			in[2].reset(new Blob<Dtype>(tF, 1, 1, 1, TZEROS));
 		return;
 }
 ///////////////////////////////////calcShape/////////////////////////////////////////
-void ConvLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+template<typename Dtype>
+void ConvLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
 	// 1. Get input Blob shape
 	int Ni = inShape[0];
 	int Ci = inShape[1];
@@ -98,6 +142,10 @@ void ConvLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, con
 	int Co = tF;
 	int Ho = (Hi + (tP << 1) - tH) / tS + 1;
 	int Wo = (Wi + (tP << 1) - tW) / tS + 1;
+	if (param.fuse_pool) { // the output of the fused max Pool
+		Ho = (Ho - param.pool_height) / param.pool_stride + 1;
+		Wo = (Wo - param.pool_width) / param.pool_stride + 1;
+	}
 
 	// 4. Assign the size of the output Blob
 	outShape[0] = No;
@@ -107,12 +155,14 @@ void ConvLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, con
 	return;
 }
 
-void ReLULayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+template<typename Dtype>
+void ReLULayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
 	outShape.assign(inShape.begin(), inShape.end()); // Copy inShape to outShape (deep copy)
 	return;
 }
 
-void PoolLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+template<typename Dtype>
+void PoolLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
 	// 1. Get input Blob shape
 	int Ni = inShape[0];
 	int Ci = inShape[1];
@@ -137,7 +187,17 @@ void PoolLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, con
 	outShape[3] = Wo;
 	return;
 }
-void FCLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+template<typename Dtype>
+void GlobalAvgPoolLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+	outShape[0] = inShape[0];
+	outShape[1] = inShape[1];
+	outShape[2] = 1;
+	outShape[3] = 1;
+	return;
+}
+
+template<typename Dtype>
+void FCLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
 	// 1. Get input Blob shape
 	int No = inShape[0]; // batch size
 	int Co = param.fc_kernels; // current layer nn numbers
@@ -151,10 +211,253 @@ void FCLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const
 	outShape[3] = Wo;
 	return;
 }
+///////////////////////////////////calcScratch/////////////////////////////////////////
+// Conv algorithms in the order their scratch groups are laid out
+static const char* convAlgos[] = {"direct", "gemm", "winograd", "fft", "blocked"};
+
+// Number of scratch Blobs in the group of a conv algorithm (see ConvLayer::algoScratchShapes)
+static int convAlgoScratch(const string& algo, const Param& param) {
+	if (algo == "winograd" || algo == "fft")
+		return 5;
+	if (algo == "blocked")
+		return param.block ? 3 : 6;
+	return algo == "gemm" ? 3 : 2;
+}
+
+// Scratch i of the gemm group, one slice per thread: the unfolded input, its gradient (both P x K), and the dw and db accumulator
+static BlobShape gemmScratchShape(int i, const ConvShape& s) {
+	int T = ThreadPool::get().threads();
+	return i < 2 ? BlobShape{T, 1, s.P(), s.K()} : BlobShape{T, 1, 1, s.K() * s.F + s.F};
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param) {
+	ConvShape s(inShape, {param.conv_kernels, inShape[1], param.conv_height, param.conv_width}, param.conv_pad, param.conv_stride);
+	for (const char* algo : convAlgos)
+		if (usesAlgo(algo, s, param))
+			algoScratchShapes(algo, s, inShape[0], shapes, param);
+	if (param.fuse_relu) {
+		BlobShape convShape, outShape;
+		fusedShapes(s, inShape[0], convShape, outShape, param);
+		shapes.push_back(convShape);
+		shapes.push_back(poolTapShape<Dtype>(param.fuse_pool ? outShape : convShape));
+	}
+	return;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::algoScratchShapes(const string& algo, const ConvShape& s, int N, vector<vector<int>>& shapes, const Param& param) const {
+	if (algo == "direct") {
+		// padded input and padded input gradient
+		vector<int> padShape = {N, s.C, s.H + (s.pad << 1), s.W + (s.pad << 1)};
+		shapes.push_back(padShape);
+		shapes.push_back(padShape);
+	} else if (algo == "gemm") {
+		// per thread: unfolded input of one sample and its gradient, both (P x K), and the dw and db of its samples
+		for (int i = 0; i < 3; i++)
+			shapes.push_back(gemmScratchShape(i, s));
+	} else if (algo == "winograd") {
+		// U, V, M and dU for the 16 transform positions, then the gemm reference of one sample for the accuracy check
+		shapes.push_back({16, 1, s.C, s.F});
+		shapes.push_back({16, 1, winogradGroup(s, N), s.T() * s.C});
+		shapes.push_back({16, 1, winogradGroup(s, N), s.T() * s.F});
+		shapes.push_back({16, 1, s.C, s.F});
+		shapes.push_back({1, s.F, s.Ho, s.Wo});
+	} else if (algo == "fft") {
+		// transformed kernels, input planes of one sample, gradient planes of one sample, kernel gradients and a work plane
+		shapes.push_back({s.F, s.C, s.FH, s.FW << 1});
+		shapes.push_back({1, s.C, s.FH, s.FW << 1});
+		shapes.push_back({1, s.F, s.FH, s.FW << 1});
+		shapes.push_back({s.F, s.C, s.FH, s.FW << 1});
+		shapes.push_back({1, 1, s.FH, s.FW << 1});
+	} else if (algo == "blocked") {
+		// weights packed by kernel block and by channel block, and the packed dw accumulator
+		int kk = s.Hw * s.Ww;
+		shapes.push_back({1, blockedChannels(s.F), s.C, kk});
+		shapes.push_back({1, blockedChannels(s.C), s.F, kk});
+		shapes.push_back({1, blockedChannels(s.F), s.C, kk});
+		// in an NCHW net: NCHWc copies of x, of out (or its gradient) and of dx
+		if (!param.block) {
+			shapes.push_back(blockedShape({N, s.C, s.H, s.W}));
+			shapes.push_back(blockedShape({N, s.F, s.Ho, s.Wo}));
+			shapes.push_back(blockedShape({N, s.C, s.H, s.W}));
+		}
+	}
+}
+
+template<typename Dtype>
+bool ConvLayer<Dtype>::usesAlgo(const string& algo, const ConvShape& s, const Param& param) const {
+	for (int pass = CONV_FORWARD; pass <= CONV_BACKWARD_WEIGHTS; pass++)
+		if (requestedAlgo(s, param, (ConvPass)pass) == algo)
+			return true;
+	// Winograd checks itself against (and falls back to) gemm
+	return algo == "gemm" && usesAlgo("winograd", s, param);
+}
+
+template<typename Dtype>
+Blob<Dtype>& ConvLayer<Dtype>::algoScratch(const string& algo, int i, const BlobShape& shape, const ConvShape& s, const Param& param) {
+	// The group of algo starts after the groups of the algorithms listed before it that the layer uses
+	int base = 0;
+	for (const char* a : convAlgos) {
+		if (algo == a)
+			break;
+		if (usesAlgo(a, s, param))
+			base += convAlgoScratch(a, param);
+	}
+	return this->getScratch(base + i, shape);
+}
+
+template<typename Dtype>
+shared_ptr<Blob<Dtype>> ConvLayer<Dtype>::fuseScratch(int i, const BlobShape& shape, const ConvShape& s, const Param& param) {
+	int base = 0;
+	for (const char* a : convAlgos)
+		if (usesAlgo(a, s, param))
+			base += convAlgoScratch(a, param);
+	this->getScratch(base + i, shape);
+	return this->scratch[base + i];
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::fusedShapes(const ConvShape& s, int N, BlobShape& convShape, BlobShape& outShape, const Param& param) {
+	// Storage shapes of the conv output and of the layer output (the pooled one when a Pool is fused, as in calcShape)
+	convShape = {N, s.F, s.Ho, s.Wo};
+	outShape = convShape;
+	if (param.fuse_pool) {
+		outShape[2] = (s.Ho - param.pool_height) / param.pool_stride + 1;
+		outShape[3] = (s.Wo - param.pool_width) / param.pool_stride + 1;
+	}
+	if (param.block) {
+		convShape = blockedShape(convShape);
+		outShape = blockedShape(outShape);
+	}
+}
+
+template<typename Dtype>
+string ConvLayer<Dtype>::requestedAlgo(const ConvShape& s, const Param& param, ConvPass pass) const {
+	if (param.block)
+		return "blocked"; // the NCHWc layout leaves no choice
+	if (!param.conv_tuned[pass].empty())
+		return param.conv_tuned[pass];
+	if (param.conv_algo == "direct" || param.conv_algo == "gemm" || param.conv_algo == "fft" || param.conv_algo == "blocked")
+		return param.conv_algo;
+	// "auto" and "winograd": Winograd where it applies
+	if (winogradEligible(s))
+		return "winograd";
+	// "auto" only: FFT for large kernels on large maps
+	if (param.conv_algo != "winograd" && fftEligible(s))
+		return "fft";
+	return "gemm";
+}
+
+template<typename Dtype>
+string ConvLayer<Dtype>::pickAlgo(const ConvShape& s, const Param& param, ConvPass pass) const {
+	string algo = requestedAlgo(s, param, pass);
+	return algo == "winograd" && wino_state < 0 ? "gemm" : algo;
+}
+
+template<typename Dtype>
+void PoolLayer<Dtype>::calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param) {
+	// window tap of every max, recorded by forward for backward (one byte per output value)
+	vector<int> outShape(4);
+	calcShape(inShape, outShape, param);
+	shapes.push_back(poolTapShape<Dtype>(param.block ? blockedShape(outShape) : BlobShape(outShape)));
+	return;
+}
+
+template<typename Dtype>
+void AvgPoolLayer<Dtype>::calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param) {
+	// column sum of the NCHW kernels, one per thread (the blocked ones need none)
+	if (!param.block)
+		shapes.push_back({1, 1, ThreadPool::get().threads(), inShape[2]});
+	return;
+}
+
+template<typename Dtype>
+void DropoutLayer<Dtype>::calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param) {
+	shapes.push_back(inShape); // drop mask, kept from forward to backward
+	return;
+}
 ///////////////////////////////////forward///////////////////////////////////
-void ConvLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) {
-	if (out)
-		out.reset();
+template<typename Dtype>
+void ConvLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	// The channel count comes from the weights, an NCHWc input has it rounded up
+	ConvShape s({in[0]->getN(), in[1]->getC(), in[0]->getH(), in[0]->getW()}, in[1]->size(), param.conv_pad, param.conv_stride);
+	if (param.fuse_relu)
+		forwardFused(pickAlgo(s, param, CONV_FORWARD), in, out, param, mode);
+	else
+		forwardWith(pickAlgo(s, param, CONV_FORWARD), in, out, param);
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::forwardFused(const string& algo, const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	// 1. With a fused Pool the conv output goes to scratch, otherwise straight to out; backward needs the taps or the mask
+	int N = in[0]->getN();
+	ConvShape s({N, in[1]->getC(), in[0]->getH(), in[0]->getW()}, in[1]->size(), param.conv_pad, param.conv_stride);
+	BlobShape convShape, outShape;
+	fusedShapes(s, N, convShape, outShape, param);
+	ensureBlob(out, outShape);
+	shared_ptr<Blob<Dtype>> y = param.fuse_pool ? fuseScratch(0, convShape, s, param) : out;
+	unsigned char* mask = NULL;
+	if (mode == "TRAIN")
+		mask = reinterpret_cast<unsigned char*>(fuseScratch(1, poolTapShape<Dtype>(param.fuse_pool ? outShape : convShape), s, param)->memptr());
+
+	// 2. gemm and the NCHWc kernel run a few samples at a time, so ReLU and pooling read a conv output that is still
+	// cached (FUSE_CHUNK_BYTES for each thread's cache); the other algorithms keep whole-batch state (scratch sized by N,
+	// transformed kernels) and run in one go
+	size_t xSample = (size_t)in[0]->getC() * s.H * s.W;
+	size_t ySample = (size_t)convShape[1] * s.Ho * s.Wo;
+	size_t oSample = (size_t)outShape[1] * outShape[2] * outShape[3];
+	int chunk = N;
+	if (algo == "gemm" || (algo == "blocked" && param.block))
+		chunk = std::max(1, (int)(FUSE_CHUNK_BYTES / (ySample * sizeof(Dtype)))) * ThreadPool::get().threads();
+	for (int n0 = 0, n; n0 < N; n0 += n) {
+		n = std::min(chunk, N - n0);
+		if (chunk >= N)
+			forwardWith(algo, in, y, param);
+		else {
+			while (n > 1 && in[0]->sample(n0 + n - 1) != in[0]->sample(n0) + (n - 1) * xSample)
+				n--; // a chunk may not cross the wrap-around of a batch view
+			Blob<Dtype> xc(const_cast<Dtype*>(in[0]->sample(n0)), {n, in[0]->getC(), s.H, s.W});
+			Blob<Dtype> yc(y->sample(n0), {n, convShape[1], s.Ho, s.Wo});
+			if (algo == "gemm")
+				convForwardGemm(xc, *in[1], *in[2], yc, algoScratch("gemm", 0, gemmScratchShape(0, s), s, param).memptr(), s);
+			else
+				convForwardBlocked(xc, *in[1], *in[2], yc, algoScratch("blocked", 0, {1, blockedChannels(s.F), s.C, s.Hw * s.Ww}, s, param).memptr(), s);
+		}
+
+		// 3. ReLU, and max pooling, of the chunk (ReLU commutes with max, so the pool clamps its outputs instead)
+		if (param.fuse_pool) {
+			Blob<Dtype> yc(y->sample(n0), {n, convShape[1], s.Ho, s.Wo});
+			Blob<Dtype> oc(out->sample(n0), {n, outShape[1], outShape[2], outShape[3]});
+			unsigned char* taps = mask ? mask + n0 * oSample : NULL;
+			if (param.block)
+				poolForwardBlocked(yc, oc, taps, param.pool_height, param.pool_width, param.pool_stride, true);
+			else
+				maxPoolForward(yc, oc, taps, param.pool_height, param.pool_width, param.pool_stride, true);
+		} else
+			parallelFor(n, [&](int i0, int i1, int) {
+				reluMaskForward(y->sample(n0 + i0), mask ? mask + (n0 + i0) * ySample : NULL, (i1 - i0) * ySample);
+			});
+	}
+	return;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::forwardWith(const string& algo, const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param) {
+	if (algo == "blocked")
+		forwardBlocked(in, out, param);
+	else if (algo == "direct")
+		forwardDirect(in, out, param);
+	else if (algo == "winograd")
+		forwardWinograd(in, out, param);
+	else if (algo == "fft")
+		forwardFft(in, out, param);
+	else
+		forwardGemm(in, out, param);
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::forwardDirect(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param) {
 	// 1. Get related parametersinput, conv kernel, output
 	assert(in[0]->getC() == in[1]->getC());
 	int N = in[0]->getN();   // The number of cubes in the input Blob
@@ -170,20 +473,27 @@ void ConvLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& ou
 	int Wo = (Wx + (param.conv_pad << 1) - Ww) / param.conv_stride + 1; // conved Blob width
 
 	// 2. Padding
-	Blob padX = in[0]->pad(param.conv_pad);
+	ConvShape s(in[0]->size(), in[1]->size(), param.conv_pad, param.conv_stride);
+	Blob<Dtype>& padX = algoScratch("direct", 0, {N, C, Hx + (param.conv_pad << 1), Wx + (param.conv_pad << 1)}, s, param);
+	in[0]->padTo(padX, param.conv_pad);
 
 
 	// 3. Convlution
-	out.reset(new Blob(N, F, Ho, Wo));
+	ensureBlob(out, {N, F, Ho, Wo});
+	int Hp = padX.getH(), HWp = Hp * padX.getW(), HWw = Hw * Ww;
 	for (int n = 0; n < N; n++) {
 		for (int f = 0; f < F; f++) {
 			for (int hh = 0; hh < Ho; hh++) {
 				for (int ww = 0; ww < Wo; ww++) {
-					cube window = padX[n](span(hh * param.conv_stride, hh * param.conv_stride + Hw - 1),
-										  span(ww * param.conv_stride, ww * param.conv_stride + Ww - 1),
-						                  span::all);
-					// out = wx+b
-					(*out)[n](hh, ww, f) = accu(window % (*in[1])[f]) + as_scalar((*in[2])[f]);
+					// out = wx+b, summed over the window in place (copying it out would allocate for every position)
+					const Dtype* window = padX.sample(n) + (size_t)(ww * param.conv_stride) * Hp + hh * param.conv_stride;
+					const Dtype* wf = in[1]->sample(f);
+					Dtype sum = 0;
+					for (int k = 0; k < C; k++)
+						for (int j = 0; j < Ww; j++)
+							for (int i = 0; i < Hw; i++)
+								sum += window[(size_t)k * HWp + j * Hp + i] * wf[k * HWw + j * Hw + i];
+					(*out)[n](hh, ww, f) = sum + in[2]->sample(f)[0];
 				}
 			}
 		}
@@ -193,17 +503,108 @@ void ConvLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& ou
  	return;
 }
 
-void ReLULayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) {
-	if (out)
-		out.reset();
-	out.reset(new Blob(*in[0]));
-	out->maxIn(0);
+template<typename Dtype>
+void ConvLayer<Dtype>::forwardGemm(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param) {
+	// 1. Output shape and the unfolded-input buffer
+	ConvShape s(in[0]->size(), in[1]->size(), param.conv_pad, param.conv_stride);
+	ensureBlob(out, {in[0]->getN(), s.F, s.Ho, s.Wo});
+	Blob<Dtype>& col = algoScratch("gemm", 0, gemmScratchShape(0, s), s, param);
+
+	// 2. out = im2col(x) * w + b, one GEMM per sample (padding is handled by im2col)
+	convForwardGemm(*in[0], *in[1], *in[2], *out, col.memptr(), s);
+	return;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::forwardWinograd(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param) {
+	// 1. Output shape and the transform buffers
+	ConvShape s(in[0]->size(), in[1]->size(), param.conv_pad, param.conv_stride);
+	ensureBlob(out, {in[0]->getN(), s.F, s.Ho, s.Wo});
+	Blob<Dtype>& U = algoScratch("winograd", 0, {16, 1, s.C, s.F}, s, param);
+	Blob<Dtype>& V = algoScratch("winograd", 1, {16, 1, winogradGroup(s, in[0]->getN()), s.T() * s.C}, s, param);
+	Blob<Dtype>& M = algoScratch("winograd", 2, {16, 1, winogradGroup(s, in[0]->getN()), s.T() * s.F}, s, param);
+	convForwardWinograd(*in[0], *in[1], *in[2], *out, U.memptr(), V.memptr(), M.memptr(), s);
+	if (wino_state != 0)
+		return;
+
+	// 2. First call: compare the first sample with the gemm result, fall back to gemm if it is off
+	Blob<Dtype>& ref = algoScratch("winograd", 4, {1, s.F, s.Ho, s.Wo}, s, param);
+	Blob<Dtype> x0(in[0]->sample(0), {1, s.C, s.H, s.W});
+	Blob<Dtype>& col = algoScratch("gemm", 0, gemmScratchShape(0, s), s, param);
+	convForwardGemm(x0, *in[1], *in[2], ref, col.memptr(), s);
+	const Dtype* y = out->sample(0);
+	const Dtype* r = ref.memptr();
+	double err = 0, mag = 0;
+	for (size_t i = 0; i < (size_t)s.F * s.P(); i++) {
+		err = std::max(err, std::abs((double)y[i] - (double)r[i]));
+		mag = std::max(mag, std::abs((double)r[i]));
+	}
+	err /= std::max(mag, 1e-12);
+	if (err <= winogradTolerance<Dtype>()) {
+		wino_state = 1;
+		return;
+	}
+	cout << "Winograd relative error " << err << " exceeds tolerance, falling back to gemm" << endl;
+	wino_state = -1;
+	forwardGemm(in, out, param);
 	return;
 }
 
-void PoolLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) {
-	if (out)
-		out.reset();
+template<typename Dtype>
+void ConvLayer<Dtype>::forwardBlocked(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param) {
+	// 1. In the NCHWc segment of a net the input is already blocked (its channel count padded), elsewhere it is converted here
+	ConvShape s({in[0]->getN(), in[1]->getC(), in[0]->getH(), in[0]->getW()}, in[1]->size(), param.conv_pad, param.conv_stride);
+	BlobShape outShape = {in[0]->getN(), s.F, s.Ho, s.Wo};
+	Blob<Dtype>& wf = algoScratch("blocked", 0, {1, blockedChannels(s.F), s.C, s.Hw * s.Ww}, s, param);
+	const Blob<Dtype>* x = in[0].get();
+	Blob<Dtype>* y;
+	if (param.block) {
+		assert(in[0]->getC() == blockedChannels(s.C));
+		ensureBlob(out, blockedShape(outShape));
+		y = out.get();
+	} else {
+		Blob<Dtype>& xb = algoScratch("blocked", 3, blockedShape(in[0]->size()), s, param);
+		toBlocked(*in[0], xb);
+		x = &xb;
+		y = &algoScratch("blocked", 4, blockedShape(outShape), s, param);
+	}
+
+	// 2. Register-tiled direct convolution, output NCHWc
+	convForwardBlocked(*x, *in[1], *in[2], *y, wf.memptr(), s);
+	if (!param.block) {
+		ensureBlob(out, outShape);
+		fromBlocked(*y, *out);
+	}
+	return;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::forwardFft(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param) {
+	// 1. Output shape and the frequency-domain buffers (complex planes stored as pairs of Dtype)
+	ConvShape s(in[0]->size(), in[1]->size(), param.conv_pad, param.conv_stride);
+	ensureBlob(out, {in[0]->getN(), s.F, s.Ho, s.Wo});
+	Blob<Dtype>& Kf = algoScratch("fft", 0, {s.F, s.C, s.FH, s.FW << 1}, s, param);
+	Blob<Dtype>& Xf = algoScratch("fft", 1, {1, s.C, s.FH, s.FW << 1}, s, param);
+	Blob<Dtype>& buf = algoScratch("fft", 4, {1, 1, s.FH, s.FW << 1}, s, param);
+
+	// 2. Kernels transformed once for the batch, then one pointwise product per (channel, kernel)
+	convForwardFft(*in[0], *in[1], *in[2], *out, Kf.memptr(), Xf.memptr(), buf.memptr(), s);
+	return;
+}
+
+template<typename Dtype>
+void ReLULayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	ensureBlob(out, in[0]->size());
+	size_t chw = (size_t)in[0]->getC() * in[0]->getH() * in[0]->getW();
+	parallelFor(in[0]->getN(), [&](int n0, int n1, int) { // clipped as Blob::maxIn does
+		for (int n = n0; n < n1; n++)
+			reluForward(in[0]->sample(n), out->sample(n), chw);
+	});
+	return;
+}
+
+template<typename Dtype>
+void PoolLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
 	// 1. Get related parameters (input, pooling kernel, output)
 	int N = in[0]->getN();   // The number of cubes in the input Blob
 	int C = in[0]->getC();   // The number of channels in the input Blob
@@ -216,24 +617,52 @@ void PoolLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& ou
 	int Ho = (Hx - Hw) / param.pool_stride + 1; // Pooled blob height
 	int Wo = (Wx - Ww) / param.pool_stride + 1; // Pooled Blob width
 
-	// 2. Pool
-	out.reset(new Blob(N, C, Ho, Wo));
-	for (int n = 0; n < N; n++)
-		for (int c = 0; c < C; c++)
-			for (int hh = 0; hh < Ho; hh++)
-				for (int ww = 0; ww < Wo; ww++)
-					(*out)[n](hh, ww, c) = (*in[0])[n](span(hh * param.pool_stride, hh * param.pool_stride + Hw - 1),
-						span(ww * param.pool_stride, ww * param.pool_stride + Ww - 1),
-						span(c, c)).max();
+	// 2. Pool, keeping the window tap of every max when training so backward does not search again
+	ensureBlob(out, {N, C, Ho, Wo});
+	unsigned char* taps = NULL;
+	if (mode == "TRAIN")
+		taps = reinterpret_cast<unsigned char*>(this->getScratch(0, poolTapShape<Dtype>(out->size())).memptr());
+	if (param.block) // NCHWc: C already counts the padding channels
+		poolForwardBlocked(*in[0], *out, taps, Hw, Ww, param.pool_stride);
+	else
+		maxPoolForward(*in[0], *out, taps, Hw, Ww, param.pool_stride);
 	return;
 }
 
-void FCLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) {
+template<typename Dtype>
+void AvgPoolLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	int Ho = (in[0]->getH() - param.pool_height) / param.pool_stride + 1;
+	int Wo = (in[0]->getW() - param.pool_width) / param.pool_stride + 1;
+	ensureBlob(out, {in[0]->getN(), in[0]->getC(), Ho, Wo});
+	if (param.block)
+		avgPoolForwardBlocked(*in[0], *out, param.pool_height, param.pool_width, param.pool_stride);
+	else
+		avgPoolForward(*in[0], *out, this->getScratch(0, {1, 1, ThreadPool::get().threads(), in[0]->getH()}).memptr(), param.pool_height, param.pool_width, param.pool_stride);
+	return;
+}
 
+template<typename Dtype>
+void GlobalAvgPoolLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	ensureBlob(out, {in[0]->getN(), in[0]->getC(), 1, 1});
+	if (param.block)
+		globalAvgPoolForwardBlocked(*in[0], *out);
+	else
+		globalAvgPoolForward(*in[0], *out);
+	return;
+}
 
+// Number of samples from n on (up to end) that lie back to back in both a and b: a batch view wraps around once
+template<typename Dtype>
+static int contiguousRun(const Blob<Dtype>& a, const Blob<Dtype>& b, int n, int end) {
+	size_t sa = (size_t)a.getC() * a.getH() * a.getW(), sb = (size_t)b.getC() * b.getH() * b.getW();
+	int m = end - n;
+	while (m > 1 && (a.sample(n + m - 1) != a.sample(n) + (m - 1) * sa || b.sample(n + m - 1) != b.sample(n) + (m - 1) * sb))
+		m--;
+	return m;
+}
 
-	if (out)
-		out.reset();
+template<typename Dtype>
+void FCLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
 	// 1. Get related parameters (input, full connection kernel, output)
 
 	int N = in[0]->getN();   // The number of cubes in the input Blob
@@ -250,19 +679,26 @@ void FCLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out,
 	int Ho = 1;
 	int Wo = 1;
 
-	// 3. FC
-	out.reset(new Blob(N, F, Ho, Wo));
-
-	for (int n = 0; n < N; n++) 
-		for (int f = 0; f < F; f++) 
-			(*out)[n](0, 0, f) = accu((*in[0])[n] % (*in[1])[f]) + as_scalar((*in[2])[f]);
+	// 3. FC as GEMMs: each run of contiguous samples is a (K x n) matrix x, w a (K x F) one and out the
+	//    (F x n) matrix out = w^T * x + b, each thread taking a range of the columns
+	ensureBlob(out, {N, F, Ho, Wo});
+	int K = C * Hx * Wx;
+	Mat<Dtype> Wm(const_cast<Dtype*>(in[1]->memptr()), K, F, false, true);
+	Col<Dtype> b(const_cast<Dtype*>(in[2]->memptr()), F, false, true);
+	parallelFor(N, [&](int n0, int n1, int) {
+		for (int i = n0, n; i < n1; i += n) {
+			n = contiguousRun(*in[0], *out, i, n1);
+			Mat<Dtype> X(const_cast<Dtype*>(in[0]->sample(i)), K, n, false, true);
+			Mat<Dtype> O(out->sample(i), F, n, false, true);
+			O = Wm.t() * X;
+			O.each_col() += b;
+		}
+	});
 	return;
 }
 
-void SoftmaxLossLayer::softmax_cross_entropy_with_logits(const vector<shared_ptr<Blob>>& in, double& loss, shared_ptr<Blob>& dout) {
-
-	if (dout)
-		dout.reset();
+template<typename Dtype>
+void SoftmaxLossLayer<Dtype>::softmax_cross_entropy_with_logits(const vector<shared_ptr<Blob<Dtype>>>& in, double& loss, shared_ptr<Blob<Dtype>>& dout) {
 
 	// 1. Get related parameters 
 	int N = in[0]->getN();
@@ -271,108 +707,205 @@ void SoftmaxLossLayer::softmax_cross_entropy_with_logits(const vector<shared_ptr
 	int Wx = in[0]->getW();
 	assert(Hx == 1 && Wx == 1);
 	
-	dout.reset(new Blob(N, C, Hx, Wx)); // (N, C, 1, 1)
-	double loss_ = 0;
-	for (int i = 0; i < N; i++) {
-		// softmax
-		cube prob = arma::exp((*in[0])[i]) / arma::accu(arma::exp((*in[0])[i]));
-		loss_ += (-arma::accu((*in[1])[i] % arma::log(prob)));
-		// Gradient expression derivation
-		(*dout)[i] = prob - (*in[1])[i]; // Calculate the error signal generated by each sample (reverse gradient)
-
-	}
-	loss = loss_ / N;
+	ensureBlob(dout, {N, C, Hx, Wx}); // (N, C, 1, 1)
+	// Each thread sums the loss of its samples, the partial sums are added in thread order
+	double* loss_ = lossPartials();
+	int parts = parallelFor(N, [&](int i0, int i1, int t) {
+		for (int i = i0; i < i1; i++) {
+			// softmax of the logits shifted by their max, so e^x cannot overflow; log(prob) = x - max - log(sum)
+			const Dtype* x = in[0]->sample(i);
+			const Dtype* label = in[1]->sample(i);
+			Dtype* prob = dout->sample(i);
+			Dtype m = *std::max_element(x, x + C);
+			for (int c = 0; c < C; c++)
+				prob[c] = x[c] - m;
+			vecExp(prob, prob, C);
+			Dtype sum = 0;
+			for (int c = 0; c < C; c++)
+				sum += prob[c];
+			double lsum = std::log((double)sum);
+			for (int c = 0; c < C; c++) {
+				loss_[t] -= label[c] * (x[c] - m - lsum);
+				// Gradient expression derivation
+				prob[c] = prob[c] / sum - label[c]; // Calculate the error signal generated by each sample (reverse gradient)
+			}
+		}
+	});
+	loss = 0;
+	for (int t = 0; t < parts; t++)
+		loss += loss_[t];
+	loss /= N;
 	return;
 }
 
 ///////////////////////////////////backward///////////////////////////////////
-void FCLayer::backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-	vector<shared_ptr<Blob>>& grads, const Param& param) {
+template<typename Dtype>
+void FCLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
 	
 
 	// dx, dw, db
-	grads[0].reset(new Blob(cache[0]->size(), TZEROS));
-	grads[1].reset(new Blob(cache[1]->size(), TZEROS));
-	grads[2].reset(new Blob(cache[2]->size(), TZEROS));
+	ensureBlob(grads[0], cache[0]->size());
+	ensureBlob(grads[1], cache[1]->size());
+	ensureBlob(grads[2], cache[2]->size());
 
 	int N = grads[0]->getN();
 	int F = grads[1]->getN();
 	assert(F == cache[1]->getN());
 
-	for (int n = 0; n < N; n++) {
-		for (int f = 0; f < F; f++) {
-			// dx
-			(*grads[0])[n] += (*din)[n](0, 0, f) * (*cache[1])[f];
-			// dw
-			(*grads[1])[f] += (*din)[n](0, 0, f)  * (*cache[0])[n] / N;
-			// db
-			(*grads[2])[f] += (*din)[n](0, 0, f) / N;
+	// GEMMs on the same (K x n), (K x F) and (F x n) views of each run of contiguous samples as forward:
+	// dx = w * dout, split over the samples, and dw = x * dout^T / N, db = row sums of dout / N, split over the kernels
+	int K = grads[0]->getC() * grads[0]->getH() * grads[0]->getW();
+	Mat<Dtype> Wm(const_cast<Dtype*>(cache[1]->memptr()), K, F, false, true);
+	parallelFor(N, [&](int n0, int n1, int) {
+		for (int i = n0, n; i < n1; i += n) {
+			n = contiguousRun(*din, *grads[0], i, n1);
+			Mat<Dtype> dO(const_cast<Dtype*>(din->sample(i)), F, n, false, true);
+			Mat<Dtype> dX(grads[0]->sample(i), K, n, false, true);
+			dX = Wm * dO;
 		}
-	}
+	});
+	parallelFor(F, [&](int f0, int f1, int) {
+		Mat<Dtype> dW(grads[1]->sample(f0), K, f1 - f0, false, true);
+		Col<Dtype> db(grads[2]->sample(f0), f1 - f0, false, true);
+		for (int i = 0, n; i < N; i += n) {
+			n = contiguousRun(*cache[0], *din, i, N);
+			Mat<Dtype> X(const_cast<Dtype*>(cache[0]->sample(i)), K, n, false, true);
+			Mat<Dtype> dO(const_cast<Dtype*>(din->sample(i)), F, n, false, true);
+			if (i == 0) {
+				dW = X * dO.rows(f0, f1 - 1).t();
+				db = sum(dO.rows(f0, f1 - 1), 1);
+			}
+			else {
+				dW += X * dO.rows(f0, f1 - 1).t();
+				db += sum(dO.rows(f0, f1 - 1), 1);
+			}
+		}
+		dW *= Dtype(1.0 / N);
+		db *= Dtype(1.0 / N);
+	});
 	return;
 }
 
-void PoolLayer::backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-	vector<shared_ptr<Blob>>& grads, const Param& param) {
+template<typename Dtype>
+void PoolLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
 
 	// 1. Set the size of the output gradient Blob (dx = grdas[0])
-	grads[0].reset(new Blob(cache[0]->size(), TZEROS));
-	// 2. Gets the size of the input gradient Blob
-	int Nd = din->getN();        // Number of cubes in input gradient Blob (number of batch samples)
-	int Cd = din->getC();        // Number of channels for input gradient Blob
-	int Hd = din->getH();        // Number of height for input gradient Blob
-	int Wd = din->getW();        // Number of width for input gradient Blob
-	// 3. Gets the parameters associated with the pooling kernel
+	ensureBlob(grads[0], cache[0]->size());
+	// 2. Gets the parameters associated with the pooling kernel
 	int Hp = param.pool_height;
 	int Wp = param.pool_width;
 	int stride = param.pool_stride;
 
-	// 4. Start backward
-	for (int n = 0; n < Nd; n++) { // The output cubes number
-		for (int c = 0; c < Cd; c++) { // The output channels number
-			for (int hh = 0; hh < Hd; hh++) { // The height of the output Blob
-				for (int ww = 0; ww < Wd; ww++) { // The width of the output Blob
-					// (1) get mask
-					mat window = (*cache[0])[n](span(hh * param.pool_stride, hh * param.pool_stride + Hp - 1),
-						span(ww * param.pool_stride, ww * param.pool_stride + Wp - 1),
-						span(c, c));
-					double maxv = window.max();
-					mat mask = conv_to<mat>::from(maxv == window); // umat -> mat
-
-					(*grads[0])[n](span(hh * param.pool_stride, hh * param.pool_stride + Hp - 1),
-						span(ww * param.pool_stride, ww * param.pool_stride + Wp - 1),
-						span(c, c)) += mask * (*din)[n](hh, ww, c);
-				}
-			}
-		}
-	}
+	// 3. Scatter every output gradient to the input the forward pass took the max from
+	const unsigned char* taps = reinterpret_cast<const unsigned char*>(this->getScratch(0, poolTapShape<Dtype>(din->size())).memptr());
+	if (param.block)
+		poolBackwardBlocked(*din, taps, *grads[0], Hp, Wp, stride);
+	else
+		maxPoolBackward(*din, taps, *grads[0], Hp, Wp, stride);
 	return;
 }
 
-void ReLULayer::backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-	vector<shared_ptr<Blob>>& grads, const Param& param) {
+template<typename Dtype>
+void AvgPoolLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
+	ensureBlob(grads[0], cache[0]->size());
+	if (param.block)
+		avgPoolBackwardBlocked(*din, *grads[0], param.pool_height, param.pool_width, param.pool_stride);
+	else
+		avgPoolBackward(*din, *grads[0], this->getScratch(0, {1, 1, ThreadPool::get().threads(), cache[0]->getH()}).memptr(), param.pool_height, param.pool_width, param.pool_stride);
+	return;
+}
+
+template<typename Dtype>
+void GlobalAvgPoolLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
+	ensureBlob(grads[0], cache[0]->size());
+	if (param.block)
+		globalAvgPoolBackwardBlocked(*din, *grads[0]);
+	else
+		globalAvgPoolBackward(*din, *grads[0]);
+	return;
+}
+
+template<typename Dtype>
+void ReLULayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
 
 
 	// 1. Set the size of the output gradient Blob (dx = grdas[0])
-	grads[0].reset(new Blob(*cache[0]));
+	ensureBlob(grads[0], cache[0]->size());
 
-	// 2. get mask
+	// 2. Let the gradient through where the clipped ReLU is linear (0 < x < RELU_CLIP)
 	int N = grads[0]->getN();
-	for (int n = 0; n < N; n++) {// The output cube number
-		//(*grads[0])[n].transform([](double e) {return e > 0 ? 1 : 0; });
-		(*grads[0])[n].transform([](double e) {return e < 6 ? 1 : 0; });
-	}
-	(*grads[0]) = (*grads[0]) * (*din);
+	int chw = grads[0]->getC() * grads[0]->getH() * grads[0]->getW();
+	parallelFor(N, [&](int n0, int n1, int) {
+		for (int n = n0; n < n1; n++) {// The output cube number
+			const Dtype* x = cache[0]->sample(n);
+			const Dtype* d = din->sample(n);
+			Dtype* dx = grads[0]->sample(n);
+			for (int i = 0; i < chw; i++)
+				dx[i] = (x[i] > 0 && x[i] < RELU_CLIP) ? d[i] : 0;
+		}
+	});
 	return;
 }
 
-void ConvLayer::backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-	vector<shared_ptr<Blob>>& grads, const Param& param) {
+template<typename Dtype>
+void ConvLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
+	ConvShape s({cache[0]->getN(), cache[1]->getC(), cache[0]->getH(), cache[0]->getW()}, cache[1]->size(), param.conv_pad, param.conv_stride);
+	// 1. Through the fused max Pool (the taps of clamped maxima pass nothing) or the ReLU mask to the conv output gradient
+	shared_ptr<Blob<Dtype>> dy = din;
+	if (param.fuse_relu) {
+		BlobShape convShape, outShape;
+		fusedShapes(s, cache[0]->getN(), convShape, outShape, param);
+		dy = fuseScratch(0, convShape, s, param);
+		const unsigned char* mask = reinterpret_cast<const unsigned char*>(fuseScratch(1, poolTapShape<Dtype>(param.fuse_pool ? outShape : convShape), s, param)->memptr());
+		if (!param.fuse_pool)
+			reluMaskBackward(din->memptr(), mask, dy->memptr(), dy->count());
+		else if (param.block)
+			poolBackwardBlocked(*din, mask, *dy, param.pool_height, param.pool_width, param.pool_stride);
+		else
+			maxPoolBackward(*din, mask, *dy, param.pool_height, param.pool_width, param.pool_stride);
+	}
+
+	// 2. One call when both gradients come from the same algorithm, so the work they share is done once
+	string dataAlgo = pickAlgo(s, param, CONV_BACKWARD_DATA);
+	string weightsAlgo = pickAlgo(s, param, CONV_BACKWARD_WEIGHTS);
+	if (dataAlgo == weightsAlgo)
+		backwardWith(dataAlgo, dy, cache, grads, param, CONV_GRAD_ALL);
+	else {
+		backwardWith(dataAlgo, dy, cache, grads, param, CONV_GRAD_DATA);
+		backwardWith(weightsAlgo, dy, cache, grads, param, CONV_GRAD_WEIGHTS);
+	}
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::backwardWith(const string& algo, const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts) {
+	if (algo == "blocked")
+		backwardBlocked(din, cache, grads, param, parts);
+	else if (algo == "direct")
+		backwardDirect(din, cache, grads, param, parts);
+	else if (algo == "winograd")
+		backwardWinograd(din, cache, grads, param, parts);
+	else if (algo == "fft")
+		backwardFft(din, cache, grads, param, parts);
+	else
+		backwardGemm(din, cache, grads, param, parts);
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::backwardDirect(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts) {
 
 	// 1. Set the size of the output gradient Blob (dx = grdas[0])
-	grads[0].reset(new Blob(cache[0]->size(), TZEROS));
-	grads[1].reset(new Blob(cache[1]->size(), TZEROS));
-	grads[2].reset(new Blob(cache[2]->size(), TZEROS));
+	bool wantDx = parts & CONV_GRAD_DATA, wantDw = parts & CONV_GRAD_WEIGHTS;
+	ensureBlob(grads[0], cache[0]->size());
+	ensureBlob(grads[1], cache[1]->size(), wantDw ? TZEROS : TDEFAULT);
+	ensureBlob(grads[2], cache[2]->size(), wantDw ? TZEROS : TDEFAULT);
 	// 2. Gets the size of the input gradient Blob
 	int Nd = din->getN();        // Number of cubes in input gradient Blob (number of batch samples)
 	int Cd = din->getC();        // Enter the number of gradient Blob channels
@@ -384,18 +917,32 @@ void ConvLayer::backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Bl
 	int stride = param.conv_stride;
 
 	// 4. start backward
-	Blob padX = cache[0]->pad(param.conv_pad);
-	Blob pad_dx(padX.size(), TZEROS);
+	ConvShape s(cache[0]->size(), cache[1]->size(), param.conv_pad, param.conv_stride);
+	Blob<Dtype>& padX = algoScratch("direct", 0, {Nd, cache[0]->getC(), cache[0]->getH() + (param.conv_pad << 1), cache[0]->getW() + (param.conv_pad << 1)}, s, param);
+	if (wantDw)
+		cache[0]->padTo(padX, param.conv_pad);
+	Blob<Dtype>& pad_dx = algoScratch("direct", 1, padX.size(), s, param);
+	pad_dx = 0;
+	int Hp = padX.getH(), HWp = Hp * padX.getW(), HWw = Hw * Ww;
 	for (int n = 0; n < Nd; n++) {
 		for (int c = 0; c < Cd; c++) {
 			for (int hh = 0; hh < Hd; hh++) {
 				for (int ww = 0; ww < Wd; ww++) {
-					// (1) get mask
-					cube window = padX[n](span(hh * stride, hh * stride + Hw - 1), span(ww * stride, ww * stride + Ww - 1), span::all);
-					// dx
-					pad_dx[n](span(hh * stride, hh * stride + Hw - 1), span(ww * stride, ww * stride + Ww - 1), span::all) += (*din)[n](hh, ww, c) * (*cache[1])[c];
-					// dw
-					(*grads[1])[c] += (*din)[n](hh, ww, c) * window / Nd;
+					// dx: the kernel scaled by the gradient, added over the window (plain loops, the armadillo
+					// form builds a temporary cube for every position)
+					if (wantDx) {
+						Dtype g = (*din)[n](hh, ww, c);
+						const Dtype* wc = cache[1]->sample(c);
+						Dtype* pd = pad_dx.sample(n) + (size_t)(ww * stride) * Hp + hh * stride;
+						for (int k = 0; k < s.C; k++)
+							for (int j = 0; j < Ww; j++)
+								for (int i = 0; i < Hw; i++)
+									pd[(size_t)k * HWp + j * Hp + i] += g * wc[k * HWw + j * Hw + i];
+					}
+					if (!wantDw)
+						continue;
+					// dw, accumulated straight from the input window without copying it
+					(*grads[1])[c] += ((*din)[n](hh, ww, c) / Nd) * padX[n](span(hh * stride, hh * stride + Hw - 1), span(ww * stride, ww * stride + Ww - 1), span::all);
 					// db
 					(*grads[2])[c](0, 0, 0) += (*din)[n](hh, ww, c) / Nd;
 				}
@@ -403,13 +950,98 @@ void ConvLayer::backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Bl
 		}
 	}
 	// Remove the padding from the output gradient
-	(*grads[0]) = pad_dx.unPad(param.conv_pad);
+	if (wantDx)
+		pad_dx.unPadTo(*grads[0], param.conv_pad);
+	return;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::backwardGemm(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts) {
+	// 1. Gradient Blobs, the two unfolded buffers and the dw / db accumulators of every thread
+	ensureBlob(grads[0], cache[0]->size());
+	ensureBlob(grads[1], cache[1]->size());
+	ensureBlob(grads[2], cache[2]->size());
+	ConvShape s(cache[0]->size(), cache[1]->size(), param.conv_pad, param.conv_stride);
+	Blob<Dtype>& col = algoScratch("gemm", 0, gemmScratchShape(0, s), s, param);
+	Blob<Dtype>& dcol = algoScratch("gemm", 1, gemmScratchShape(1, s), s, param);
+	Blob<Dtype>& acc = algoScratch("gemm", 2, gemmScratchShape(2, s), s, param);
+
+	// 2. dw = col^T * dout, dx = col2im(dout * w^T), db = row sums of dout
+	convBackwardGemm(*din, *cache[0], *cache[1], *grads[0], *grads[1], *grads[2], col.memptr(), dcol.memptr(), acc.memptr(), s, parts);
+	return;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::backwardWinograd(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts) {
+	// 1. Gradient Blobs and the transform buffers (dV reuses V)
+	ensureBlob(grads[0], cache[0]->size());
+	ensureBlob(grads[1], cache[1]->size());
+	ensureBlob(grads[2], cache[2]->size());
+	ConvShape s(cache[0]->size(), cache[1]->size(), param.conv_pad, param.conv_stride);
+	Blob<Dtype>& U = algoScratch("winograd", 0, {16, 1, s.C, s.F}, s, param);
+	Blob<Dtype>& V = algoScratch("winograd", 1, {16, 1, winogradGroup(s, cache[0]->getN()), s.T() * s.C}, s, param);
+	Blob<Dtype>& M = algoScratch("winograd", 2, {16, 1, winogradGroup(s, cache[0]->getN()), s.T() * s.F}, s, param);
+	Blob<Dtype>& dU = algoScratch("winograd", 3, {16, 1, s.C, s.F}, s, param);
+
+	// 2. Transposed transforms of the forward pass: dw = G^T (V^T dM) G, dx = B (dM U^T) B^T
+	convBackwardWinograd(*din, *cache[0], *cache[1], *grads[0], *grads[1], *grads[2], U.memptr(), V.memptr(), M.memptr(), dU.memptr(), s, parts);
+	return;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::backwardBlocked(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts) {
+	// 1. dx has the layout of the input, dw and db are plain
+	ensureBlob(grads[0], cache[0]->size());
+	ensureBlob(grads[1], cache[1]->size());
+	ensureBlob(grads[2], cache[2]->size());
+	ConvShape s({cache[0]->getN(), cache[1]->getC(), cache[0]->getH(), cache[0]->getW()}, cache[1]->size(), param.conv_pad, param.conv_stride);
+	Blob<Dtype>& wt = algoScratch("blocked", 1, {1, blockedChannels(s.C), s.F, s.Hw * s.Ww}, s, param);
+	Blob<Dtype>& dwf = algoScratch("blocked", 2, {1, blockedChannels(s.F), s.C, s.Hw * s.Ww}, s, param);
+	const Blob<Dtype>* x = cache[0].get();
+	const Blob<Dtype>* dy = din.get();
+	Blob<Dtype>* dx = grads[0].get();
+	if (!param.block) { // NCHW net: blocked copies of x (for dw), of the output gradient and of dx
+		Blob<Dtype>& xb = algoScratch("blocked", 3, blockedShape(cache[0]->size()), s, param);
+		if (parts & CONV_GRAD_WEIGHTS)
+			toBlocked(*cache[0], xb);
+		Blob<Dtype>& dyb = algoScratch("blocked", 4, blockedShape(din->size()), s, param);
+		toBlocked(*din, dyb);
+		x = &xb;
+		dy = &dyb;
+		dx = &algoScratch("blocked", 5, blockedShape(cache[0]->size()), s, param);
+	}
+
+	// 2. Vectorized over kernels for dw and db, over input channels for dx
+	convBackwardBlocked(*dy, *x, *cache[1], *dx, *grads[1], *grads[2], wt.memptr(), dwf.memptr(), s, parts);
+	if (!param.block && (parts & CONV_GRAD_DATA))
+		fromBlocked(*dx, *grads[0]);
+	return;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::backwardFft(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts) {
+	// 1. Gradient Blobs and the frequency-domain buffers
+	ensureBlob(grads[0], cache[0]->size());
+	ensureBlob(grads[1], cache[1]->size());
+	ensureBlob(grads[2], cache[2]->size());
+	ConvShape s(cache[0]->size(), cache[1]->size(), param.conv_pad, param.conv_stride);
+	Blob<Dtype>& Kf = algoScratch("fft", 0, {s.F, s.C, s.FH, s.FW << 1}, s, param);
+	Blob<Dtype>& Xf = algoScratch("fft", 1, {1, s.C, s.FH, s.FW << 1}, s, param);
+	Blob<Dtype>& Yf = algoScratch("fft", 2, {1, s.F, s.FH, s.FW << 1}, s, param);
+	Blob<Dtype>& dWf = algoScratch("fft", 3, {s.F, s.C, s.FH, s.FW << 1}, s, param);
+	Blob<Dtype>& buf = algoScratch("fft", 4, {1, 1, s.FH, s.FW << 1}, s, param);
+
+	// 2. dx and dw from pointwise products with the transformed output gradient
+	convBackwardFft(*din, *cache[0], *cache[1], *grads[0], *grads[1], *grads[2], Kf.memptr(), Xf.memptr(), Yf.memptr(), dWf.memptr(), buf.memptr(), s, parts);
 	return;
 }
 
-void SVMLossLayer::hinge_with_logits(const vector<shared_ptr<Blob>>& in, double& loss, shared_ptr<Blob>& dout) {
-	if (dout)
-		dout.reset();
+template<typename Dtype>
+void SVMLossLayer<Dtype>::hinge_with_logits(const vector<shared_ptr<Blob<Dtype>>>& in, double& loss, shared_ptr<Blob<Dtype>>& dout) {
 
 	// 1. Get relevant dimensions
 	int N = in[0]->getN();
@@ -418,266 +1050,654 @@ void SVMLossLayer::hinge_with_logits(const vector<shared_ptr<Blob>>& in, double&
 	int Wx = in[0]->getW();
 	assert(Hx == 1 && Wx == 1);
 
-	dout.reset(new Blob(N, C, Hx, Wx)); // (N, C, 1, 1)
-	double loss_ = 0;
+	ensureBlob(dout, {N, C, Hx, Wx}); // (N, C, 1, 1)
+	double* loss_ = lossPartials(); // per thread, added in thread order
 	double delta = 0.2;
-	for (int i = 0; i < N; i++) {
-		// Calc Loss
-		int idx_max = (*in[1])[i].index_max();
-		double positive_x = (*in[0])[i](0, 0, idx_max);
-		cube tmp = ((*in[0])[i] - positive_x + delta); // Hinge Loss formula
-		tmp(0, 0, idx_max) = 0; // Eliminate values in the correct category
-		tmp.transform([](double e) {return e > 0 ? e : 0; });
-		arma::accu(tmp); // get all kinds of losses
-		loss_ += arma::accu(tmp);
-		
-		// Calc Gradient
-		tmp.transform([](double e) {return e ? 1 : 0; });
-		tmp(0, 0, idx_max) = -arma::accu(tmp);
-		(*dout)[i] = tmp;
-	}
-	loss = loss_ / N;
+	int parts = parallelFor(N, [&](int i0, int i1, int t) {
+		for (int i = i0; i < i1; i++) {
+			const Dtype* x = in[0]->sample(i);
+			const Dtype* label = in[1]->sample(i);
+			Dtype* d = dout->sample(i);
+			// Calc Loss: the hinge margin of every wrong category over the correct one
+			int idx_max = (int)(std::max_element(label, label + C) - label);
+			Dtype positive_x = x[idx_max];
+			int active = 0;
+			for (int c = 0; c < C; c++) {
+				Dtype margin = x[c] - positive_x + (Dtype)delta; // Hinge Loss formula
+				if (c != idx_max && margin > 0) {
+					loss_[t] += margin;
+					active++;
+				}
+				// Calc Gradient: 1 for every margin that counts, minus their number for the correct category
+				d[c] = c != idx_max && margin > 0 ? 1 : 0;
+			}
+			d[idx_max] = (Dtype)-active;
+		}
+	});
+	loss = 0;
+	for (int t = 0; t < parts; t++)
+		loss += loss_[t];
+	loss /= N;
 	return;
 }
 
-void DropoutLayer::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) {
+template<typename Dtype>
+void DropoutLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
 	return;
 }
-void DropoutLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+template<typename Dtype>
+void DropoutLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
 	outShape.assign(inShape.begin(), inShape.end());
 	return;
 }
-void DropoutLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) {
-	if (out)
-		out.reset();
+template<typename Dtype>
+void DropoutLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	ensureBlob(out, in[0]->size());
 	if (mode == "TRAIN") {
 		double drop_rate = param.drop_rate;
 		assert(drop_rate >= 0 && drop_rate <= 1);
-		shared_ptr<Blob> in_mask(new Blob(in[0]->size(), TRANDU));
-		in_mask->convertIn(drop_rate);
-		drop_mask.reset(new Blob(*in_mask));
-		out.reset(new Blob((*in[0]) * (*in_mask) / (1 - drop_rate)));
+		Blob<Dtype>& drop_mask = this->getScratch(0, in[0]->size());
+		drop_mask.fill(TRANDU);
+		drop_mask.convertIn(drop_rate);
+		(*out) = (*in[0]) * drop_mask / (1 - drop_rate);
 	}
 	else
-		out.reset(new Blob((*in[0])));
+		(*out) = (*in[0]);
 }
-void DropoutLayer::backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-	vector<shared_ptr<Blob>>& grads, const Param& param) {
+template<typename Dtype>
+void DropoutLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
 	double drop_rate = param.drop_rate;
-	grads[0].reset(new Blob((*din) * (*drop_mask) / (1 - drop_rate)));
+	ensureBlob(grads[0], din->size());
+	Blob<Dtype>& drop_mask = this->getScratch(0, din->size());
+	(*grads[0]) = (*din) * drop_mask / (1 - drop_rate);
 }
 
-void BNLayer::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) {
+template<typename Dtype>
+void BNLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
 	int C = inShape[1];
 	int H = inShape[2];
 	int W = inShape[3];
 	if (!in[1]) 
-		in[1].reset(new Blob(1, C, H, W, TZEROS));
+		in[1].reset(new Blob<Dtype>(1, C, H, W, TZEROS));
 	if (!in[2])
-		in[2].reset(new Blob(1, C, H, W, TZEROS));
+		in[2].reset(new Blob<Dtype>(1, C, H, W, TZEROS));
 }
 
 
-void BNLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) {
-	if (out)
-		out.reset(new Blob(in[0]->size(), TZEROS));
-	int N = in[0]->getN();
-	int C = in[0]->getC();
-	int H = in[0]->getH();
-	int W = in[0]->getW();
+// Mean and sum of squared deviations of n values (the sums run in four lanes so they do not wait on each other)
+template<typename Dtype>
+static void planeStats(const Dtype* x, size_t n, double& mean, double& m2) {
+	double s[4] = {0, 0, 0, 0}, d[4] = {0, 0, 0, 0};
+	size_t q = 0;
+	for (; q + 4 <= n; q += 4)
+		for (int l = 0; l < 4; l++)
+			s[l] += x[q + l];
+	for (; q < n; q++)
+		s[0] += x[q];
+	mean = (s[0] + s[1] + s[2] + s[3]) / n;
+	for (q = 0; q + 4 <= n; q += 4)
+		for (int l = 0; l < 4; l++)
+			d[l] += (x[q + l] - mean) * (x[q + l] - mean);
+	for (; q < n; q++)
+		d[0] += (x[q] - mean) * (x[q] - mean);
+	m2 = d[0] + d[1] + d[2] + d[3];
+}
 
-	if (mode == "TRAIN") {
-		// clear
-		mean.reset(new cube(1, 1, C, fill::zeros));
-		var.reset(new cube(1, 1, C, fill::zeros));
-		std.reset(new cube(1, 1, C, fill::zeros));
-
-		// calc mean
-		for (int i = 0; i < N; i++)
-			(*mean) += sum(sum((*in[0])[i], 0), 1) / (H * W);
-		(*mean) /= (-N);
-		
-		// calc variance
-		for (int i = 0; i < N; i++)
-			(*var) += square(sum(sum((*in[0])[i], 0), 1) / (H * W) + (*mean));
-		(*var) /= N;
-
-		// calc std
-		(*std) = sqrt((*var) + 1e-5);
-		
-		// broadcast mean and std
-		cube mean_tmp(H, W, C, fill::zeros);
-		cube std_tmp(H, W, C, fill::zeros);
-		for (int c = 0; c < C; c++) {
-			mean_tmp.slice(c).fill(as_scalar((*mean).slice(c)));
-			std_tmp.slice(c).fill(as_scalar((*std).slice(c)));
+// Sums of dy and of dy * (x * a + b) over n values
+template<typename Dtype>
+static void planeGradSums(const Dtype* x, const Dtype* dy, size_t n, Dtype a, Dtype b, double& s, double& sx) {
+	double u[4] = {0, 0, 0, 0}, v[4] = {0, 0, 0, 0};
+	size_t q = 0;
+	for (; q + 4 <= n; q += 4)
+		for (int l = 0; l < 4; l++) {
+			u[l] += dy[q + l];
+			v[l] += dy[q + l] * (x[q + l] * a + b);
 		}
+	for (; q < n; q++) {
+		u[0] += dy[q];
+		v[0] += dy[q] * (x[q] * a + b);
+	}
+	s = u[0] + u[1] + u[2] + u[3];
+	sx = v[0] + v[1] + v[2] + v[3];
+}
 
-		// normalize
-		for (int i = 0; i < N; i++)
-			(*out)[i] = ((*in[0])[i] + mean_tmp) / std_tmp;
+template<typename Dtype>
+void BNLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	ensureBlob(out, in[0]->size());
+	int N = in[0]->getN();
+	int C = in[0]->getC();
+	size_t HW = (size_t)in[0]->getH() * in[0]->getW();
 
-		if (!running_mean_std_init) {
-			(*in[1])[0] = mean_tmp;
-			(*in[2])[0] = std_tmp;
-			running_mean_std_init = true;
-		}
+	if (mode == "TRAIN") {
+		// 1. Mean and variance of every channel over the batch in one pass: the mean and squared deviations of
+		// a plane are taken while it is cached, then merged into the channel's (Chan's parallel form of Welford)
+		// Channels are independent, so the threads split them
+		sum1.assign(C, 0);
+		sum2.assign(C, 0);
+		scale.resize(C);
+		shift.resize(C);
+		Dtype* rm = in[1]->memptr();
+		Dtype* rs = in[2]->memptr();
+		double yita = running_mean_std_init ? 0.99 : 0;
+		parallelFor(C, [&](int c0, int c1, int) {
+			for (int c = c0; c < c1; c++) {
+				for (int n = 0; n < N; n++) {
+					double m, m2;
+					planeStats(in[0]->sample(n) + c * HW, HW, m, m2);
+					double before = (double)n * HW, total = before + HW, delta = m - sum1[c];
+					sum1[c] += delta * HW / total;
+					sum2[c] += m2 + delta * delta * before * HW / total;
+				}
 
-		double yita = 0.99;
-		(*in[1])[0] = yita * (*in[1])[0] + (1 - yita) * mean_tmp;
-		(*in[2])[0] = yita * (*in[2])[0] + (1 - yita) * std_tmp;
-	} else 
-		for (int n = 0; n < N; n++)
-			(*out)[n] = ((*in[0])[n] + (*in[1])[0]) / (*in[2])[0];
+				// 2. x_hat = (x - mean) / std; the running statistics keep -mean and std at every position
+				double sd = std::sqrt(sum2[c] / ((double)N * HW) + 1e-5);
+				scale[c] = Dtype(1 / sd);
+				shift[c] = Dtype(-sum1[c] / sd);
+				for (size_t q = c * HW; q < (c + 1) * HW; q++) {
+					rm[q] = Dtype(yita * rm[q] - (1 - yita) * sum1[c]);
+					rs[q] = Dtype(yita * rs[q] + (1 - yita) * sd);
+				}
+			}
+		});
+		running_mean_std_init = true;
+		parallelFor(N, [&](int n0, int n1, int) {
+			for (int n = n0; n < n1; n++)
+				channelAffine(in[0]->sample(n), out->sample(n), scale.data(), shift.data(), 0, C * HW, HW);
+		});
+	} else
+		parallelFor(N, [&](int n0, int n1, int) {
+			for (int n = n0; n < n1; n++)
+				bnInference(in[0]->sample(n), out->sample(n), in[1]->memptr(), in[2]->memptr(), C * HW);
+		});
 }
 
-void BNLayer::backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-	vector<shared_ptr<Blob>>& grads, const Param& param) {
-	grads[0].reset(new Blob(cache[0]->size(), TZEROS));
+template<typename Dtype>
+void BNLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
+	ensureBlob(grads[0], cache[0]->size());
 	int N = grads[0]->getN();
 	int C = grads[0]->getC();
-	int H = grads[0]->getH();
-	int W = grads[0]->getW();
-
-	cube mean_tmp(H, W, C, fill::zeros);
-	cube var_tmp(H, W, C, fill::zeros);
-	cube std_tmp(H, W, C, fill::zeros);
-	for (int c = 0; c < C; c++) {
-		mean_tmp.slice(c).fill(as_scalar((*mean).slice(c)));
-		var_tmp.slice(c).fill(as_scalar((*var).slice(c)));
-		std_tmp.slice(c).fill(as_scalar((*std).slice(c)));
-	}
-
-	for (int k = 0; k < N; k++) {
-		cube item1(H, W, C, fill::zeros);
-		for (int i = 0; i < N; i++)
-			item1 += (*din)[i] % ((*cache[0])[i] + mean_tmp);
-		cube tmp = (-sum(sum(item1, 0), 1) / (2 * (*var) % (*std))) / N;
-
-		cube item2(1, 1, C, fill::zeros);
-		for (int i = 0; i < N; i++)
-			item2 += (tmp % (2 * (sum(sum((*cache[0])[i], 0), 1) / (H * W) + (*mean))));
-
-		cube item3(H, W, C, fill::zeros);
-		for (int i = 0; i < N; i++)
-			item2 += (*din)[i] / std_tmp;
-		
-		cube item4(1, 1, C, fill::zeros);
-		item4 = sum(sum(item3, 0), 1);
-
-		cube black0 = (item2 + item4) / (-N);
-		cube red0 = (tmp % (2 * (sum(sum((*cache[0])[k], 0), 1) / (H * W) + (*mean))));
-		cube black_(H, W, C, fill::zeros);
-		cube red_(H, W, C, fill::zeros);
-		cube purple_ = (*din)[k] / std_tmp;
-		for (int c = 0; c < C; ++c) {
-			black_.slice(c).fill(as_scalar(black0.slice(c)));        //cube(H, W, C)
-			red_.slice(c).fill(as_scalar(red0.slice(c)));			//cube(H, W, C)
+	size_t HW = (size_t)grads[0]->getH() * grads[0]->getW();
+
+	// dx = (dy - mean(dy) - x_hat * mean(dy * x_hat)) / std with the means taken per channel over the batch:
+	// one pass for the two sums, one to write dx, the threads splitting the channels
+	sum1.assign(C, 0);
+	sum2.assign(C, 0);
+	parallelFor(C, [&](int c0, int c1, int) {
+		for (int c = c0; c < c1; c++) {
+			for (int n = 0; n < N; n++) {
+				double s, sx;
+				planeGradSums(cache[0]->sample(n) + c * HW, din->sample(n) + c * HW, HW, scale[c], shift[c], s, sx);
+				sum1[c] += s;
+				sum2[c] += sx;
+			}
+			// as dx = a * dy + b * x + d
+			double k1 = sum1[c] / ((double)N * HW), k2 = sum2[c] / ((double)N * HW);
+			Dtype a = scale[c], b = Dtype(-k2 * scale[c] * scale[c]), d = Dtype(-(k1 + k2 * shift[c]) * scale[c]);
+			for (int n = 0; n < N; n++) {
+				const Dtype* x = cache[0]->sample(n) + c * HW;
+				const Dtype* dy = din->sample(n) + c * HW;
+				Dtype* dx = grads[0]->sample(n) + c * HW;
+				for (size_t q = 0; q < HW; q++)
+					dx[q] = a * dy[q] + b * x[q] + d;
+			}
 		}
-		(*grads[0])[k] = (black_ + red_) / (H * W) + purple_;
-	}
+	});
 	return;
 }
 
-void BNLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+template<typename Dtype>
+void BNLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
 	outShape.assign(inShape.begin(), inShape.end());
 	return;
 }
 
-void ScaleLayer::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) {
+template<typename Dtype>
+void ScaleLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
 	int C = inShape[1];
 
 	if (!in[1])
-		in[1].reset(new Blob(1, C, 1, 1, TONES));
+		in[1].reset(new Blob<Dtype>(1, C, 1, 1, TONES));
 
 	if (!in[2])
-		in[2].reset(new Blob(1, C, 1, 1, TZEROS));
+		in[2].reset(new Blob<Dtype>(1, C, 1, 1, TZEROS));
 	return;
 }
 
-void ScaleLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+template<typename Dtype>
+void ScaleLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
 	outShape.assign(inShape.begin(), inShape.end());
 	return;
 }
 
-void ScaleLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) {
-	out.reset(new Blob(in[0]->size(), TZEROS));
+template<typename Dtype>
+void ScaleLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	ensureBlob(out, in[0]->size());
 
 	int N = in[0]->getN();
 	int C = in[0]->getC();
-	int H = in[0]->getH();
-	int W = in[0]->getW();
-
-	shared_ptr<Blob> gamma(new Blob(1, C, H, W, TZEROS));
-	shared_ptr<Blob> beta(new Blob(1, C, H, W, TZEROS));
-	for (int c = 0; c < C; ++c) {
-		(*gamma)[0].slice(c).fill(as_scalar((*in[1])[0].slice(c)));
-		(*beta)[0].slice(c).fill(as_scalar((*in[2])[0].slice(c)));
-	}
-
-	for (int n = 0; n < N; ++n)
-		(*out)[n] = (*gamma)[0] % (*in[0])[n] + (*beta)[0];  //out  =  * in    +  
+	int HW = in[0]->getH() * in[0]->getW();
+	const Dtype* gamma = in[1]->sample(0);
+	const Dtype* beta = in[2]->sample(0);
+
+	parallelFor(N, [&](int n0, int n1, int) {
+		for (int n = n0; n < n1; ++n)
+			for (int c = 0; c < C; ++c) { // out = gamma * in + beta, per channel
+				const Dtype* x = in[0]->sample(n) + (size_t)c * HW;
+				Dtype* y = out->sample(n) + (size_t)c * HW;
+				for (int i = 0; i < HW; i++)
+					y[i] = gamma[c] * x[i] + beta[c];
+			}
+	});
 	return;
 }
 
-void ScaleLayer::backward(const shared_ptr<Blob>& din,
-	const vector<shared_ptr<Blob>>& cache,
-	vector<shared_ptr<Blob>>& grads,
+template<typename Dtype>
+void ScaleLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din,
+	const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads,
 	const Param& param) {
 
-	grads[0].reset(new Blob(cache[0]->size(), TZEROS));//dx  
-	grads[1].reset(new Blob(cache[1]->size(), TZEROS));//d
-	grads[2].reset(new Blob(cache[2]->size(), TZEROS));//d
+	ensureBlob(grads[0], cache[0]->size());        // dx
+	ensureBlob(grads[1], cache[1]->size(), TZEROS); // dgamma
+	ensureBlob(grads[2], cache[2]->size(), TZEROS); // dbeta
 	int N = grads[0]->getN();
 	int C = grads[0]->getC();
-	int H = grads[0]->getH();
-	int W = grads[0]->getW();
-
-	shared_ptr<Blob> gamma(new Blob(1, C, H, W, TZEROS));
-	for (int c = 0; c < C; ++c)
-		(*gamma)[0].slice(c).fill(as_scalar((*cache[1])[0].slice(c)));  //Ϊdx  = din %   Ԧ Ҫ㲥ɳߴƥ
-
-	shared_ptr<Blob> dgamma(new Blob(1, C, H, W, TZEROS));
-	shared_ptr<Blob> dbeta(new Blob(1, C, H, W, TZEROS));
-	for (int n = 0; n < N; ++n) {
-		(*grads[0])[n] = (*din)[n] % (*gamma)[0];
-		(*dgamma)[0] += (*din)[n] % (*cache[0])[n];
-		(*dbeta)[0] += (*din)[n];
-	}
-	(*grads[1])[0] = sum(sum((*dgamma)[0], 0), 1) / N;
-	(*grads[2])[0] = sum(sum((*dbeta)[0], 0), 1) / N;
-
+	int HW = grads[0]->getH() * grads[0]->getW();
+	const Dtype* gamma = cache[1]->sample(0);
+	Dtype* dgamma = grads[1]->sample(0);
+	Dtype* dbeta = grads[2]->sample(0);
+
+	// Split over the channels, so each dgamma / dbeta is summed by one thread
+	parallelFor(C, [&](int c0, int c1, int) {
+		for (int c = c0; c < c1; ++c) {
+			for (int n = 0; n < N; ++n) {
+				const Dtype* dy = din->sample(n) + (size_t)c * HW;
+				const Dtype* x = cache[0]->sample(n) + (size_t)c * HW;
+				Dtype* dx = grads[0]->sample(n) + (size_t)c * HW;
+				Dtype sg = 0, sb = 0;
+				for (int i = 0; i < HW; i++) {
+					dx[i] = dy[i] * gamma[c];
+					sg += dy[i] * x[i];
+					sb += dy[i];
+				}
+				dgamma[c] += sg / N;
+				dbeta[c] += sb / N;
+			}
+		}
+	});
 	return;
 }
 
-void TanhLayer::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) {
+template<typename Dtype>
+void TanhLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
 	return;
 }
 
-void TanhLayer::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+template<typename Dtype>
+void TanhLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
 	outShape.assign(inShape.begin(), inShape.end());
 	return;
 }
 
-void TanhLayer::forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) {
-	if (out)
-		out.reset();
-	out.reset(new Blob(*in[0]));
+template<typename Dtype>
+void TanhLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	ensureBlob(out, in[0]->size());
 	int N = in[0]->getN();
-	for (int n = 0; n < N; ++n)
-		(*out)[n] = (arma::exp((*in[0])[n]) - arma::exp(-(*in[0])[n])) / (arma::exp((*in[0])[n]) + arma::exp(-(*in[0])[n]));
+	size_t chw = (size_t)in[0]->getC() * in[0]->getH() * in[0]->getW();
+	parallelFor(N, [&](int n0, int n1, int) {
+		for (int n = n0; n < n1; ++n)
+			vecTanh(in[0]->sample(n), out->sample(n), chw);
+	});
+	y = out;
 	return;
 }
 
-void TanhLayer::backward(const shared_ptr<Blob>& din,
-	const vector<shared_ptr<Blob>>& cache,
-	vector<shared_ptr<Blob>>& grads,
+template<typename Dtype>
+void TanhLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din,
+	const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads,
 	const Param& param) {
 
-	grads[0].reset(new Blob(*cache[0]));
+	ensureBlob(grads[0], cache[0]->size());
 
+	// dx = din * (1 - tanh(x)^2), with tanh(x) the saved output
+	assert(y && y->size() == cache[0]->size());
 	int N = grads[0]->getN();
-	for (int n = 0; n < N; ++n)
-		(*grads[0])[n] = (*din)[n] % (1 - arma::square((arma::exp((*cache[0])[n]) - arma::exp(-(*cache[0])[n])) / (arma::exp((*cache[0])[n]) + arma::exp(-(*cache[0])[n]))));
+	size_t chw = (size_t)grads[0]->getC() * grads[0]->getH() * grads[0]->getW();
+	parallelFor(N, [&](int n0, int n1, int) {
+		for (int n = n0; n < n1; ++n)
+			tanhBackward(y->sample(n), din->sample(n), grads[0]->sample(n), chw);
+	});
+	return;
+}
+
+///////////////////////////////////chain///////////////////////////////////
+template<typename Dtype>
+ChainLayer<Dtype>::ChainLayer(const vector<ChainOp<Dtype>>& ops) :ops(ops), bn(-1), drop(ops.size(), -1), drops(0),
+	tiles(NULL), masks(NULL), count(0), vals(ops.size() + 1), bn_in(3), bn_grads(3) {
+	for (int i = 0; i < (int)ops.size(); i++) {
+		if (ops[i].type == CHAIN_BN)
+			bn = i;
+		if (ops[i].type == CHAIN_DROPOUT)
+			drop[i] = drops++;
+	}
+}
+
+template<typename Dtype>
+void ChainLayer<Dtype>::initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) {
+	return; // the chained layers were initialized as layers of their own
+}
+
+template<typename Dtype>
+void ChainLayer<Dtype>::calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) {
+	outShape.assign(inShape.begin(), inShape.end());
+	return;
+}
+
+template<typename Dtype>
+void ChainLayer<Dtype>::calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param) {
+	int k = ops.size();
+	vector<int> none = {1, 1, 1, 1};
+	shapes.push_back({1, 1, ThreadPool::get().threads(), (k + 1) * FUSE_TILE}); // tiles of each thread
+	shapes.push_back(drops ? vector<int>(poolTapShape<Dtype>({drops * inShape[0], inShape[1], inShape[2], inShape[3]})) : none); // masks
+	// Training BN: its input and output, then their gradients (a single value where the BN is the first or last op)
+	bool pre = bn > 0, post = bn >= 0 && bn < k - 1;
+	shapes.push_back(pre ? inShape : none);
+	shapes.push_back(post ? inShape : none);
+	shapes.push_back(pre ? inShape : none);
+	shapes.push_back(post ? inShape : none);
+	return;
+}
+
+template<typename Dtype>
+void ChainLayer<Dtype>::bindTiles(const BlobShape& inShape) {
+	count = (size_t)inShape[0] * inShape[1] * inShape[2] * inShape[3];
+	int T = ThreadPool::get().threads();
+	tiles = this->getScratch(0, {1, 1, T, ((int)ops.size() + 1) * FUSE_TILE}).memptr();
+	vals.resize(T * (ops.size() + 1));
+	masks = drops ? reinterpret_cast<unsigned char*>(this->getScratch(1, poolTapShape<Dtype>({drops * inShape[0], inShape[1], inShape[2], inShape[3]})).memptr()) : NULL;
+}
+
+template<typename Dtype>
+shared_ptr<Blob<Dtype>> ChainLayer<Dtype>::chainScratch(int i, const BlobShape& shape) {
+	this->getScratch(i, shape);
+	return this->scratch[i];
+}
+
+template<typename Dtype>
+bool ChainLayer<Dtype>::forwardTile(int i, const Dtype* x, Dtype* y, Dtype* tile, size_t at, size_t j, size_t m, size_t HW, bool train, bool replay) {
+	const ChainOp<Dtype>& op = ops[i];
+	switch (op.type) {
+	case CHAIN_RELU:
+		reluForward(x, y, m);
+		return true;
+	case CHAIN_TANH:
+		vecTanh(x, y, m);
+		return true;
+	case CHAIN_DROPOUT: {
+		if (!train)
+			return false;
+		Dtype* r = NULL;
+		if (!replay) { // draws as DropoutLayer does, in the same order
+			r = tile + ops.size() * FUSE_TILE;
+			arma::Col<Dtype> rc(r, m, false, true);
+			rc.randu();
+		}
+		dropoutForward(x, y, masks + drop[i] * count + at, r, op.param.drop_rate, m);
+		return true;
+	}
+	case CHAIN_SCALE:
+		channelAffine(x, y, (*op.data)[1]->memptr(), (*op.data)[2]->memptr(), j, m, HW);
+		return true;
+	case CHAIN_BN: // inference only, training runs the BN layer between two parts of the chain
+		assert(!train);
+		bnInference(x, y, (*op.data)[1]->memptr() + j, (*op.data)[2]->memptr() + j, m);
+		return true;
+	}
+	return false;
+}
+
+template<typename Dtype>
+void ChainLayer<Dtype>::forwardOps(int first, int last, const Blob<Dtype>& x, Blob<Dtype>& y, bool train) {
+	int N = x.getN();
+	size_t HW = (size_t)x.getH() * x.getW(), chw = x.getC() * HW;
+	auto run = [&](int n0, int n1, int t) {
+		Dtype* tile = tiles + t * (ops.size() + 1) * FUSE_TILE;
+		for (int n = n0; n < n1; n++)
+			for (size_t j = 0; j < chw; j += FUSE_TILE) {
+				size_t m = std::min((size_t)FUSE_TILE, chw - j);
+				const Dtype* src = x.sample(n) + j;
+				Dtype* dst = y.sample(n) + j;
+				for (int i = first; i < last; i++) // the first op reads x, the others work in place on y
+					if (forwardTile(i, src, dst, tile, n * chw + j, j, m, HW, train, false))
+						src = dst;
+				if (src != dst)
+					memcpy(dst, src, m * sizeof(Dtype));
+			}
+	};
+	// Dropout draws its random numbers in sample order, so a training chain with one stays on this thread
+	bool draws = false;
+	for (int i = first; i < last; i++)
+		draws |= train && ops[i].type == CHAIN_DROPOUT;
+	if (draws)
+		run(0, N, 0);
+	else
+		parallelFor(N, run);
+}
+
+template<typename Dtype>
+void ChainLayer<Dtype>::backwardOps(int first, int last, const Blob<Dtype>& x, const Blob<Dtype>& y, const Blob<Dtype>& din, Blob<Dtype>& dx) {
+	int N = x.getN();
+	size_t HW = (size_t)x.getH() * x.getW(), chw = x.getC() * HW;
+	auto run = [&](int n0, int n1, int t) {
+		Dtype* tile = tiles + t * (ops.size() + 1) * FUSE_TILE;
+		const Dtype** val = vals.data() + t * (ops.size() + 1);
+		for (int n = n0; n < n1; n++)
+			for (size_t j = 0; j < chw; j += FUSE_TILE) {
+				size_t m = std::min((size_t)FUSE_TILE, chw - j);
+				size_t at = n * chw + j;
+
+				// 1. Replay the tile's forward, keeping the input of every op (a last Tanh reads its output from y)
+				val[first] = x.sample(n) + j;
+				for (int i = first; i < last - 1; i++) {
+					Dtype* v = tile + (i - first) * FUSE_TILE;
+					val[i + 1] = forwardTile(i, val[i], v, tile, at, j, m, HW, true, true) ? v : val[i];
+				}
+				val[last] = y.sample(n) + j;
+
+				// 2. The ops' gradients in reverse, the last op reads din and the others work in place on dx
+				const Dtype* g = din.sample(n) + j;
+				Dtype* d = dx.sample(n) + j;
+				for (int i = last - 1; i >= first; i--) {
+					const ChainOp<Dtype>& op = ops[i];
+					switch (op.type) {
+					case CHAIN_RELU:
+						reluBackward(val[i], g, d, m);
+						break;
+					case CHAIN_TANH:
+						tanhBackward(val[i + 1], g, d, m);
+						break;
+					case CHAIN_DROPOUT:
+						dropoutBackward(masks + drop[i] * count + at, g, d, op.param.drop_rate, m);
+						break;
+					case CHAIN_SCALE:
+						channelAffineBackward(val[i], g, d, (*op.data)[1]->memptr(), (*op.grads)[1]->memptr(), (*op.grads)[2]->memptr(), Dtype(1.0 / N), j, m, HW);
+						break;
+					case CHAIN_BN:
+						assert(false); // never inside a part of the chain that is taken back
+					}
+					g = d;
+				}
+			}
+	};
+	// Scale sums its gradients into dgamma / dbeta, so a chain with one stays on this thread
+	bool sums = false;
+	for (int i = first; i < last; i++)
+		sums |= ops[i].type == CHAIN_SCALE;
+	if (sums)
+		run(0, N, 0);
+	else
+		parallelFor(N, run);
+}
+
+template<typename Dtype>
+void ChainLayer<Dtype>::forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) {
+	ensureBlob(out, in[0]->size());
+	bindTiles(in[0]->size());
+	y = out;
+	int k = ops.size();
+	bool train = (mode == "TRAIN");
+	if (!train || bn < 0) { // in TEST the ops folded into the Conv / FC before the chain are left out
+		forwardOps(train ? 0 : param.folded, k, *in[0], *out, train);
+		return;
+	}
+
+	// The ops before the BN, the BN layer on the whole batch, then the ops after it
+	shared_ptr<Blob<Dtype>> t0 = bn > 0 ? chainScratch(2, in[0]->size()) : in[0];
+	shared_ptr<Blob<Dtype>> t1 = bn < k - 1 ? chainScratch(3, in[0]->size()) : out;
+	if (bn > 0)
+		forwardOps(0, bn, *in[0], *t0, true);
+	bn_in[0] = t0;
+	bn_in[1] = (*ops[bn].data)[1];
+	bn_in[2] = (*ops[bn].data)[2];
+	ops[bn].layer->forward(bn_in, t1, ops[bn].param, mode);
+	if (bn < k - 1)
+		forwardOps(bn + 1, k, *t1, *out, true);
 	return;
-}
\ No newline at end of file
+}
+
+template<typename Dtype>
+void ChainLayer<Dtype>::backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+	vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) {
+	ensureBlob(grads[0], cache[0]->size());
+	bindTiles(cache[0]->size());
+	int k = ops.size();
+	for (auto& op : ops) // Scale gradients are summed tile by tile
+		if (op.type == CHAIN_SCALE) {
+			ensureBlob((*op.grads)[1], (*op.data)[1]->size(), TZEROS);
+			ensureBlob((*op.grads)[2], (*op.data)[2]->size(), TZEROS);
+		}
+	if (bn < 0) {
+		backwardOps(0, k, *cache[0], *y, *din, *grads[0]);
+		return;
+	}
+
+	// Back through the ops after the BN, the BN layer, then the ops before it
+	shared_ptr<Blob<Dtype>> dt1 = din;
+	if (bn < k - 1) {
+		dt1 = chainScratch(5, cache[0]->size());
+		backwardOps(bn + 1, k, *chainScratch(3, cache[0]->size()), *y, *din, *dt1);
+	}
+	bn_in[0] = bn > 0 ? chainScratch(2, cache[0]->size()) : cache[0];
+	bn_in[1] = (*ops[bn].data)[1];
+	bn_in[2] = (*ops[bn].data)[2];
+	bn_grads[0] = bn > 0 ? chainScratch(4, cache[0]->size()) : grads[0];
+	bn_grads[1] = (*ops[bn].grads)[1];
+	bn_grads[2] = (*ops[bn].grads)[2];
+	ops[bn].layer->backward(dt1, bn_in, bn_grads, ops[bn].param);
+	if (bn > 0)
+		backwardOps(0, bn, *cache[0], *chainScratch(2, cache[0]->size()), *bn_grads[0], *grads[0]);
+	return;
+}
+
+///////////////////////////////////tune///////////////////////////////////
+// Seconds taken by the fastest of TUNE_REPS runs after a warm-up run; when the warm-up is already
+// TUNE_CUTOFF times slower than the best time so far, the candidate has lost and is not repeated
+template<typename Run>
+static double timeRuns(Run run, double best) {
+	double t = 0;
+	for (int r = 0; r <= TUNE_REPS; r++) {
+		auto t0 = std::chrono::steady_clock::now();
+		run();
+		double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		if (r == 0 && dt > TUNE_CUTOFF * best)
+			return dt;
+		if (r == 1 || (r > 1 && dt < t))
+			t = dt;
+	}
+	return t;
+}
+
+template<typename Dtype>
+void ConvLayer<Dtype>::tune(const vector<int>& inShape, const vector<shared_ptr<Blob<Dtype>>>& in, Param& param) {
+	// 1. Only "auto" layers are tuned, and the NCHWc segment of a net has to run blocked
+	if (param.conv_algo != "auto" || param.block)
+		return;
+	ConvShape s(inShape, in[1]->size(), param.conv_pad, param.conv_stride);
+	vector<string> algos = {"gemm", "blocked"};
+	if (winogradEligible(s))
+		algos.push_back("winograd");
+	algos.push_back("fft");
+	algos.push_back("direct");
+
+	// 2. Random input and output gradient of the real shapes, with the layer's own weights
+	vector<shared_ptr<Blob<Dtype>>> io = {shared_ptr<Blob<Dtype>>(new Blob<Dtype>(inShape, TRANDN)), in[1], in[2]};
+	shared_ptr<Blob<Dtype>> out;
+	shared_ptr<Blob<Dtype>> dout(new Blob<Dtype>(inShape[0], s.F, s.Ho, s.Wo, TRANDN));
+	vector<shared_ptr<Blob<Dtype>>> grads(3);
+
+	// 3. Time every pass of every candidate on its own scratch, keep the fastest per pass
+	double best[3] = {1e30, 1e30, 1e30};
+	for (const string& algo : algos) {
+		Param p = param;
+		p.fuse_relu = p.fuse_pool = false; // the conv alone is timed
+		for (int pass = CONV_FORWARD; pass <= CONV_BACKWARD_WEIGHTS; pass++)
+			p.conv_tuned[pass] = algo;
+		vector<vector<int>> shapes;
+		calcScratch(inShape, shapes, p);
+		double bytes = 0;
+		for (auto& shape : shapes)
+			bytes += (double)shape[0] * shape[1] * shape[2] * shape[3] * sizeof(Dtype);
+		if (bytes > TUNE_MAX_SCRATCH_MB * 1048576.0)
+			continue;
+		vector<shared_ptr<Blob<Dtype>>> scratch;
+		for (auto& shape : shapes)
+			scratch.push_back(shared_ptr<Blob<Dtype>>(new Blob<Dtype>(shape)));
+		this->bindScratch(scratch);
+
+		double t[3];
+		t[CONV_FORWARD] = timeRuns([&] { forwardWith(algo, io, out, p); }, best[CONV_FORWARD]);
+		if (algo == "winograd" && wino_state < 0)
+			continue; // failed its accuracy check
+		t[CONV_BACKWARD_DATA] = timeRuns([&] { backwardWith(algo, dout, io, grads, p, CONV_GRAD_DATA); }, best[CONV_BACKWARD_DATA]);
+		t[CONV_BACKWARD_WEIGHTS] = timeRuns([&] { backwardWith(algo, dout, io, grads, p, CONV_GRAD_WEIGHTS); }, best[CONV_BACKWARD_WEIGHTS]);
+		for (int pass = CONV_FORWARD; pass <= CONV_BACKWARD_WEIGHTS; pass++)
+			if (t[pass] < best[pass]) {
+				best[pass] = t[pass];
+				param.conv_tuned[pass] = algo;
+			}
+	}
+	this->bindScratch({}); // the Net binds its workspace, sized for the chosen algorithms
+	return;
+}
+
+template class ConvLayer<float>;
+template class ConvLayer<double>;
+template class ReLULayer<float>;
+template class ReLULayer<double>;
+template class PoolLayer<float>;
+template class PoolLayer<double>;
+template class AvgPoolLayer<float>;
+template class AvgPoolLayer<double>;
+template class GlobalAvgPoolLayer<float>;
+template class GlobalAvgPoolLayer<double>;
+template class FCLayer<float>;
+template class FCLayer<double>;
+template class DropoutLayer<float>;
+template class DropoutLayer<double>;
+template class SoftmaxLossLayer<float>;
+template class SoftmaxLossLayer<double>;
+template class SVMLossLayer<float>;
+template class SVMLossLayer<double>;
+template class BNLayer<float>;
+template class BNLayer<double>;
+template class ScaleLayer<float>;
+template class ScaleLayer<double>;
+template class TanhLayer<float>;
+template class TanhLayer<double>;
+template class ChainLayer<float>;
+template class ChainLayer<double>;
+template void ensureBlob<float>(shared_ptr<Blob<float>>&, const BlobShape&, int);
+template void ensureBlob<double>(shared_ptr<Blob<double>>&, const BlobShape&, int);
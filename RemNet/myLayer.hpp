@@ -3,10 +3,18 @@
 #include <iostream>
 #include <memory>
 #include "myBlob.hpp"
+#include "myConv.hpp"
+#include "myBlocked.hpp"
+#include "myPool.hpp"
+#include "myFuse.hpp"
+#include "myMath.hpp"
 
 using std::vector;
 using std::shared_ptr;
 
+// The three passes of a convolution, each of which may run a different algorithm
+enum ConvPass { CONV_FORWARD, CONV_BACKWARD_DATA, CONV_BACKWARD_WEIGHTS };
+
 struct Param { // Parameters for each layer
 	
 	// 1. Conv Layer parameters
@@ -16,6 +24,8 @@ struct Param { // Parameters for each layer
 	int conv_height;
 	int conv_kernels;
 	string conv_weight_init;
+	string conv_algo; // "auto" (default), "winograd" (3x3 stride 1 only), "fft", "gemm" (im2col + GEMM), "blocked" (NCHWc SIMD) or "direct" (one window per output pixel)
+	string conv_tuned[3]; // algorithm of each ConvPass picked by the autotuner, empty when the layer is not tuned
 
 	// 2. Pooling Layer parameters
 	int pool_stride;
@@ -28,131 +38,276 @@ struct Param { // Parameters for each layer
 
 	// 4. Dropout Layer parameters
 	double drop_rate;
+
+	// 5. Channel block of the NCHWc layout the layer runs on, 0 for plain NCHW (set by the Net)
+	int block = 0;
+
+	// 6. Layers fused into this Conv by the Net: the ReLU after it, and the max Pool after that (its window in pool_*)
+	bool fuse_relu = false;
+	bool fuse_pool = false;
+
+	// 7. Pointwise chain (set by the Net): on its first layer the number of following layers run by the same ChainLayer,
+	// on those layers chained (the Net skips them, they only keep their parameters)
+	int chain = 0;
+	bool chained = false;
+
+	// 8. Inference folding (set by the Net): on a Conv or FC the number of BN / Scale layers after it whose affine
+	// transform its weights and bias take in TEST, on a chain head the number of its leading ops that are thus skipped
+	int fold = 0;
+	int folded = 0;
 };
 
+template<typename Dtype>
 class Layer {
 public:
 	Layer(){}
 	virtual ~Layer() {}
-	virtual void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param) = 0;
+	virtual void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param) = 0;
 	virtual void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param) = 0;
-	virtual void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode) = 0;
-	virtual void backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache, 
-						  vector<shared_ptr<Blob>>& grads, const Param& param) = 0;
+	virtual void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode) = 0;
+	virtual void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache, 
+						  vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param) = 0;
+	// Shapes of the scratch Blobs the layer needs for a given input shape (carved out of the Net workspace)
+	virtual void calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param) {}
+	void bindScratch(const vector<shared_ptr<Blob<Dtype>>>& s) { scratch = s; }
+	// Benchmark the layer's algorithms on this input shape and record the fastest in param (only Conv has a choice)
+	virtual void tune(const vector<int>& inShape, const vector<shared_ptr<Blob<Dtype>>>& in, Param& param) {}
+protected:
+	Blob<Dtype>& getScratch(int i, const BlobShape& shape);
+	vector<shared_ptr<Blob<Dtype>>> scratch;
 };
 
-class ConvLayer:public Layer {
+// Make blob a Blob of the given shape, reusing the existing (preallocated) one when the shape matches
+template<typename Dtype>
+void ensureBlob(shared_ptr<Blob<Dtype>>& blob, const BlobShape& shape, int type = TDEFAULT);
+
+template<typename Dtype>
+class ConvLayer : public Layer<Dtype> {
 public:
-	ConvLayer() {}
+	ConvLayer() :wino_state(0) {}
 	~ConvLayer() {}
-	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param);
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
 	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
-	void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode);
-	void backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-		vector<shared_ptr<Blob>>& grads, const Param& param);
-
+	void calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
+	void tune(const vector<int>& inShape, const vector<shared_ptr<Blob<Dtype>>>& in, Param& param);
+private:
+	void forwardWith(const string& algo, const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param);
+	// Conv followed by the fused ReLU (and max pooling), chunk by chunk of samples where the algorithm allows
+	void forwardFused(const string& algo, const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backwardWith(const string& algo, const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts);
+	void forwardDirect(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param);
+	void forwardGemm(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param);
+	void forwardWinograd(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param);
+	void forwardFft(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param);
+	void forwardBlocked(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param);
+	void backwardDirect(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts);
+	void backwardGemm(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts);
+	void backwardWinograd(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts);
+	void backwardFft(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts);
+	void backwardBlocked(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param, int parts);
+	string requestedAlgo(const ConvShape& s, const Param& param, ConvPass pass) const; // resolves "auto" and the tuned choice
+	string pickAlgo(const ConvShape& s, const Param& param, ConvPass pass) const; // requestedAlgo plus the Winograd fallback
+	// Scratch is laid out as one group of Blobs per algorithm the layer uses, so passes running different algorithms share it
+	bool usesAlgo(const string& algo, const ConvShape& s, const Param& param) const;
+	void algoScratchShapes(const string& algo, const ConvShape& s, int N, vector<vector<int>>& shapes, const Param& param) const;
+	Blob<Dtype>& algoScratch(const string& algo, int i, const BlobShape& shape, const ConvShape& s, const Param& param);
+	// The fused layers' scratch follows all algorithm groups: the conv output (or its gradient), then the pool taps or ReLU mask
+	shared_ptr<Blob<Dtype>> fuseScratch(int i, const BlobShape& shape, const ConvShape& s, const Param& param);
+	void fusedShapes(const ConvShape& s, int N, BlobShape& convShape, BlobShape& outShape, const Param& param);
+	int wino_state; // Winograd accuracy check: 0 not run yet, 1 passed, -1 failed (gemm is used instead)
 };
 
-class ReLULayer:public Layer {
+template<typename Dtype>
+class ReLULayer : public Layer<Dtype> {
 public:
 	ReLULayer() {}
 	~ReLULayer() {}
-	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param);
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
 	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
-	void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode);
-	void backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-		vector<shared_ptr<Blob>>& grads, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
 
 };
 
-class PoolLayer:public Layer {
+template<typename Dtype>
+class PoolLayer : public Layer<Dtype> {
 public:
 	PoolLayer() {}
 	~PoolLayer() {}
-	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param);
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
 	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
-	void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode);
-	void backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-		vector<shared_ptr<Blob>>& grads, const Param& param);
+	void calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
+
+};
+
+// Same window parameters and output shape as PoolLayer, averaging instead of taking the max
+template<typename Dtype>
+class AvgPoolLayer : public PoolLayer<Dtype> {
+public:
+	AvgPoolLayer() {}
+	~AvgPoolLayer() {}
+	void calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
+};
 
+// Mean of every channel plane, (N, C, H, W) -> (N, C, 1, 1)
+template<typename Dtype>
+class GlobalAvgPoolLayer : public Layer<Dtype> {
+public:
+	GlobalAvgPoolLayer() {}
+	~GlobalAvgPoolLayer() {}
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
+	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
 };
 
-class FCLayer:public Layer {
+template<typename Dtype>
+class FCLayer : public Layer<Dtype> {
 public:
 	FCLayer() {}
 	~FCLayer() {}
-	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param);
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
 	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
-	void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode);
-	void backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-		vector<shared_ptr<Blob>>& grads, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
 };
 
-class DropoutLayer :public Layer {
+template<typename Dtype>
+class DropoutLayer : public Layer<Dtype> {
 public:
 	DropoutLayer() {}
 	~DropoutLayer() {}
-	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param);
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
 	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
-	void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode);
-	void backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-		vector<shared_ptr<Blob>>& grads, const Param& param);
-private:
-	shared_ptr<Blob> drop_mask;
+	void calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
 };
 
+template<typename Dtype>
 class SoftmaxLossLayer {
 public:
-	static void softmax_cross_entropy_with_logits(const vector<shared_ptr<Blob>>& in, double& loss, shared_ptr<Blob>& dout);
+	static void softmax_cross_entropy_with_logits(const vector<shared_ptr<Blob<Dtype>>>& in, double& loss, shared_ptr<Blob<Dtype>>& dout);
 };
 
+template<typename Dtype>
 class SVMLossLayer {
 public:
-	static void hinge_with_logits(const vector<shared_ptr<Blob>>& in, double& loss, shared_ptr<Blob>& dout);
+	static void hinge_with_logits(const vector<shared_ptr<Blob<Dtype>>>& in, double& loss, shared_ptr<Blob<Dtype>>& dout);
 };
 
-class BNLayer : public Layer {
+template<typename Dtype>
+class BNLayer : public Layer<Dtype> {
 public:
 	BNLayer() :running_mean_std_init(false) {}
 	~BNLayer(){}
-	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param);
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
 	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
-	void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode);
-	void backward(const shared_ptr<Blob>& din, const vector<shared_ptr<Blob>>& cache,
-		vector<shared_ptr<Blob>>& grads, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
 private:
 	bool running_mean_std_init;
-	shared_ptr<cube> mean; // negative mean
-	shared_ptr<cube> var;  // variance
-	shared_ptr<cube> std;  // standard deviation
+	vector<double> sum1, sum2; // per channel: mean and squared deviations in forward, sums of dy and dy * x_hat in backward
+	vector<Dtype> scale, shift; // x_hat = x * scale + shift per channel, from the statistics of the last training batch
 };
 
-class ScaleLayer : public Layer {
+template<typename Dtype>
+class ScaleLayer : public Layer<Dtype> {
 public:
 	ScaleLayer() {}
 	~ScaleLayer() {}
-	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param);
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
 	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
-	void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode);
-	void backward(const shared_ptr<Blob>& din,
-		const vector<shared_ptr<Blob>>& cache,
-		vector<shared_ptr<Blob>>& grads,
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din,
+		const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads,
 		const Param& param);
 };
 
-class TanhLayer : public Layer {
+template<typename Dtype>
+class TanhLayer : public Layer<Dtype> {
 public:
 	TanhLayer() {}
 	~TanhLayer() {}
-	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob>>& in, const Param& param);
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
 	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
-	void forward(const vector<shared_ptr<Blob>>& in, shared_ptr<Blob>& out, const Param& param, string mode);
-	void backward(const shared_ptr<Blob>& din,
-		const vector<shared_ptr<Blob>>& cache,
-		vector<shared_ptr<Blob>>& grads,
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din,
+		const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads,
 		const Param& param);
+private:
+	shared_ptr<Blob<Dtype>> y; // output of the last forward, backward works from it
 };
 
+// One layer of a ChainLayer: its type and Param, and the Net's data and gradient Blobs of that layer (for w, b and dw, db)
+template<typename Dtype>
+struct ChainOp {
+	ChainOpType type;
+	Param param;
+	vector<shared_ptr<Blob<Dtype>>>* data;
+	vector<shared_ptr<Blob<Dtype>>>* grads;
+	shared_ptr<Layer<Dtype>> layer; // BN runs through its own layer in training
+};
 
+// Consecutive ReLU, Tanh, Dropout, Scale and BN layers run as one: each FUSE_TILE values of the input go through all the
+// layers before the next tile is read, so the chain makes one pass over memory instead of one per layer. Backward replays
+// the tile's forward (Dropout keeps its mask) to get each layer's input, then runs the layers' gradients over it in reverse.
+// In training a BN needs whole-batch statistics, so the chain is cut there: the layers before it, the BN layer itself and
+// the layers after it run one after the other through scratch Blobs. The threads split the samples, each with tiles of its
+// own, except for a training forward with a Dropout (its draws keep their order) and a backward with a Scale (it sums dgamma).
+template<typename Dtype>
+class ChainLayer : public Layer<Dtype> {
+public:
+	ChainLayer(const vector<ChainOp<Dtype>>& ops);
+	~ChainLayer() {}
+	void initLayer(const vector<int>& inShape, const string& lname, vector<shared_ptr<Blob<Dtype>>>& in, const Param& param);
+	void calcShape(const vector<int>& inShape, vector<int>& outShape, const Param& param);
+	void calcScratch(const vector<int>& inShape, vector<vector<int>>& shapes, const Param& param);
+	void forward(const vector<shared_ptr<Blob<Dtype>>>& in, shared_ptr<Blob<Dtype>>& out, const Param& param, string mode);
+	void backward(const shared_ptr<Blob<Dtype>>& din, const vector<shared_ptr<Blob<Dtype>>>& cache,
+		vector<shared_ptr<Blob<Dtype>>>& grads, const Param& param);
+private:
+	// ops [first, last) over every tile of x into y, and their gradients from din into dx
+	void forwardOps(int first, int last, const Blob<Dtype>& x, Blob<Dtype>& y, bool train);
+	// y is the output of op last - 1, which a Tanh there is taken back from
+	void backwardOps(int first, int last, const Blob<Dtype>& x, const Blob<Dtype>& y, const Blob<Dtype>& din, Blob<Dtype>& dx);
+	// Op i over the m values of a tile (at: its offset in the batch, j: in its sample), false when the op leaves x as it is.
+	// tile is the calling thread's part of tiles. replay reapplies the Dropout masks instead of drawing new ones.
+	bool forwardTile(int i, const Dtype* x, Dtype* y, Dtype* tile, size_t at, size_t j, size_t m, size_t HW, bool train, bool replay);
+	void bindTiles(const BlobShape& inShape);
+	shared_ptr<Blob<Dtype>> chainScratch(int i, const BlobShape& shape);
+	vector<ChainOp<Dtype>> ops;
+	int bn; // index of the BN op, -1 without one
+	vector<int> drop; // mask of each Dropout op (-1 for the other ops)
+	int drops;
+	Dtype* tiles; // per thread: op outputs of the tile being taken back, then one tile of random numbers
+	unsigned char* masks; // Dropout masks, one byte per value of the batch for each Dropout op
+	size_t count; // values in the batch
+	vector<const Dtype*> vals; // per thread: input of every op of the tile being taken back
+	vector<shared_ptr<Blob<Dtype>>> bn_in, bn_grads; // what the BN layer is called with in training
+	shared_ptr<Blob<Dtype>> y; // output of the last forward
+};
 
 #endif  //__MYLAYER_HPP__
\ No newline at end of file
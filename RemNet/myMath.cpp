@@ -0,0 +1,157 @@
+#include "myMath.hpp"
+#include "mySimd.hpp"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+// Range limits and polynomial coefficients (highest power first). exp and log follow fdlibm, tanh Cephes.
+template<typename Dtype>
+struct MathConst;
+
+template<>
+struct MathConst<float> {
+	static const float expHi, expLo, ln2Hi, ln2Lo, logLn2Hi, logLn2Lo, round;
+	static const float expP[2], logP[7], tanhP[5], tanhQ[1];
+};
+const float MathConst<float>::expHi = 8.8722831726e+01f;
+const float MathConst<float>::expLo = -1.0397208405e+02f;
+const float MathConst<float>::ln2Hi = 6.9314575195e-01f;
+const float MathConst<float>::ln2Lo = 1.4286067653e-06f;
+const float MathConst<float>::logLn2Hi = 6.9313812256e-01f;
+const float MathConst<float>::logLn2Lo = 9.0580006145e-06f;
+const float MathConst<float>::round = 12582912.0f; // 1.5 * 2^23
+const float MathConst<float>::expP[2] = {-2.7667332906e-03f, 1.6666625440e-01f};
+const float MathConst<float>::logP[7] = {1.4798198640e-01f, 1.5313838422e-01f, 1.8183572590e-01f, 2.2222198546e-01f,
+	2.8571429849e-01f, 4.0000000596e-01f, 6.6666668653e-01f};
+const float MathConst<float>::tanhP[5] = {-5.70498872745e-03f, 2.06390887954e-02f, -5.37397155531e-02f, 1.33314422036e-01f, -3.33332819422e-01f};
+const float MathConst<float>::tanhQ[1] = {1.0f};
+
+template<>
+struct MathConst<double> {
+	static const double expHi, expLo, ln2Hi, ln2Lo, logLn2Hi, logLn2Lo, round;
+	static const double expP[5], logP[7], tanhP[3], tanhQ[4];
+};
+const double MathConst<double>::expHi = 7.09782712893383973096e+02;
+const double MathConst<double>::expLo = -7.45133219101941108420e+02;
+const double MathConst<double>::ln2Hi = 6.93147180369123816490e-01;
+const double MathConst<double>::ln2Lo = 1.90821492927058770002e-10;
+const double MathConst<double>::logLn2Hi = 6.93147180369123816490e-01;
+const double MathConst<double>::logLn2Lo = 1.90821492927058770002e-10;
+const double MathConst<double>::round = 6755399441055744.0; // 1.5 * 2^52
+const double MathConst<double>::expP[5] = {4.13813679705723846039e-08, -1.65339022054652515390e-06, 6.61375632143793436117e-05,
+	-2.77777777770155933842e-03, 1.66666666666666019037e-01};
+const double MathConst<double>::logP[7] = {1.479819860511658591e-01, 1.531383769920937332e-01, 1.818357216161805012e-01,
+	2.222219843214978396e-01, 2.857142874366239149e-01, 3.999999999940941908e-01, 6.666666666666735130e-01};
+const double MathConst<double>::tanhP[3] = {-9.64399179425052238628e-01, -9.92877231001918586564e+01, -1.61468768441708447952e+03};
+const double MathConst<double>::tanhQ[4] = {1.0, 1.12811678491632931402e+02, 2.23548839060100448583e+03, 4.84406305325125486048e+03};
+
+// Horner's rule
+template<typename V, int N>
+static inline V poly(V x, const typename V::T (&c)[N]) {
+	V r = V::set(c[0]);
+	for (int i = 1; i < N; i++)
+		r = V::madd(r, x, V::set(c[i]));
+	return r;
+}
+
+// x = k ln2 + r with |r| <= ln2 / 2, e^r from a rational approximation, then scaled by 2^k in two factors so
+// that k from the denormal to the overflow end stays within normal exponents
+template<typename V>
+static inline V expV(V x) {
+	typedef typename V::T Dtype;
+	typedef MathConst<Dtype> K;
+	const V one = V::set(1), rnd = V::set(K::round);
+	V xc = V::min(V::max(x, V::set(K::expLo)), V::set(K::expHi));
+	V k = V::madd(xc, V::set(Dtype(1.44269504088896338700)), rnd) - rnd;
+	V hi = V::madd(k, V::set(-K::ln2Hi), xc), lo = k * V::set(K::ln2Lo);
+	V r = hi - lo, t = r * r;
+	V c = r - t * poly(t, K::expP);
+	V y = one - ((lo - (r * c) / (V::set(2) - c)) - hi);
+	V k1 = V::madd(k, V::set(Dtype(0.5)), rnd) - rnd;
+	y = y * V::pow2(k1) * V::pow2(k - k1);
+	y = V::ifLess(V::set(K::expHi), x, V::set(std::numeric_limits<Dtype>::infinity()), y);
+	return V::ifLess(x, V::set(K::expLo), V::set(0), y);
+}
+
+// x = 2^e (1 + f) with 1 + f in [sqrt(2) / 2, sqrt(2)), log(1 + f) = 2 atanh(s) with s = f / (2 + f)
+template<typename V>
+static inline V logV(V x) {
+	typedef typename V::T Dtype;
+	typedef MathConst<Dtype> K;
+	const V one = V::set(1), half = V::set(Dtype(0.5)), sqrt1_2 = V::set(Dtype(0.70710678118654752440));
+	const V tiny = V::set(std::numeric_limits<Dtype>::min());
+	V e, m = V::frexp(V::max(x, tiny), e);
+	e = V::ifLess(m, sqrt1_2, e - one, e);
+	V f = V::ifLess(m, sqrt1_2, m + m, m) - one;
+	V s = f / (V::set(2) + f), z = s * s;
+	V R = z * poly(z, K::logP), hfsq = half * f * f;
+	V y = e * V::set(K::logLn2Hi) - ((hfsq - V::madd(s, hfsq + R, e * V::set(K::logLn2Lo))) - f);
+	y = V::ifLess(x, tiny, V::set(-std::numeric_limits<Dtype>::infinity()), y);
+	y = V::ifLess(x, V::set(0), V::set(std::numeric_limits<Dtype>::quiet_NaN()), y);
+	return V::ifLess(V::set(std::numeric_limits<Dtype>::max()), x, V::set(std::numeric_limits<Dtype>::infinity()), y);
+}
+
+// |x| < 0.625: x + x^3 P(x^2) / Q(x^2); above: 1 - 2 / (e^2|x| + 1) with the sign of x (1 once e^2|x| overflows)
+template<typename V>
+static inline V tanhV(V x) {
+	typedef typename V::T Dtype;
+	typedef MathConst<Dtype> K;
+	const V zero = V::set(0), one = V::set(1);
+	V a = V::max(x, zero - x), z = x * x;
+	V s = V::madd(x * z, poly(z, K::tanhP) / poly(z, K::tanhQ), x);
+	V l = one - V::set(2) / (expV(a + a) + one);
+	l = V::ifLess(x, zero, zero - l, l);
+	return V::ifLess(a, V::set(Dtype(0.625)), s, l);
+}
+
+// 1 / (1 + e^-x), taken as e^x / (1 + e^x) for negative x so that small results keep their precision
+template<typename V>
+static inline V sigmoidV(V x) {
+	const V zero = V::set(0), one = V::set(1);
+	V e = expV(V::min(x, zero - x)), s = one / (one + e);
+	return V::ifLess(x, zero, e * s, s);
+}
+
+// Runs f over whole vectors, and over the tail padded to a whole vector
+template<typename Dtype, MathVec<Dtype> (*f)(MathVec<Dtype>)>
+static void mapVec(const Dtype* x, Dtype* y, size_t n) {
+	typedef MathVec<Dtype> V;
+	size_t i = 0;
+	for (; i + V::W <= n; i += V::W)
+		f(V::load(x + i)).store(y + i);
+	if (i < n) {
+		Dtype t[V::W] = {0};
+		std::copy(x + i, x + n, t);
+		f(V::load(t)).store(t);
+		std::copy(t, t + (n - i), y + i);
+	}
+}
+
+template<typename Dtype>
+void vecExp(const Dtype* x, Dtype* y, size_t n) {
+	mapVec<Dtype, expV<MathVec<Dtype>>>(x, y, n);
+}
+
+template<typename Dtype>
+void vecLog(const Dtype* x, Dtype* y, size_t n) {
+	mapVec<Dtype, logV<MathVec<Dtype>>>(x, y, n);
+}
+
+template<typename Dtype>
+void vecTanh(const Dtype* x, Dtype* y, size_t n) {
+	mapVec<Dtype, tanhV<MathVec<Dtype>>>(x, y, n);
+}
+
+template<typename Dtype>
+void vecSigmoid(const Dtype* x, Dtype* y, size_t n) {
+	mapVec<Dtype, sigmoidV<MathVec<Dtype>>>(x, y, n);
+}
+
+template void vecExp<float>(const float*, float*, size_t);
+template void vecExp<double>(const double*, double*, size_t);
+template void vecLog<float>(const float*, float*, size_t);
+template void vecLog<double>(const double*, double*, size_t);
+template void vecTanh<float>(const float*, float*, size_t);
+template void vecTanh<double>(const double*, double*, size_t);
+template void vecSigmoid<float>(const float*, float*, size_t);
+template void vecSigmoid<double>(const double*, double*, size_t);
@@ -1,8 +1,12 @@
 #include "myNet.hpp"
 #include "myBlob.hpp"
+#include "myThread.hpp"
 #include <json/json.h>
 #include <fstream>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <mutex>
 using namespace std;
 
 void NetParam::readNetParam(string file) {
@@ -20,6 +24,8 @@ void NetParam::readNetParam(string file) {
 			this->optimizer= tparam["update method"].asString();
 			this->momentum = tparam["momentum parameter"].asDouble();
 			this->rmsprop = tparam["rmsprop"].asDouble();
+			this->adam_beta1 = tparam.get("adam beta1", 0.9).asDouble();
+			this->adam_beta2 = tparam.get("adam beta2", 0.999).asDouble();
 			this->reg = tparam["reg coefficient"].asDouble();
 			this->epochs = tparam["epochs"].asInt();
 			this->use_batch = tparam["use batch"].asBool();
@@ -28,8 +34,20 @@ void NetParam::readNetParam(string file) {
 			this->update_lr = tparam["frequence update"].asBool();
 			this->snap_shot = tparam["snapshot"].asBool();
 			this->snapshot_interval = tparam["snapshot interval"].asInt();
+			this->snapshot_folded = tparam.get("snapshot folded", false).asBool();
 			this->fine_tune = tparam["fine tune"].asBool();
 			this->preTrainedModel = tparam["pre trained model"].asString();
+			this->precision = tparam.get("precision", "double").asString();
+			assert(this->precision == "float" || this->precision == "double");
+			this->layout = tparam.get("layout", "NCHW").asString();
+			assert(this->layout == "NCHW" || this->layout == "NCHWc");
+			this->conv_tune = tparam.get("conv autotune", false).asBool();
+			this->tune_cache = tparam.get("tune cache", "./RemNet.tune.json").asString();
+			this->fuse_layers = tparam.get("layer fusion", true).asBool();
+			this->threads = tparam.get("threads", 0).asInt();
+			this->replicas = tparam.get("replicas", 1).asInt();
+			this->hogwild = tparam.get("hogwild", false).asBool();
+			assert(this->replicas >= 1 && this->replicas <= this->batch_size);
 		}
 
 		if (!value["net"].isNull()) {
@@ -48,9 +66,10 @@ void NetParam::readNetParam(string file) {
 					this->lparams[name].conv_pad = layer["pad"].asInt();
 					this->lparams[name].conv_stride = layer["stride"].asInt();
 					this->lparams[name].conv_weight_init = layer["conv weight init"].asString();
+					this->lparams[name].conv_algo = layer.get("conv algo", "auto").asString();
 				}
 
-				if (layer["type"].asString() == "Pool") {
+				if (layer["type"].asString() == "Pool" || layer["type"].asString() == "AvgPool") {
 					this->lparams[name].pool_height = layer["kernel height"].asInt();
 					this->lparams[name].pool_width = layer["kernel width"].asInt();
 					this->lparams[name].pool_stride = layer["stride"].asInt();
@@ -69,12 +88,67 @@ void NetParam::readNetParam(string file) {
 	}	
 }
 
-void Net::initNet(NetParam& param, vector<shared_ptr<Blob>>& x, vector<shared_ptr<Blob>>& y) {
-	// 1. Print layer structure
+// Layer types that have an NCHWc implementation
+static bool blockedType(const string& ltype) {
+	return ltype == "Conv" || ltype == "ReLU" || ltype == "Pool" || ltype == "AvgPool" || ltype == "GlobalAvgPool";
+}
+
+// Layer types a ChainLayer can run
+static bool pointwiseType(const string& ltype) {
+	return ltype == "ReLU" || ltype == "Tanh" || ltype == "Dropout" || ltype == "Scale" || ltype == "BN";
+}
+
+template<typename Dtype>
+static shared_ptr<Layer<Dtype>> createLayer(const string& ltype) {
+	shared_ptr<Layer<Dtype>> myLayer(NULL);
+	if (ltype == "Conv") 
+		myLayer.reset(new ConvLayer<Dtype>);
+
+	if (ltype == "ReLU") 
+		myLayer.reset(new ReLULayer<Dtype>);
+
+	if (ltype == "Pool") 
+		myLayer.reset(new PoolLayer<Dtype>);
+
+	if (ltype == "AvgPool")
+		myLayer.reset(new AvgPoolLayer<Dtype>);
+
+	if (ltype == "GlobalAvgPool")
+		myLayer.reset(new GlobalAvgPoolLayer<Dtype>);
+
+	if (ltype == "FC") 
+		myLayer.reset(new FCLayer<Dtype>);
+
+	if (ltype == "Dropout") 
+		myLayer.reset(new DropoutLayer<Dtype>);
+
+	if (ltype == "BN")
+		myLayer.reset(new BNLayer<Dtype>);
+
+	if (ltype == "Scale")
+		myLayer.reset(new ScaleLayer<Dtype>);
+
+	if (ltype == "Tanh")
+		myLayer.reset(new TanhLayer<Dtype>);
+	return myLayer;
+}
+
+template<typename Dtype>
+void Net<Dtype>::initNet(NetParam& param, vector<shared_ptr<Blob<Dtype>>>& x, vector<shared_ptr<Blob<Dtype>>>& y) {
+	// 1. Print layer structure. The thread count comes first: per-thread scratch is sized from it
+	ThreadPool::get().setThreads(param.threads);
+	cout << "threads = " << ThreadPool::get().threads() << endl;
+	// A Hogwild! replica needs a thread of its own to run, the ones beyond the thread count would never train
+	if (param.hogwild && param.replicas > ThreadPool::get().threads()) {
+		param.replicas = ThreadPool::get().threads();
+		cout << "Hogwild! replicas capped at the thread count: " << param.replicas << endl;
+	}
 	layers = param.layers;
 	ltypes = param.ltypes;
 	for (int i = 0; i < layers.size(); i++)
 		cout << "layer = " << layers[i] << "," << "ltypes = " << ltypes[i] << endl;
+	if (param.fuse_layers)
+		fuseLayers(param);
 
 	// 2. Initializes the member variables in the Net class
 	x_train = x[0];
@@ -83,41 +157,44 @@ void Net::initNet(NetParam& param, vector<shared_ptr<Blob>>& x, vector<shared_pt
 	y_val = y[1];
 
 	for (int i = 0; i < (int)layers.size(); i++) { // Go through each layer
-		data[layers[i]] = vector<shared_ptr<Blob>>(3, NULL); //x, w, b
-		gradient[layers[i]] = vector<shared_ptr<Blob>>(3, NULL);
-		step_cache[layers[i]] = vector<shared_ptr<Blob>>(3, NULL);
+		data[layers[i]] = vector<shared_ptr<Blob<Dtype>>>(3, NULL); //x, w, b
+		gradient[layers[i]] = vector<shared_ptr<Blob<Dtype>>>(3, NULL);
+		step_cache[layers[i]] = vector<shared_ptr<Blob<Dtype>>>(3, NULL);
 		outShapes[layers[i]] = vector<int>(4); // Define the cache to store the output size of each layer
 	}
 
+	// Conv, ReLU and pooling layers at the front of the net share the NCHWc layout, conversions happen only around them
+	if (param.layout == "NCHWc")
+		while (blocked_layers < (int)layers.size() - 1 && blockedType(ltypes[blocked_layers]) && !param.lparams[layers[blocked_layers]].chain)
+			param.lparams[layers[blocked_layers++]].block = CBLOCK;
+
+	// Training steps run on batches of train_batch samples (with replicas, the first shard of a batch; Hogwild!
+	// replicas take whole batches), the workspace is sized and the conv layers are tuned for it
+	train_batch = param.hogwild ? param.batch_size : rangeBegin(param.batch_size, param.replicas, 1);
+
 	 // 3. Complete the initialization of each layer w and b
-	shared_ptr<Layer> myLayer(NULL);
 	vector<int> inShape = {param.batch_size, x_train->getC(), x_train->getH(), x_train->getW()};
 	cout << "input -> (" << inShape[0] << ", " << inShape[1] << ", " << inShape[2] << ", " << inShape[3] << ")" << endl;
+	map<string, vector<string>> tuneCache;
+	bool tuneUpdated = false;
+	if (param.conv_tune)
+		tuneCache = loadTuneCache(param.tune_cache, cpuModel());
 	for (int i = 0; i < (int)layers.size() - 1; i++) {
 		string lname = layers[i];
 		string ltype = ltypes[i];
-
-		if (ltype == "Conv") 
-			myLayer.reset(new ConvLayer);
-	
-		if (ltype == "ReLU") 
-			myLayer.reset(new ReLULayer);
-	
-		if (ltype == "Pool") 
-			myLayer.reset(new PoolLayer);
-
-		if (ltype == "FC") 
-			myLayer.reset(new FCLayer);
-
-		if (ltype == "Dropout") 
-			myLayer.reset(new DropoutLayer);
-
+		shared_ptr<Layer<Dtype>> myLayer = createLayer<Dtype>(ltype);
 		myLayers[lname] = myLayer;
 		myLayer->initLayer(inShape, lname, data[lname], param.lparams[lname]);
 		myLayer->calcShape(inShape, outShapes[lname], param.lparams[lname]);
+		if (ltype == "Conv" && param.conv_tune)
+			tuneConv(lname, inShape, param, tuneCache, tuneUpdated);
 		inShape.assign(outShapes[lname].begin(), outShapes[lname].end());
 		cout << lname << "->(" << outShapes[lname][0] << "," << outShapes[lname][1] << "," << outShapes[lname][2] << "," << outShapes[lname][3] << ")" << endl;
 	}
+	if (tuneUpdated)
+		saveTuneCache(param.tune_cache, cpuModel(), tuneCache);
+
+	buildChains(param);
 	if (param.fine_tune) {
 		fstream input(param.preTrainedModel, ios::in | ios::binary);
 		if (!input) {
@@ -132,38 +209,367 @@ void Net::initNet(NetParam& param, vector<shared_ptr<Blob>>& x, vector<shared_pt
 		cout << "-----Load the " << param.preTrainedModel << " successfully !" << endl;
 		loadModelParam(snapshot_model);
 	}
+
+	// The folded weights and bias, refreshed before every TEST pass
+	for (auto lname : layers)
+		if (param.lparams[lname].fold) {
+			folded[lname] = vector<shared_ptr<Blob<Dtype>>>(3, NULL);
+			folded[lname][1].reset(new Blob<Dtype>(data[lname][1]->size()));
+			folded[lname][2].reset(new Blob<Dtype>(data[lname][2]->size()));
+		}
+
+	// 4. Size the training workspace once, every iteration reuses it
+	bindWorkspace(train_batch, param);
+
+	// 5. Parameters, their gradients and the optimizer state in flat arenas, so that no update step has to allocate
+	buildArenas(param);
+
+	// 6. The replicas that take back the other shards of every training batch, or batches of their own
+	for (int k = 1; k < param.replicas; k++) {
+		int shard = rangeBegin(param.batch_size, param.replicas, k + 1) - rangeBegin(param.batch_size, param.replicas, k);
+		replicas.push_back(shared_ptr<Net<Dtype>>(new Net<Dtype>));
+		replicas.back()->initReplica(*this, param, param.hogwild ? param.batch_size : shard);
+	}
+	if (param.replicas > 1 && param.hogwild)
+		cout << "replicas -> " << param.replicas << ", Hogwild! on batches of " << train_batch << " samples" << endl;
+	else if (param.replicas > 1)
+		cout << "replicas -> " << param.replicas << ", shards of " << train_batch << " samples or fewer" << endl;
+}
+
+template<typename Dtype>
+void Net<Dtype>::initReplica(Net<Dtype>& master, NetParam& param, int batch) {
+	// 1. The master's (already fused) layer list, each layer built anew on the master's parameters
+	layers = master.layers;
+	ltypes = master.ltypes;
+	x_train = master.x_train;
+	y_train = master.y_train;
+	blocked_layers = master.blocked_layers;
+	vector<int> inShape = {batch, x_train->getC(), x_train->getH(), x_train->getW()};
+	for (int i = 0; i < (int)layers.size(); i++) {
+		string lname = layers[i];
+		data[lname] = vector<shared_ptr<Blob<Dtype>>>(3, NULL);
+		gradient[lname] = vector<shared_ptr<Blob<Dtype>>>(3, NULL);
+		outShapes[lname] = vector<int>(4);
+		if (i == (int)layers.size() - 1)
+			break;
+		for (int j = 1; j <= 2; j++) // BN updates its running statistics in forward, a replica keeps a copy of them
+			if (master.data[lname][j])
+				data[lname][j] = ltypes[i] == "BN" ? shared_ptr<Blob<Dtype>>(new Blob<Dtype>(*master.data[lname][j])) : master.data[lname][j];
+		myLayers[lname] = createLayer<Dtype>(ltypes[i]);
+		myLayers[lname]->initLayer(inShape, lname, data[lname], param.lparams[lname]);
+		myLayers[lname]->calcShape(inShape, outShapes[lname], param.lparams[lname]);
+		inShape = outShapes[lname];
+	}
+	buildChains(param);
+
+	// 2. Activations and scratch for its shard, and parameter gradients laid out as the master's
+	train_batch = batch;
+	bindWorkspace(batch, param);
+	vector<string> trained = trainedLayers();
+	for (int i = 1; i <= 2; i++)
+		for (auto lname : trained)
+			grad_arena.declare(i == 1 ? "w" : "b", data[lname][i]->size());
+	grad_arena.allocate();
+	for (int k = 0; k < (int)trained.size(); k++)
+		for (int i = 1; i <= 2; i++)
+			gradient[trained[k]][i] = grad_arena[i == 1 ? "w" : "b"][k];
 }
 
-void Net::trainNet(NetParam& param) {
+template<typename Dtype>
+void Net<Dtype>::buildChains(NetParam& param) {
+	// The first layer of every pointwise chain runs the whole chain, with the parameters of all its layers
+	for (int i = 0; i < (int)layers.size() - 1; i++) {
+		int k = param.lparams[layers[i]].chain;
+		if (!k)
+			continue;
+		vector<ChainOp<Dtype>> ops;
+		for (int j = i; j <= i + k; j++) {
+			const string& t = ltypes[j];
+			ChainOpType type = t == "ReLU" ? CHAIN_RELU : t == "Tanh" ? CHAIN_TANH : t == "Dropout" ? CHAIN_DROPOUT : t == "Scale" ? CHAIN_SCALE : CHAIN_BN;
+			ops.push_back({type, param.lparams[layers[j]], &data[layers[j]], &gradient[layers[j]], myLayers[layers[j]]});
+		}
+		myLayers[layers[i]].reset(new ChainLayer<Dtype>(ops));
+	}
+}
+
+template<typename Dtype>
+vector<string> Net<Dtype>::trainedLayers() {
+	// Layers with a w and b, in order (the w and b of BN are its running statistics)
+	vector<string> trained;
+	for (int l = 0; l < (int)layers.size(); l++)
+		if (data[layers[l]][1] && data[layers[l]][2] && ltypes[l] != "BN")
+			trained.push_back(layers[l]);
+	return trained;
+}
+
+template<typename Dtype>
+void Net<Dtype>::buildArenas(NetParam& param) {
+	// 1. Declare the w of every trained layer, then their b
+	vector<string> trained = trainedLayers();
+	optim = optimType(param.optimizer);
+	int states = optimStates(optim);
+	for (int i = 1; i <= 2; i++)
+		for (auto lname : trained) {
+			string group = i == 1 ? "w" : "b";
+			param_arena.declare(group, data[lname][i]->size());
+			grad_arena.declare(group, data[lname][i]->size());
+			for (int s = 0; s < states; s++)
+				state_arena[s].declare(group, data[lname][i]->size());
+		}
+	param_arena.allocate();
+	grad_arena.allocate();
+	for (int s = 0; s < states; s++)
+		state_arena[s].allocate();
+
+	// 2. Copy the initialized (or loaded) parameters in and hand the layers views into the arenas
+	for (int k = 0; k < (int)trained.size(); k++)
+		for (int i = 1; i <= 2; i++) {
+			string lname = trained[k], group = i == 1 ? "w" : "b";
+			*param_arena[group][k] = *data[lname][i];
+			data[lname][i] = param_arena[group][k];
+			gradient[lname][i] = grad_arena[group][k];
+			if (states)
+				step_cache[lname][i] = state_arena[0][group][k];
+		}
+	arena_w = param_arena.span("w");
+	cout << "parameters -> " << trained.size() << " layers, " << param_arena.bytes() / 1048576.0 << " MB per arena" << endl;
+}
+
+template<typename Dtype>
+void Net<Dtype>::fuseLayers(NetParam& param) {
+	// Conv -> ReLU (-> max Pool) leaves only the Conv in the layer list: it applies the ReLU and the pooling to
+	// its output while that is still in cache (the two layers have no parameters, snapshots are unaffected)
+	for (int i = 0; i + 1 < (int)layers.size() - 1; i++) {
+		if (ltypes[i] != "Conv" || ltypes[i + 1] != "ReLU")
+			continue;
+		Param& conv = param.lparams[layers[i]];
+		conv.fuse_relu = true;
+		string fused = layers[i + 1];
+		int n = 1;
+		if (i + 2 < (int)layers.size() - 1 && ltypes[i + 2] == "Pool") {
+			const Param& pool = param.lparams[layers[i + 2]];
+			conv.fuse_pool = true;
+			conv.pool_height = pool.pool_height;
+			conv.pool_width = pool.pool_width;
+			conv.pool_stride = pool.pool_stride;
+			fused += ", " + layers[i + 2];
+			n = 2;
+		}
+		cout << layers[i] << " fused with " << fused << endl;
+		layers.erase(layers.begin() + i + 1, layers.begin() + i + 1 + n);
+		ltypes.erase(ltypes.begin() + i + 1, ltypes.begin() + i + 1 + n);
+	}
+
+	// Runs of pointwise layers become one ChainLayer on the first of them. The others keep their place in the layer
+	// list, so their parameters are still trained and saved under their names, but the Net skips them.
+	// A chain takes at most one BN (in training the chain is cut around it).
+	for (int i = 0; i < (int)layers.size() - 1;) {
+		int j = i;
+		bool bn = false;
+		while (j < (int)layers.size() - 1 && pointwiseType(ltypes[j]) && !(bn && ltypes[j] == "BN"))
+			bn |= ltypes[j++] == "BN";
+		if (j - i >= 2) {
+			param.lparams[layers[i]].chain = j - i - 1;
+			string chained;
+			for (int m = i + 1; m < j; m++) {
+				param.lparams[layers[m]].chained = true;
+				chained += (m > i + 1 ? ", " : "") + layers[m];
+			}
+			cout << layers[i] << " chained with " << chained << endl;
+		}
+		i = max(j, i + 1);
+	}
+
+	// In TEST the BN and Scale layers right after a Conv or FC only scale and shift each of its output channels, so the
+	// Conv / FC runs with weights and bias that include them (see foldAffine) and writes to the first layer left.
+	// Where that layer is inside a chain, the chain head runs and skips the ops before it.
+	for (int i = 0; i < (int)layers.size() - 1; i++) {
+		Param& lparam = param.lparams[layers[i]];
+		if ((ltypes[i] != "Conv" && ltypes[i] != "FC") || lparam.fuse_relu)
+			continue;
+		int e = i + 1;
+		string folds;
+		for (; e < (int)layers.size() - 1 && (ltypes[e] == "BN" || ltypes[e] == "Scale"); e++)
+			folds += (e > i + 1 ? ", " : "") + layers[e];
+		if (e == i + 1)
+			continue;
+		lparam.fold = e - i - 1;
+		int head = e;
+		while (param.lparams[layers[head]].chained)
+			head--;
+		param.lparams[layers[head]].folded = e - head;
+		cout << layers[i] << " folds " << folds << " at inference" << endl;
+	}
+}
+
+template<typename Dtype>
+void Net<Dtype>::foldAffine(NetParam& param) {
+	// Output channel f of a Conv / FC followed by the layers it folds becomes a * (w_f * x + b_f) + c, with
+	// y -> (y + m) / s for a BN (m its running -mean, s its running std) and y -> gamma * y + beta for a Scale
+	for (int i = 0; i < (int)layers.size() - 1; i++) {
+		int k = param.lparams[layers[i]].fold;
+		if (!k)
+			continue;
+		const Blob<Dtype>& w = *data[layers[i]][1];
+		const Dtype* b = data[layers[i]][2]->memptr();
+		Blob<Dtype>& fw = *folded[layers[i]][1];
+		Dtype* fb = folded[layers[i]][2]->memptr();
+		size_t K = (size_t)w.getC() * w.getH() * w.getW();
+		for (int f = 0; f < w.getN(); f++) {
+			double a = 1, c = 0;
+			for (int j = i + 1; j <= i + k; j++) {
+				const vector<shared_ptr<Blob<Dtype>>>& p = data[layers[j]];
+				if (ltypes[j] == "BN") { // the running statistics are the same over a channel plane
+					size_t at = (size_t)f * p[1]->getH() * p[1]->getW();
+					double s = p[2]->memptr()[at];
+					a /= s;
+					c = (c + p[1]->memptr()[at]) / s;
+				} else {
+					double g = p[1]->memptr()[f];
+					a *= g;
+					c = g * c + p[2]->memptr()[f];
+				}
+			}
+			const Dtype* src = w.sample(f);
+			Dtype* dst = fw.sample(f);
+			for (size_t q = 0; q < K; q++)
+				dst[q] = Dtype(a * src[q]);
+			fb[f] = Dtype(a * b[f] + c);
+		}
+	}
+}
+
+template<typename Dtype>
+void Net<Dtype>::tuneConv(const string& lname, const vector<int>& inShape, NetParam& param, map<string, vector<string>>& cache, bool& updated) {
+	// 1. Layers with an explicit algorithm, and the NCHWc segment, are left alone
+	Param& lparam = param.lparams[lname];
+	if (lparam.conv_algo != "auto" || lparam.block)
+		return;
+
+	// 2. The layer is measured as training runs it: on train_batch samples, and with replicas on one thread (the
+	// kernels of a replica stay on its thread). Reuse the choice measured so on this CPU, or measure it now
+	vector<int> shape = inShape;
+	shape[0] = train_batch;
+	int threads = param.replicas > 1 ? 1 : ThreadPool::get().threads();
+	ConvShape s(shape, data[lname][1]->size(), lparam.conv_pad, lparam.conv_stride);
+	string key = convTuneKey(param.precision, s, train_batch, threads);
+	auto hit = cache.find(key);
+	bool cached = hit != cache.end();
+	if (cached) {
+		for (int pass = CONV_FORWARD; pass <= CONV_BACKWARD_WEIGHTS; pass++)
+			lparam.conv_tuned[pass] = hit->second[pass];
+	} else {
+		int all = ThreadPool::get().threads();
+		ThreadPool::get().setThreads(threads);
+		myLayers[lname]->tune(shape, data[lname], lparam);
+		ThreadPool::get().setThreads(all);
+		cache[key] = {lparam.conv_tuned[CONV_FORWARD], lparam.conv_tuned[CONV_BACKWARD_DATA], lparam.conv_tuned[CONV_BACKWARD_WEIGHTS]};
+		updated = true;
+	}
+	cout << lname << " conv algo: forward " << lparam.conv_tuned[CONV_FORWARD] << ", backward data " << lparam.conv_tuned[CONV_BACKWARD_DATA]
+		<< ", backward weights " << lparam.conv_tuned[CONV_BACKWARD_WEIGHTS] << (cached ? " (cached)" : " (tuned)") << endl;
+}
+
+template<typename Dtype>
+void Net<Dtype>::bindWorkspace(int N, NetParam& param) {
+	if (N == bound_batch)
+		return;
+	int n = layers.size();
+	shared_ptr<Workspace<Dtype>>& ws = workspaces[N];
+	if (!ws) {
+		// 1. Declare the input of every layer, its gradients and its scratch for this batch size
+		ws.reset(new Workspace<Dtype>);
+		bool with_grads = (N == train_batch); // Only training batches go through backward
+		vector<int> inShape = {N, x_train->getC(), x_train->getH(), x_train->getW()};
+		if (blocked_layers > 0)
+			ws->declare("blocked/x", blockedShape(inShape));
+		for (int i = 0; i < n - 1; i++) {
+			string lname = layers[i];
+			bool chained = param.lparams[lname].chained; // run by its chain, only its parameter gradients are needed
+			vector<int> outShape(4);
+			vector<vector<int>> scratchShapes;
+			myLayers[lname]->calcShape(inShape, outShape, param.lparams[lname]);
+			if (!chained)
+				myLayers[lname]->calcScratch(inShape, scratchShapes, param.lparams[lname]);
+			for (auto& shape : scratchShapes)
+				ws->declare(lname + "/scratch", shape);
+			// Activations and gradients inside the blocked layers are stored NCHWc
+			if (!param.lparams[layers[i + 1]].chained)
+				ws->declare(layers[i + 1] + "/x", i + 1 < blocked_layers ? blockedShape(outShape) : BlobShape(outShape));
+			if (i + 1 == blocked_layers) {
+				ws->declare("blocked/y", blockedShape(outShape));
+				if (with_grads)
+					ws->declare("blocked/dy", blockedShape(outShape));
+			}
+			if (with_grads && !chained) // dw and db live in the gradient arena
+				ws->declare(lname + "/dx", i < blocked_layers ? blockedShape(inShape) : BlobShape(inShape));
+			inShape = outShape;
+		}
+		if (with_grads)
+			ws->declare(layers.back() + "/dx", inShape); // Gradient of the loss w.r.t. the scores
+		ws->allocate();
+		cout << "workspace(batch " << N << ") -> " << ws->slots() << " blobs, " << ws->bytes() / 1048576.0 << " MB" << endl;
+	}
+
+	// 2. Point layer inputs, gradients and scratch at the workspace
+	for (int i = 0; i < n; i++) {
+		string lname = layers[i];
+		if (i > 0 && ws->has(lname + "/x"))
+			data[lname][0] = (*ws)[lname + "/x"][0];
+		if (ws->has(lname + "/dx"))
+			gradient[lname][0] = (*ws)[lname + "/dx"][0];
+		if (i < n - 1 && ws->has(lname + "/scratch"))
+			myLayers[lname]->bindScratch((*ws)[lname + "/scratch"]);
+	}
+	if (blocked_layers > 0) {
+		blocked_x = (*ws)["blocked/x"][0];
+		blocked_y = (*ws)["blocked/y"][0];
+		blocked_dy = ws->has("blocked/dy") ? (*ws)["blocked/dy"][0] : NULL;
+	}
+	bound_batch = N;
+}
+
+template<typename Dtype>
+void Net<Dtype>::trainNet(NetParam& param) {
 	
 	int N = x_train->getN(); // The total number of samples
 	int iter_per_epoch = N / param.batch_size;
 	// The total number of batches (iterations) = the number of batches contained in a single epoch * the number of epochs
 	int batchs = iter_per_epoch * param.epochs;
 	for (int iter = 0; iter < batchs; iter++) {
-		// 1. Obtain a mini-batch from the entire training set
-		shared_ptr<Blob> x_batch;
-		shared_ptr<Blob> y_batch;
-		x_batch.reset(new Blob(
-			(x_train->subBlob(
-			(iter * param.batch_size) % N,
-			(((iter +1)*param.batch_size) % N)
-		))));
-
-		y_batch.reset(new Blob(
-			(y_train->subBlob(
-			(iter * param.batch_size) % N,
-				(((iter + 1) * param.batch_size) % N)
-			))));
-
-		// 2. Train the network model with the mini-batch
-		train_with_batch(x_batch, y_batch, param);
+		// 1. Obtain a mini-batch from the entire training set (a view over x_train/y_train, no data is copied)
+		int start = (iter * param.batch_size) % N;
+		int end = ((iter + 1) * param.batch_size) % N;
+
+		// 2. Train the network model with the mini-batch, split over the replicas when there are some. Hogwild! replicas
+		// take every iteration up to the next report or snapshot, iter moves on to the last of them
+		long long allocs = heapAllocCount();
+		if (param.hogwild && !replicas.empty()) {
+			int last = iter;
+			while (last + 1 < batchs && last % param.acc_frequence != 0 && !(param.snap_shot && last > 0 && last % param.snapshot_interval == 0))
+				last++;
+			trainHogwild(iter, last, param);
+			iter = last;
+		} else if (replicas.empty()) {
+			x_batch->viewOf(*x_train, start, end);
+			y_batch->viewOf(*y_train, start, end);
+			train_with_batch(x_batch, y_batch, param);
+		} else
+			trainReplicas(start, param);
+		train_allocs += heapAllocCount() - allocs;
 
 		// 3. Evaluate the current accuracy of the model (training set and verification set)
 		if (iter % param.acc_frequence == 0) {
 			evaluate_with_batch(param);
-			printf("iter_%d   lr: %0.6f   train_loss: %f   val_loss: %f   train_acc: %0.2f%%   val_acc: %0.2f%%\n",
-				iter, param.lr, train_loss, val_loss, train_accu * 100, val_accu * 100);
+			printf("iter_%d   lr: %0.6f   train_loss: %f   val_loss: %f   train_acc: %0.2f%%   val_acc: %0.2f%%   allocs: %lld\n",
+				iter, param.lr, train_loss, val_loss, train_accu * 100, val_accu * 100, train_allocs);
+			if (param.hogwild && hog_samples > 0) {
+				printf("iter_%d   hogwild: %.0f samples/s   staleness: mean %.2f max %lld updates\n",
+					iter, hog_samples / hog_seconds, (double)hog_stale * param.batch_size / hog_samples, hog_stale_max);
+				hog_samples = hog_stale = hog_stale_max = 0;
+				hog_seconds = 0;
+			}
+			train_allocs = 0;
 		}
 		// 4. Save model
 		if (iter > 0 && param.snap_shot && iter % param.snapshot_interval == 0) {
@@ -173,7 +579,7 @@ void Net::trainNet(NetParam& param) {
 			fstream output(outputFile, ios::out | ios::trunc | ios::binary);
 
 			shared_ptr<RemNet::snapshotModel> snapshot_model(new RemNet::snapshotModel);
-			saveModelParam(snapshot_model);
+			saveModelParam(snapshot_model, param);
 
 			if (!snapshot_model->SerializeToOstream(&output)) {
 				cout << "Failed to Serialize snapshot_model to Ostream";
@@ -183,98 +589,209 @@ void Net::trainNet(NetParam& param) {
 	}
 }
 
-void Net::train_with_batch(shared_ptr<Blob> &x, shared_ptr<Blob>& y, NetParam& param, string mode) {
+template<typename Dtype>
+void Net<Dtype>::train_with_batch(shared_ptr<Blob<Dtype>> &x, shared_ptr<Blob<Dtype>>& y, NetParam& param, string mode) {
+	bindWorkspace(x->getN(), param);
+	batch_n = x->getN();
+	propagate(x, y, param, mode);
 
-	// 1. Populate the mini-batch with x in the initial layer
-	data[layers[0]][0] = x;
-	data[layers.back()][1] = y;
+	// 5. The L2 regularization loss (the update step applies its gradient)
+	if (param.reg != 0)
+		regular_with_batch(param, mode);
+
+	// 6. update parameters
+	if (mode == "TRAIN")
+		optimizer_with_batch(param);
+}
+
+template<typename Dtype>
+void Net<Dtype>::trainReplicas(int start, NetParam& param) {
+	// 1. Shard k of the batch (samples [b_k, b_k+1) of it, a view over x_train/y_train) goes to replica k, this Net
+	// taking the first. Each replica runs on a thread of its own, its layers then run their kernels on that thread.
+	int N = x_train->getN(), K = (int)replicas.size() + 1;
+	shard_share.resize(K);
+	for (int k = 0; k < K; k++) {
+		Net<Dtype>& r = k ? *replicas[k - 1] : *this;
+		int b0 = rangeBegin(param.batch_size, K, k), b1 = rangeBegin(param.batch_size, K, k + 1);
+		r.x_batch->viewOf(*x_train, (start + b0) % N, (start + b1) % N);
+		r.y_batch->viewOf(*y_train, (start + b0) % N, (start + b1) % N);
+		shard_share[k] = (double)(b1 - b0) / param.batch_size;
+	}
+	bindWorkspace(train_batch, param);
+	ThreadPool::get().run(K, [&](int k0, int k1, int) {
+		for (int k = k0; k < k1; k++) {
+			Net<Dtype>& r = k ? *replicas[k - 1] : *this;
+			r.propagate(r.x_batch, r.y_batch, param, "TRAIN");
+		}
+	});
+
+	// 2. Every layer averaged its gradients over its shard: the batch gradient is their mean weighted by the shard
+	// sizes, summed into this Net's gradient arena (the replicas read the parameters from this Net, only it is updated)
+	shard_grads.clear();
+	train_loss = shard_share[0] * train_loss;
+	for (int k = 1; k < K; k++) {
+		shard_grads.push_back(replicas[k - 1]->grad_arena.flat().memptr());
+		train_loss += shard_share[k] * replicas[k - 1]->train_loss;
+	}
+	gradReduce(grad_arena.flat().memptr(), shard_grads, shard_share, grad_arena.flat().count());
+
+	// 3. The L2 regularization loss and one update for the whole batch
+	batch_n = param.batch_size;
+	if (param.reg != 0)
+		regular_with_batch(param, "TRAIN");
+	optimizer_with_batch(param);
+}
+
+template<typename Dtype>
+void Net<Dtype>::trainHogwild(int first, int last, NetParam& param) {
+	// 1. Iterations [first, last] go to whichever replica is free, a thread per replica (initNet keeps no more replicas
+	// than threads). A replica reads the shared parameters in forward and backward, then applies its own update to them
+	// and to the shared optimizer state with no lock: updates of other replicas may land in between (Hogwild!).
+	int N = x_train->getN(), K = (int)replicas.size() + 1;
+	std::atomic<int> next(first);
+	std::mutex stats;
+	batch_n = param.batch_size;
+	bindWorkspace(train_batch, param);
+	auto t0 = std::chrono::steady_clock::now();
+	ThreadPool::get().run(K, [&](int k0, int k1, int) {
+		Net<Dtype>& r = k0 ? *replicas[k0 - 1] : *this;
+		long long stale = 0, stale_max = 0;
+		for (int iter = next++; iter <= last; iter = next++) {
+			int start = (iter * param.batch_size) % N, end = ((iter + 1) * param.batch_size) % N;
+			r.x_batch->viewOf(*x_train, start, end);
+			r.y_batch->viewOf(*y_train, start, end);
+			long long seen = optim_steps;
+			r.propagate(r.x_batch, r.y_batch, param, "TRAIN");
+			long long t = ++optim_steps;
+			applyStep(r.grad_arena.flat().memptr(), optimStep(param, t));
+			stale += t - 1 - seen;
+			stale_max = std::max(stale_max, t - 1 - seen);
+		}
+		std::lock_guard<std::mutex> g(stats);
+		hog_stale += stale;
+		hog_stale_max = std::max(hog_stale_max, stale_max);
+	});
+	hog_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	hog_samples += (long long)(last - first + 1) * param.batch_size;
+
+	// 2. The loss reported is that of the last batch this Net took, the learning rate decays once per iteration
+	if (param.reg != 0)
+		regular_with_batch(param, "TRAIN");
+	if (param.update_lr)
+		param.lr *= std::pow(param.lr_decay, last - first + 1);
+}
 
-	// 2. Layer by layer forward calculation
+template<typename Dtype>
+void Net<Dtype>::propagate(shared_ptr<Blob<Dtype>>& x, shared_ptr<Blob<Dtype>>& y, NetParam& param, string mode) {
+	// Replicas run this at the same time on the same param: it is only read (lparams through at(), never inserting)
+
+	// 1. Populate the mini-batch with x in the initial layer, the other Blobs come from the workspace
+	data[layers.back()][1] = y;
+	if (blocked_layers > 0) { // the blocked layers see the input as NCHWc
+		toBlocked(*x, *blocked_x);
+		data[layers[0]][0] = blocked_x;
+	} else
+		data[layers[0]][0] = x;
+	if (mode == "TEST")
+		foldAffine(param);
+
+	// 2. Layer by layer forward calculation, each layer writes straight into the input of the next one
 	int n = layers.size(); // The number of layers
 	for (int i = 0; i < n - 1; i++) {
 		string lname = layers[i];
-		shared_ptr<Blob> out;
-		myLayers[lname]->forward(data[lname], out, param.lparams[lname], mode);
-		data[layers[i+1]][0] = out;
-	
+		const Param& lparam = param.lparams.at(lname);
+		if (lparam.chained) // run by the first layer of its chain
+			continue;
+		string next = layers[i + 1 + lparam.chain];
+		bool unblock = (i + 1 == blocked_layers); // last blocked layer: back to NCHW for the rest of the net
+		vector<shared_ptr<Blob<Dtype>>>* in = &data[lname];
+		if (mode == "TEST" && lparam.fold) { // skip the folded layers, up to the head of the chain that runs the rest
+			in = &folded[lname];
+			(*in)[0] = data[lname][0];
+			for (i += 1 + lparam.fold; param.lparams.at(layers[i]).chained; i--)
+				;
+			next = layers[i--];
+		}
+		if (unblock) {
+			myLayers[lname]->forward(*in, blocked_y, lparam, mode);
+			fromBlocked(*blocked_y, *data[next][0]);
+		} else
+			myLayers[lname]->forward(*in, data[next][0], lparam, mode);
 	}
 	if (mode == "TRAIN") {
 		// 3. softmax and calc Loss
 		if (ltypes.back() == "Softmax")
-			SoftmaxLossLayer::softmax_cross_entropy_with_logits(data[layers.back()], train_loss, gradient[layers.back()][0]);
+			SoftmaxLossLayer<Dtype>::softmax_cross_entropy_with_logits(data[layers.back()], train_loss, gradient[layers.back()][0]);
 		if (ltypes.back() == "SVM")
-			SVMLossLayer::hinge_with_logits(data[layers.back()], train_loss, gradient[layers.back()][0]);
+			SVMLossLayer<Dtype>::hinge_with_logits(data[layers.back()], train_loss, gradient[layers.back()][0]);
 	} else {
 		if (ltypes.back() == "Softmax")
-			SoftmaxLossLayer::softmax_cross_entropy_with_logits(data[layers.back()], val_loss, gradient[layers.back()][0]);
+			SoftmaxLossLayer<Dtype>::softmax_cross_entropy_with_logits(data[layers.back()], val_loss, gradient[layers.back()][0]);
 		if (ltypes.back() == "SVM")
-			SVMLossLayer::hinge_with_logits(data[layers.back()], val_loss, gradient[layers.back()][0]);
+			SVMLossLayer<Dtype>::hinge_with_logits(data[layers.back()], val_loss, gradient[layers.back()][0]);
 	}
 	if (mode == "TRAIN") {
 		// 4. Layer by layer back propagation 
 		for (int i = n - 2; i >= 0; i--) {
 			string lname = layers[i];
-			myLayers[lname]->backward(gradient[layers[i + 1]][0], data[lname], gradient[lname], param.lparams[lname]);
+			const Param& lparam = param.lparams.at(lname);
+			if (lparam.chained)
+				continue;
+			string next = layers[i + 1 + lparam.chain];
+			if (i + 1 == blocked_layers) {
+				toBlocked(*gradient[next][0], *blocked_dy);
+				myLayers[lname]->backward(blocked_dy, data[lname], gradient[lname], lparam);
+			} else
+				myLayers[lname]->backward(gradient[next][0], data[lname], gradient[lname], lparam);
 		}
 	}
-
-	// 5. The effect of L2 regularization is applied to each layer gradient
-	if (param.reg != 0)
-		regular_with_batch(param, mode);
-
-	// 6. update parameters
-	if (mode == "TRAIN")
-		optimizer_with_batch(param);
-}
-
-Blob& Blob::operator= (double val) {
-	for (int i = 0; i < N; i++)
-		blob_data[i].fill(val);
-	return *this;
 }
 
-void Net::optimizer_with_batch(NetParam& param) {
-	for (auto lname : layers) {
-		// Skip the layer without weight and bias
-		if (!data[lname][1] || !data[lname][2])
-			continue;
+template<typename Dtype>
+void Net<Dtype>::optimizer_with_batch(NetParam& param) {
+	applyStep(grad_arena.flat().memptr(), optimStep(param, ++optim_steps));
 
-		for (int i = 1; i <= 2; i++) {
-			assert(param.optimizer == "sgd" || param.optimizer == "momentum" || param.optimizer == "rmsprop");
-			shared_ptr<Blob> dparam(new Blob(data[lname][i]->size(), TZEROS));
-			if (param.optimizer == "rmsprop") {
-				double rmsprop = param.rmsprop;
-				if (!step_cache[lname][i])
-					step_cache[lname][i].reset(new Blob(data[lname][i]->size(), TZEROS));
-				(*step_cache[lname][i]) = rmsprop * (*step_cache[lname][i]) + (1 - rmsprop) * (*gradient[lname][i]) * (*gradient[lname][i]);
-				(*dparam) = -param.lr * (*gradient[lname][i]) / sqrt((*step_cache[lname][i]) + 1e-8);
-			}
-				
-			else if (param.optimizer == "momentum") {
-				if (!step_cache[lname][i])
-					step_cache[lname][i].reset(new Blob(data[lname][i]->size(), TZEROS));
-				(*step_cache[lname][i]) = param.momentum * (*step_cache[lname][i]) + (*gradient[lname][i]);
-				(*dparam) = -param.lr * (*step_cache[lname][i]);
-			}
-			else
-				(*dparam) = -param.lr * (*gradient[lname][i]);
-
-			(*data[lname][i]) = (*data[lname][i]) + (*dparam);
-		}
-	}
 	// update lr
 	if (param.update_lr)
 		param.lr *= param.lr_decay;
 }
 
-void Net::evaluate_with_batch(NetParam& param) {
+template<typename Dtype>
+OptimStep Net<Dtype>::optimStep(const NetParam& param, long long t) const {
+	OptimStep step;
+	step.type = optim;
+	step.lr = param.lr;
+	step.beta1 = optim == OPTIM_MOMENTUM ? param.momentum : optim == OPTIM_RMSPROP ? param.rmsprop : param.adam_beta1;
+	step.beta2 = param.adam_beta2;
+	step.decay = param.reg / batch_n;
+	step.t = t;
+	return step;
+}
+
+template<typename Dtype>
+void Net<Dtype>::applyStep(const Dtype* dw, const OptimStep& step) {
+	// Every parameter of the net is updated in place by one fused pass over the flat arenas: the weights with
+	// the L2 term folded in, then the biases
+	int states = optimStates(optim);
+	Dtype* w = param_arena.flat().memptr();
+	Dtype* s1 = states > 0 ? state_arena[0].flat().memptr() : NULL;
+	Dtype* s2 = states > 1 ? state_arena[1].flat().memptr() : NULL;
+	size_t nw = arena_w->count(), n = param_arena.flat().count();
+	OptimStep b = step;
+	b.decay = 0;
+	optimUpdate(w, dw, s1, s2, nw, step);
+	optimUpdate(w + nw, dw + nw, s1 ? s1 + nw : NULL, s2 ? s2 + nw : NULL, n - nw, b);
+}
+
+template<typename Dtype>
+void Net<Dtype>::evaluate_with_batch(NetParam& param) {
 	// Evaluate the accuracy of the training set
-	shared_ptr<Blob> x_train_subset;
-	shared_ptr<Blob> y_train_subset;
+	shared_ptr<Blob<Dtype>> x_train_subset;
+	shared_ptr<Blob<Dtype>> y_train_subset;
 	int N = x_train->getN();
 	if (N > 1000) {
-		x_train_subset.reset(new Blob(x_train->subBlob(0, 1000)));
-		y_train_subset.reset(new Blob(y_train->subBlob(0, 1000)));
+		x_train_subset.reset(new Blob<Dtype>(x_train->view(0, 1000)));
+		y_train_subset.reset(new Blob<Dtype>(y_train->view(0, 1000)));
 	} else {
 		x_train_subset = x_train;
 		y_train_subset = y_train;
@@ -290,7 +807,8 @@ void Net::evaluate_with_batch(NetParam& param) {
 
 }
 
-double Net::calc_accuracy(Blob& y, Blob& pred) {
+template<typename Dtype>
+double Net<Dtype>::calc_accuracy(Blob<Dtype>& y, Blob<Dtype>& pred) {
 	vector<int> size_y = y.size();
 	vector<int> size_p = pred.size();
 	for (int i = 0; i < 4; i++)
@@ -304,18 +822,27 @@ double Net::calc_accuracy(Blob& y, Blob& pred) {
 	return (double)count / (double)N; // acc%
 }
 
-void Net::saveModelParam(shared_ptr<RemNet::snapshotModel>& snapshot_model) {
-	// Those without weight and bias do not need to be stored
-	for (auto lname : layers) {
+template<typename Dtype>
+void Net<Dtype>::saveModelParam(shared_ptr<RemNet::snapshotModel>& snapshot_model, NetParam& param) {
+	// A folded snapshot holds the folded weights and bias of each Conv / FC and leaves out the layers folded into it
+	if (param.snapshot_folded)
+		foldAffine(param);
+	for (int l = 0; l < (int)layers.size(); l++) {
+		string lname = layers[l];
+		// Those without weight and bias do not need to be stored
 		if (!data[lname][1] || !data[lname][2])
 			continue;
+		int fold = param.lparams[lname].fold;
+		vector<shared_ptr<Blob<Dtype>>>& params = param.snapshot_folded && fold ? folded[lname] : data[lname];
+		if (param.snapshot_folded)
+			l += fold;
 		// Take all parameters from the relevant Blob and fill in the snapshotModel
 		for (int i = 1; i <= 2; i++) { // weightbias
 			RemNet::snapshotModel_paramBlok* param_blok = snapshot_model->add_param_blok(); // Dynamically add a param blok
-			int N = data[lname][i]->getN();
-			int C = data[lname][i]->getC();
-			int H = data[lname][i]->getH();
-			int W = data[lname][i]->getW();
+			int N = params[i]->getN();
+			int C = params[i]->getC();
+			int H = params[i]->getH();
+			int W = params[i]->getW();
 			param_blok->set_kernel_n(N);
 			param_blok->set_kernel_c(C);
 			param_blok->set_kernel_h(H);
@@ -330,7 +857,7 @@ void Net::saveModelParam(shared_ptr<RemNet::snapshotModel>& snapshot_model) {
 					for (int h = 0; h < H; h++) {
 						for (int w = 0; w < W; w++) {
 							RemNet::snapshotModel_paramBlok_paramValue* param_value = param_blok->add_param_value();
-							param_value->set_value((*data[lname][i])[n](h, w, c));
+							param_value->set_value((double)(*params[i])[n](h, w, c)); // snapshots always hold doubles
 						}
 					}
 				}
@@ -339,7 +866,8 @@ void Net::saveModelParam(shared_ptr<RemNet::snapshotModel>& snapshot_model) {
 	}
 }
 
-void Net::loadModelParam(const shared_ptr<RemNet::snapshotModel>& snapshot_model) {
+template<typename Dtype>
+void Net<Dtype>::loadModelParam(const shared_ptr<RemNet::snapshotModel>& snapshot_model) {
 	for (int i = 0; i < snapshot_model->param_blok_size(); i++) {
 		// 1. Pull paramBlok one by one from snapshot_model
 		const RemNet::snapshotModel::paramBlok& param_blok = snapshot_model->param_blok(i);
@@ -355,37 +883,36 @@ void Net::loadModelParam(const shared_ptr<RemNet::snapshotModel>& snapshot_model
 
 		// 3. Iterate through each parameter in the current paramBlok, pull it out, and fill in the corresponding Blob
 		int val_idx = 0;
-		shared_ptr<Blob> tmp_blob(new Blob(N, C, H, W));
+		shared_ptr<Blob<Dtype>> tmp_blob(new Blob<Dtype>(N, C, H, W));
 		for (int n = 0; n < N; n++) {
 			for (int c = 0; c < C; c++) {
 				for (int h = 0; h < H; h++) {
 					for (int w = 0; w < W; w++) {
 						const RemNet::snapshotModel_paramBlok_paramValue&param_value = param_blok.param_value(val_idx++);
-						(*tmp_blob)[n](h, w, c) = param_value.value();
+						(*tmp_blob)[n](h, w, c) = (Dtype)param_value.value(); // converted to the precision of this Net
 					}
 				}
 			}
 		}
-		if (paramtype == "WEIGHT")
-			data[lname][1] = tmp_blob;
+		// Once the arenas exist the parameters are written into them
+		shared_ptr<Blob<Dtype>>& dst = data[lname][paramtype == "WEIGHT" ? 1 : 2];
+		if (dst && dst->size() == tmp_blob->size())
+			*dst = *tmp_blob;
 		else
-			data[lname][2] = tmp_blob;
+			dst = tmp_blob;
 	}
 }
 
-void Net::regular_with_batch(NetParam& param, string mode) {
-	double reg_loss = 0;
-	int N = data[layers[0]][0]->getN();
-	for (auto lname : layers) {
-		if (!gradient[lname][1])
-			continue;
-		if (mode == "TRAIN")
-			(*gradient[lname][1]) = (*gradient[lname][1]) + param.reg * (*data[lname][1]) / N;
-		reg_loss += accu(square((*data[lname][1])));
-	}
-	reg_loss = reg_loss * param.reg / (N << 1);
+template<typename Dtype>
+void Net<Dtype>::regular_with_batch(NetParam& param, string mode) {
+	// The weights of all trained layers are one span of the parameter arena (the biases are not regularized).
+	// Only the loss is added here, the optimizer folds the gradient of the L2 term into its update.
+	double reg_loss = accu(square(*arena_w)) * param.reg / (batch_n << 1);
 	if (mode == "TRAIN")
 		train_loss = train_loss + reg_loss;
 	else
 		val_loss = val_loss + reg_loss;
-}
\ No newline at end of file
+}
+
+template class Net<float>;
+template class Net<double>;
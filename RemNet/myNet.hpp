@@ -2,11 +2,15 @@
 #define __MYNET_HPP__
 #include "myLayer.hpp"
 #include "myBlob.hpp"
+#include "myWorkspace.hpp"
+#include "myTune.hpp"
+#include "myOptim.hpp"
 #include "RemNet.snapshotModel.pb.h"
 #include <iostream>
 #include <vector>
 #include <memory>
 #include <unordered_map>
+#include <atomic>
 
 using std::unordered_map;
 using std::shared_ptr;
@@ -23,7 +27,7 @@ struct NetParam { // Whole Model parameters
 	// Learning rate decay coefficient
 	double lr_decay;
 
-	// Optimizer sgd/momentum/rmsprop/adagrad
+	// Optimizer sgd/momentum/rmsprop/adagrad/adam/adamw
 	string optimizer;
 
 	// Momentum optimizer coefficient decay
@@ -32,6 +36,10 @@ struct NetParam { // Whole Model parameters
 	// Rmsprop optimizer coefficient decay
 	double rmsprop;
 
+	// Decay rates of the first and second moment of adam / adamw
+	double adam_beta1;
+	double adam_beta2;
+
 	// L2 Regularization coefficient
 	double reg;
 
@@ -51,12 +59,33 @@ struct NetParam { // Whole Model parameters
 	// Save the model every few iterations
 	int snapshot_interval;
 
+	// Save snapshots with each BN / Scale folded into the Conv / FC before it (for serving: a net without those layers loads them)
+	bool snapshot_folded;
+
 	// Whether to train with fine tune
 	bool fine_tune;
 
 	// The path of the pretrained model
 	string preTrainedModel;
 
+	// Element type of Blobs, layers and Net: "float" or "double"
+	string precision;
+	// Activation layout: "NCHW", or "NCHWc" to run the leading Conv/ReLU/Pool layers channel-blocked
+	string layout;
+	// Benchmark the conv algorithms of every "auto" Conv layer, results cached in tune_cache per shape and CPU
+	bool conv_tune;
+	string tune_cache;
+	// Run Conv -> ReLU (-> max Pool) as one layer, and each run of pointwise layers as one ChainLayer;
+	// in TEST the BN and Scale layers right after a Conv / FC are folded into its weights
+	bool fuse_layers;
+	// Threads the layer kernels and the update run on, the calling one included (0: every hardware thread)
+	int threads;
+	// Copies of the layer stack a training batch is split over (1: no split), see Net::trainReplicas
+	int replicas;
+	// With replicas > 1: each replica trains on whole batches of its own and updates the shared parameters without
+	// locks (Hogwild!), see Net::trainHogwild
+	bool hogwild;
+
 	// layers name
 	vector<string> layers;
 
@@ -68,26 +97,49 @@ struct NetParam { // Whole Model parameters
 	void readNetParam(string file);
 };
 
+// Dtype is the element type of the whole pipeline (float or double, see NetParam::precision)
+template<typename Dtype>
 class Net {
 
 public:
-	void initNet(NetParam& param, vector<shared_ptr<Blob>>& x, vector<shared_ptr<Blob>>& y);
+	Net() :x_batch(new Blob<Dtype>), y_batch(new Blob<Dtype>), bound_batch(0), train_batch(0), batch_n(0), train_allocs(0), blocked_layers(0),
+		optim(OPTIM_SGD), optim_steps(0), hog_samples(0), hog_seconds(0), hog_stale(0), hog_stale_max(0) {}
+	void initNet(NetParam& param, vector<shared_ptr<Blob<Dtype>>>& x, vector<shared_ptr<Blob<Dtype>>>& y);
 	void trainNet(NetParam& param);
-	void train_with_batch(shared_ptr<Blob>& x, shared_ptr<Blob>& y, NetParam& param, string mode="TRAIN");
+	void train_with_batch(shared_ptr<Blob<Dtype>>& x, shared_ptr<Blob<Dtype>>& y, NetParam& param, string mode="TRAIN");
 	void optimizer_with_batch(NetParam& param);
 	void evaluate_with_batch(NetParam& param);
 	void regular_with_batch(NetParam& param, string mode="TRAIN");
-	double calc_accuracy(Blob& y, Blob& pred);
-	void saveModelParam(shared_ptr<RemNet::snapshotModel>& snapshot_model);
+	double calc_accuracy(Blob<Dtype>& y, Blob<Dtype>& pred);
+	void saveModelParam(shared_ptr<RemNet::snapshotModel>& snapshot_model, NetParam& param);
 	void loadModelParam(const shared_ptr<RemNet::snapshotModel>& snapshot_model);
+	void bindWorkspace(int N, NetParam& param);
 private:
+	// Forward, loss and backward of one batch on the bound workspace, without the update
+	void propagate(shared_ptr<Blob<Dtype>>& x, shared_ptr<Blob<Dtype>>& y, NetParam& param, string mode);
+	void trainReplicas(int start, NetParam& param);
+	void trainHogwild(int first, int last, NetParam& param);
+	// The update of step t, and applying it with the gradients dw to the parameters and optimizer state of this Net
+	OptimStep optimStep(const NetParam& param, long long t) const;
+	void applyStep(const Dtype* dw, const OptimStep& step);
+	void initReplica(Net<Dtype>& master, NetParam& param, int batch);
+	void buildChains(NetParam& param);
+	vector<string> trainedLayers();
+	void fuseLayers(NetParam& param);
+	void foldAffine(NetParam& param);
+	void buildArenas(NetParam& param);
+	void tuneConv(const string& lname, const vector<int>& inShape, NetParam& param, map<string, vector<string>>& cache, bool& updated);
 	// Train Data
-	shared_ptr<Blob> x_train;
-	shared_ptr<Blob> y_train;
+	shared_ptr<Blob<Dtype>> x_train;
+	shared_ptr<Blob<Dtype>> y_train;
 
 	// Val Data
-	shared_ptr<Blob> x_val;
-	shared_ptr<Blob> y_val;
+	shared_ptr<Blob<Dtype>> x_val;
+	shared_ptr<Blob<Dtype>> y_val;
+
+	// The batch (or shard of it) this Net trains on: views over x_train/y_train, laid again for every step
+	shared_ptr<Blob<Dtype>> x_batch;
+	shared_ptr<Blob<Dtype>> y_batch;
 
 	vector<string> layers; // layer name
 	vector<string> ltypes; // layer type
@@ -97,15 +149,39 @@ private:
 	double train_accu;
 	double val_accu;
 
-	unordered_map<string, vector<shared_ptr<Blob>>> data; // the needed Blob for forward
+	unordered_map<string, vector<shared_ptr<Blob<Dtype>>>> data; // the needed Blob for forward
 	
 	// gradient[0]=dx, gradient[1]=dw, gradient[2]=db
-	unordered_map<string, vector<shared_ptr<Blob>>> gradient; // the needed Blob for backward
+	unordered_map<string, vector<shared_ptr<Blob<Dtype>>>> gradient; // the needed Blob for backward
 
-	unordered_map<string, shared_ptr<Layer>> myLayers;
+	unordered_map<string, shared_ptr<Layer<Dtype>>> myLayers;
 
 	unordered_map<string, vector<int>> outShapes; // output shape for each layer
-	unordered_map<string, vector<shared_ptr<Blob>>> step_cache; // Preserved cumulative gradientOnly rmsprop and momentum are used
+	unordered_map<int, shared_ptr<Workspace<Dtype>>> workspaces; // activations, gradients and layer scratch, one arena per batch size
+	int bound_batch; // batch size of the workspace currently bound to data/gradient
+	int train_batch; // batch size the training steps of this Net run with (its shard when the batch is split)
+	int batch_n; // samples in the batch of the last step, the L2 term is divided by it
+	long long train_allocs; // heap allocations made by the training steps (see heapAllocCount) since the last report
+	vector<double> shard_share; // trainReplicas: the part of the batch each replica's shard holds
+	vector<const Dtype*> shard_grads; // and the gradient arenas of replicas 1 .. K - 1
+	int blocked_layers; // number of leading layers running on the NCHWc layout (0: none)
+	shared_ptr<Blob<Dtype>> blocked_x, blocked_y, blocked_dy; // NCHWc copies of the input, the last blocked output and its gradient
+	unordered_map<string, vector<shared_ptr<Blob<Dtype>>>> folded; // x, w and b a Conv / FC runs with in TEST when it folds the layers after it
+	// Every trained w, then every trained b, in one flat arena each for the values, the gradients and the optimizer
+	// state: data, gradient and step_cache hold views into them (the running statistics of BN stay outside)
+	Workspace<Dtype> param_arena, grad_arena, state_arena[2];
+	shared_ptr<Blob<Dtype>> arena_w; // the span of the weights in param_arena (they come first, the optimizer decays only them)
+	OptimType optim; // NetParam::optimizer
+	std::atomic<long long> optim_steps; // updates applied so far
+	// Hogwild! statistics since the last report: samples trained and the seconds it took, and the staleness of the updates
+	// (the updates other replicas applied between reading the parameters and updating them): summed and largest
+	long long hog_samples;
+	double hog_seconds;
+	long long hog_stale, hog_stale_max;
+	// Replicas 1 .. K - 1 of the layer stack (this Net is replica 0): layers, activations and parameter gradients of their
+	// own, the parameters of this Net (the BN running statistics are their own too, only those of this Net are kept)
+	vector<shared_ptr<Net<Dtype>>> replicas;
+	unordered_map<string, vector<shared_ptr<Blob<Dtype>>>> step_cache; // Preserved cumulative gradientOnly rmsprop and momentum are used
 
 };
 
@@ -0,0 +1,159 @@
+#include "myOptim.hpp"
+#include "mySimd.hpp"
+#include "myThread.hpp"
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+OptimType optimType(const std::string& name) {
+	if (name == "momentum")
+		return OPTIM_MOMENTUM;
+	if (name == "rmsprop")
+		return OPTIM_RMSPROP;
+	if (name == "adagrad")
+		return OPTIM_ADAGRAD;
+	if (name == "adam")
+		return OPTIM_ADAM;
+	if (name == "adamw")
+		return OPTIM_ADAMW;
+	assert(name == "sgd");
+	return OPTIM_SGD;
+}
+
+int optimStates(OptimType type) {
+	if (type == OPTIM_SGD)
+		return 0;
+	return type == OPTIM_ADAM || type == OPTIM_ADAMW ? 2 : 1;
+}
+
+// The per-step constants of an update, broadcast once
+template<typename V>
+struct OptimConst {
+	V lr, beta1, beta2, rest1, rest2, decay, keep, lrt, eps;
+	OptimConst(const OptimStep& s) {
+		typedef typename V::T Dtype;
+		lr = V::set(Dtype(-s.lr));
+		beta1 = V::set(Dtype(s.beta1));
+		beta2 = V::set(Dtype(s.beta2));
+		rest1 = V::set(Dtype(1 - s.beta1));
+		rest2 = V::set(Dtype(1 - s.beta2));
+		decay = V::set(Dtype(s.type == OPTIM_ADAMW ? 0 : s.decay));
+		keep = V::set(Dtype(s.type == OPTIM_ADAMW ? 1 - s.lr * s.decay : 1));
+		double c1 = 1 - std::pow(s.beta1, (double)s.t), c2 = 1 - std::pow(s.beta2, (double)s.t);
+		lrt = V::set(Dtype(s.type == OPTIM_ADAM || s.type == OPTIM_ADAMW ? -s.lr * std::sqrt(c2) / c1 : 0));
+		eps = V::set(Dtype(1e-8));
+	}
+};
+
+// New w of one vector of parameters, the state updated in place (the branches fold away for each T)
+template<OptimType T, typename V>
+static inline V updateV(V w, V dw, V& s1, V& s2, const OptimConst<V>& c) {
+	V g = V::madd(w, c.decay, dw);
+	if (T == OPTIM_SGD)
+		return V::madd(g, c.lr, w);
+	if (T == OPTIM_MOMENTUM) {
+		s1 = V::madd(s1, c.beta1, g);
+		return V::madd(s1, c.lr, w);
+	}
+	if (T == OPTIM_RMSPROP) {
+		s1 = V::madd(s1, c.beta1, c.rest1 * g * g);
+		return V::madd(g / V::sqrt(s1 + c.eps), c.lr, w);
+	}
+	if (T == OPTIM_ADAGRAD) {
+		s1 = V::madd(g, g, s1);
+		return V::madd(g / (V::sqrt(s1) + c.eps), c.lr, w);
+	}
+	s1 = V::madd(s1, c.beta1, c.rest1 * g);
+	s2 = V::madd(s2, c.beta2, c.rest2 * g * g);
+	return V::madd(s1 / (V::sqrt(s2) + c.eps), c.lrt, w * c.keep);
+}
+
+// Runs the update over whole vectors, and over the tail copied into a padded vector
+template<OptimType T, typename Dtype>
+static void updateAll(Dtype* w, const Dtype* dw, Dtype* s1, Dtype* s2, size_t n, const OptimStep& step) {
+	typedef MathVec<Dtype> V;
+	const OptimConst<V> c(step);
+	const int states = optimStates(T);
+	V a = V::set(0), b = V::set(0);
+	size_t i = 0;
+	for (; i + V::W <= n; i += V::W) {
+		if (states > 0)
+			a = V::load(s1 + i);
+		if (states > 1)
+			b = V::load(s2 + i);
+		updateV<T>(V::load(w + i), V::load(dw + i), a, b, c).store(w + i);
+		if (states > 0)
+			a.store(s1 + i);
+		if (states > 1)
+			b.store(s2 + i);
+	}
+	if (i < n) {
+		Dtype tw[V::W] = {0}, tg[V::W] = {0}, t1[V::W] = {0}, t2[V::W] = {0};
+		size_t m = n - i;
+		std::copy(w + i, w + n, tw);
+		std::copy(dw + i, dw + n, tg);
+		if (states > 0)
+			std::copy(s1 + i, s1 + n, t1);
+		if (states > 1)
+			std::copy(s2 + i, s2 + n, t2);
+		updateAll<T>(tw, tg, t1, t2, V::W, step);
+		std::copy(tw, tw + m, w + i);
+		if (states > 0)
+			std::copy(t1, t1 + m, s1 + i);
+		if (states > 1)
+			std::copy(t2, t2 + m, s2 + i);
+	}
+}
+
+template<typename Dtype>
+void optimUpdate(Dtype* w, const Dtype* dw, Dtype* s1, Dtype* s2, size_t n, const OptimStep& step) {
+	assert(optimStates(step.type) < 1 || s1);
+	assert(optimStates(step.type) < 2 || s2);
+	// Chunks of OPTIM_CHUNK parameters (whole vectors) go to the threads, only the last one has a tail
+	int chunks = (int)((n + OPTIM_CHUNK - 1) / OPTIM_CHUNK);
+	parallelFor(chunks, [&](int c0, int c1, int) {
+		size_t i = (size_t)c0 * OPTIM_CHUNK, m = std::min(n, (size_t)c1 * OPTIM_CHUNK) - i;
+		Dtype* a = s1 ? s1 + i : NULL;
+		Dtype* b = s2 ? s2 + i : NULL;
+		switch (step.type) {
+		case OPTIM_SGD: updateAll<OPTIM_SGD>(w + i, dw + i, a, b, m, step); break;
+		case OPTIM_MOMENTUM: updateAll<OPTIM_MOMENTUM>(w + i, dw + i, a, b, m, step); break;
+		case OPTIM_RMSPROP: updateAll<OPTIM_RMSPROP>(w + i, dw + i, a, b, m, step); break;
+		case OPTIM_ADAGRAD: updateAll<OPTIM_ADAGRAD>(w + i, dw + i, a, b, m, step); break;
+		case OPTIM_ADAM: updateAll<OPTIM_ADAM>(w + i, dw + i, a, b, m, step); break;
+		case OPTIM_ADAMW: updateAll<OPTIM_ADAMW>(w + i, dw + i, a, b, m, step); break;
+		}
+	});
+}
+
+template<typename Dtype>
+void gradReduce(Dtype* dst, const std::vector<const Dtype*>& src, const std::vector<double>& share, size_t n) {
+	typedef MathVec<Dtype> V;
+	assert(share.size() == src.size() + 1);
+	int chunks = (int)((n + OPTIM_CHUNK - 1) / OPTIM_CHUNK);
+	parallelFor(chunks, [&](int c0, int c1, int) {
+		for (int c = c0; c < c1; c++) {
+			size_t i0 = (size_t)c * OPTIM_CHUNK, i1 = std::min(n, i0 + OPTIM_CHUNK), i;
+			Dtype* d = dst + i0;
+			size_t m = i1 - i0;
+			const V a = V::set(Dtype(share[0]));
+			for (i = 0; i + V::W <= m; i += V::W)
+				(V::load(d + i) * a).store(d + i);
+			for (; i < m; i++)
+				d[i] *= Dtype(share[0]);
+			for (size_t k = 0; k < src.size(); k++) {
+				const Dtype* s = src[k] + i0;
+				const V b = V::set(Dtype(share[k + 1]));
+				for (i = 0; i + V::W <= m; i += V::W)
+					V::madd(V::load(s + i), b, V::load(d + i)).store(d + i);
+				for (; i < m; i++)
+					d[i] += Dtype(share[k + 1]) * s[i];
+			}
+		}
+	});
+}
+
+template void optimUpdate<float>(float*, const float*, float*, float*, size_t, const OptimStep&);
+template void optimUpdate<double>(double*, const double*, double*, double*, size_t, const OptimStep&);
+template void gradReduce<float>(float*, const std::vector<const float*>&, const std::vector<double>&, size_t);
+template void gradReduce<double>(double*, const std::vector<const double*>&, const std::vector<double>&, size_t);
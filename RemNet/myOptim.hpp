@@ -0,0 +1,49 @@
+#ifndef __MYOPTIM_HPP__
+#define __MYOPTIM_HPP__
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Update methods of NetParam::optimizer ("sgd", "momentum", "rmsprop", "adagrad", "adam", "adamw")
+enum OptimType { OPTIM_SGD, OPTIM_MOMENTUM, OPTIM_RMSPROP, OPTIM_ADAGRAD, OPTIM_ADAM, OPTIM_ADAMW };
+
+// Parameters per piece of an update handed to one thread (a multiple of every vector width)
+#define OPTIM_CHUNK 16384
+
+// Parses an update method name, asserts on an unknown one
+OptimType optimType(const std::string& name);
+
+// Number of state values each parameter needs (velocity, squared-gradient average, Adam's two moments)
+int optimStates(OptimType type);
+
+// One update step: lr, the decay rates of the state (momentum / rmsprop / beta1 and beta2) and the L2 coefficient
+// decay. The gradient used is g = dw + decay * w, except for adamw where w -= lr * decay * w is applied on its own.
+// t counts the steps taken so far including this one (the Adam bias correction).
+struct OptimStep {
+	OptimType type;
+	double lr;
+	double beta1;
+	double beta2;
+	double decay;
+	long long t;
+};
+
+// Updates n parameters w in place from their gradients dw, with s1 and s2 the state (each may be NULL when the method
+// keeps fewer states). One pass reads w, dw and the state once and writes w and the state once, a native vector at a time,
+// split over the threads in chunks:
+//   sgd       w -= lr * g
+//   momentum  s1 = beta1 * s1 + g,                          w -= lr * s1
+//   rmsprop   s1 = beta1 * s1 + (1 - beta1) * g^2,          w -= lr * g / sqrt(s1 + 1e-8)
+//   adagrad   s1 += g^2,                                    w -= lr * g / (sqrt(s1) + 1e-8)
+//   adam      s1 = beta1 * s1 + (1 - beta1) * g,  s2 = beta2 * s2 + (1 - beta2) * g^2,
+//             w -= lr * sqrt(1 - beta2^t) / (1 - beta1^t) * s1 / (sqrt(s2) + 1e-8)
+template<typename Dtype>
+void optimUpdate(Dtype* w, const Dtype* dw, Dtype* s1, Dtype* s2, size_t n, const OptimStep& step);
+
+// Combines the gradients of the shards of a batch into the first of them: dst = share[0] * dst + sum of share[k + 1] * src[k]
+// over n values. The threads take chunks of OPTIM_CHUNK values, and each chunk of dst takes every shard in turn while
+// it is still in cache; the shards are always added in the same order.
+template<typename Dtype>
+void gradReduce(Dtype* dst, const std::vector<const Dtype*>& src, const std::vector<double>& share, size_t n);
+
+#endif
@@ -0,0 +1,250 @@
+#include "myPool.hpp"
+#include "mySimd.hpp"
+#include "myThread.hpp"
+#include <cassert>
+#include <algorithm>
+
+// Start of plane i (sample i / C, channel i % C) of planes of HW values: every sample is contiguous, but a batch
+// view may wrap around between two of them
+template<typename Dtype>
+static inline const Dtype* planeOf(const Blob<Dtype>& b, size_t i, size_t HW) { return b.sample((int)(i / b.getC())) + i % b.getC() * HW; }
+template<typename Dtype>
+static inline Dtype* planeOf(Blob<Dtype>& b, size_t i, size_t HW) { return b.sample((int)(i / b.getC())) + i % b.getC() * HW; }
+
+// One channel plane, window KH x KW and stride S fixed at compile time (0: use the runtime Hp, Wp, stride)
+template<typename Dtype, int KH, int KW, int S>
+static void maxPoolPlane(const Dtype* x, Dtype* y, unsigned char* a, int H, int Ho, int Wo, int Hp, int Wp, int stride, bool relu) {
+	typedef BlockVec<Dtype> V;
+	const int hp = KH ? KH : Hp, wp = KW ? KW : Wp, st = S ? S : stride;
+	for (int ow = 0; ow < Wo; ow++) {
+		const Dtype* xc = x + (size_t)ow * st * H;
+		Dtype* yc = y + (size_t)ow * Ho;
+		unsigned char* ac = a ? a + (size_t)ow * Ho : NULL;
+		int oh = 0;
+		// Stride 1: CBLOCK neighbouring output rows read CBLOCK neighbouring input rows, one vector per tap
+		if (S == 1)
+			for (; oh + CBLOCK <= Ho; oh += CBLOCK) {
+				V m = V::load(xc + oh), arg = V::zero();
+				for (int kw = 0; kw < wp; kw++)
+					for (int kh = 0; kh < hp; kh++)
+						if (kw || kh)
+							m.maxArg(V::load(xc + (size_t)kw * H + kh + oh), Dtype(kw * hp + kh), arg);
+				if (ac) {
+					Dtype t[CBLOCK], mv[CBLOCK];
+					arg.store(t);
+					m.store(mv);
+					for (int l = 0; l < CBLOCK; l++)
+						ac[oh + l] = relu && !(mv[l] > 0 && mv[l] < RELU_CLIP) ? POOL_NO_TAP : (unsigned char)t[l];
+				}
+				if (relu) {
+					m.max(V::zero());
+					m.min(V::set(RELU_CLIP));
+				}
+				m.store(yc + oh);
+			}
+		for (; oh < Ho; oh++) {
+			const Dtype* p = xc + (size_t)oh * st;
+			Dtype m = p[0];
+			int tap = 0;
+			for (int kw = 0; kw < wp; kw++)
+				for (int kh = 0; kh < hp; kh++) {
+					Dtype v = p[(size_t)kw * H + kh];
+					if (v > m) {
+						m = v;
+						tap = kw * hp + kh;
+					}
+				}
+			if (relu && !(m > 0 && m < RELU_CLIP)) {
+				m = m > 0 ? Dtype(RELU_CLIP) : Dtype(0);
+				tap = POOL_NO_TAP;
+			}
+			yc[oh] = m;
+			if (ac)
+				ac[oh] = (unsigned char)tap;
+		}
+	}
+}
+
+template<typename Dtype>
+void maxPoolForward(const Blob<Dtype>& x, Blob<Dtype>& out, unsigned char* taps, int Hp, int Wp, int stride, bool relu) {
+	assert(Hp * Wp <= POOL_MAX_TAPS);
+	int H = x.getH(), W = x.getW();
+	int Ho = out.getH(), Wo = out.getW();
+	size_t planes = (size_t)x.getN() * x.getC();
+	size_t HW = (size_t)H * W, P = (size_t)Ho * Wo;
+	auto plane = maxPoolPlane<Dtype, 0, 0, 0>;
+	if (Hp == 2 && Wp == 2 && stride == 2)
+		plane = maxPoolPlane<Dtype, 2, 2, 2>;
+	else if (Hp == 2 && Wp == 2 && stride == 1)
+		plane = maxPoolPlane<Dtype, 2, 2, 1>;
+	else if (Hp == 3 && Wp == 3 && stride == 2)
+		plane = maxPoolPlane<Dtype, 3, 3, 2>;
+	else if (Hp == 3 && Wp == 3 && stride == 1)
+		plane = maxPoolPlane<Dtype, 3, 3, 1>;
+	parallelFor((int)planes, [&](int i0, int i1, int) {
+		for (size_t i = i0; i < (size_t)i1; i++)
+			plane(planeOf(x, i, HW), planeOf(out, i, P), taps ? taps + i * P : NULL, H, Ho, Wo, Hp, Wp, stride, relu);
+	});
+}
+
+template<typename Dtype>
+void maxPoolBackward(const Blob<Dtype>& din, const unsigned char* taps, Blob<Dtype>& dx, int Hp, int Wp, int stride) {
+	// Offset of every tap from the window origin in a column-major plane
+	int H = dx.getH(), W = dx.getW();
+	int Ho = din.getH(), Wo = din.getW();
+	size_t tapOff[POOL_MAX_TAPS];
+	for (int kw = 0; kw < Wp; kw++)
+		for (int kh = 0; kh < Hp; kh++)
+			tapOff[kw * Hp + kh] = (size_t)kw * H + kh;
+
+	size_t planes = (size_t)din.getN() * din.getC();
+	size_t HW = (size_t)H * W, P = (size_t)Ho * Wo;
+	parallelFor((int)planes, [&](int i0, int i1, int) {
+		for (size_t i = i0; i < (size_t)i1; i++) {
+			const Dtype* d = planeOf(din, i, P);
+			const unsigned char* a = taps + i * P;
+			Dtype* g = planeOf(dx, i, HW);
+			std::fill(g, g + HW, Dtype(0));
+			for (int ow = 0; ow < Wo; ow++)
+				for (int oh = 0; oh < Ho; oh++) {
+					size_t q = (size_t)ow * Ho + oh;
+					if (a[q] != POOL_NO_TAP)
+						g[(size_t)ow * stride * H + (size_t)oh * stride + tapOff[a[q]]] += d[q];
+				}
+		}
+	});
+}
+
+// acc[0, n) += x[0, n)
+template<typename Dtype>
+static inline void addTo(Dtype* acc, const Dtype* x, int n) {
+	typedef BlockVec<Dtype> V;
+	int i = 0;
+	for (; i + CBLOCK <= n; i += CBLOCK) {
+		V a = V::load(acc + i);
+		a.add(V::load(x + i));
+		a.store(acc + i);
+	}
+	for (; i < n; i++)
+		acc[i] += x[i];
+}
+
+// Sum of x[0, n), CBLOCK partial sums at a time
+template<typename Dtype>
+static inline Dtype sumOf(const Dtype* x, size_t n) {
+	typedef BlockVec<Dtype> V;
+	V acc = V::zero();
+	size_t i = 0;
+	for (; i + CBLOCK <= n; i += CBLOCK)
+		acc.add(V::load(x + i));
+	Dtype lanes[CBLOCK], s = 0;
+	acc.store(lanes);
+	for (int l = 0; l < CBLOCK; l++)
+		s += lanes[l];
+	for (; i < n; i++)
+		s += x[i];
+	return s;
+}
+
+template<typename Dtype>
+void avgPoolForward(const Blob<Dtype>& x, Blob<Dtype>& out, Dtype* col, int Hp, int Wp, int stride) {
+	typedef BlockVec<Dtype> V;
+	int H = x.getH(), W = x.getW();
+	int Ho = out.getH(), Wo = out.getW();
+	size_t planes = (size_t)x.getN() * x.getC();
+	size_t HW = (size_t)H * W, P = (size_t)Ho * Wo;
+	Dtype scale = Dtype(1.0 / (Hp * Wp));
+	parallelFor((int)planes, [&](int i0, int i1, int t) {
+		Dtype* cs = col + (size_t)t * H;
+		for (size_t i = i0; i < (size_t)i1; i++)
+			for (int ow = 0; ow < Wo; ow++) {
+				// 1. Sum of the Wp input columns under this output column
+				const Dtype* xc = planeOf(x, i, HW) + (size_t)ow * stride * H;
+				std::copy(xc, xc + H, cs);
+				for (int kw = 1; kw < Wp; kw++)
+					addTo(cs, xc + (size_t)kw * H, H);
+
+				// 2. Hp rows of that sum per output, CBLOCK neighbouring outputs at a time for stride 1
+				Dtype* yc = planeOf(out, i, P) + (size_t)ow * Ho;
+				int oh = 0;
+				if (stride == 1)
+					for (; oh + CBLOCK <= Ho; oh += CBLOCK) {
+						V s = V::zero();
+						for (int kh = 0; kh < Hp; kh++)
+							s.madd(V::load(cs + oh + kh), scale);
+						s.store(yc + oh);
+					}
+				for (; oh < Ho; oh++) {
+					Dtype s = 0;
+					for (int kh = 0; kh < Hp; kh++)
+						s += cs[oh * stride + kh] * scale;
+					yc[oh] = s;
+				}
+			}
+	});
+}
+
+template<typename Dtype>
+void avgPoolBackward(const Blob<Dtype>& din, Blob<Dtype>& dx, Dtype* col, int Hp, int Wp, int stride) {
+	int H = dx.getH(), W = dx.getW();
+	int Ho = din.getH(), Wo = din.getW();
+	size_t planes = (size_t)din.getN() * din.getC();
+	size_t HW = (size_t)H * W, P = (size_t)Ho * Wo;
+	Dtype scale = Dtype(1.0 / (Hp * Wp));
+	parallelFor((int)planes, [&](int i0, int i1, int t) {
+		Dtype* cs = col + (size_t)t * H;
+		for (size_t i = i0; i < (size_t)i1; i++) {
+			std::fill(planeOf(dx, i, HW), planeOf(dx, i, HW) + HW, Dtype(0));
+			for (int ow = 0; ow < Wo; ow++) {
+				// 1. Spread the output column over the input rows its windows cover
+				const Dtype* d = planeOf(din, i, P) + (size_t)ow * Ho;
+				std::fill(cs, cs + H, Dtype(0));
+				for (int oh = 0; oh < Ho; oh++) {
+					Dtype g = d[oh] * scale;
+					for (int kh = 0; kh < Hp; kh++)
+						cs[oh * stride + kh] += g;
+				}
+
+				// 2. Add it to every input column of the window
+				Dtype* gc = planeOf(dx, i, HW) + (size_t)ow * stride * H;
+				for (int kw = 0; kw < Wp; kw++)
+					addTo(gc + (size_t)kw * H, cs, H);
+			}
+		}
+	});
+}
+
+template<typename Dtype>
+void globalAvgPoolForward(const Blob<Dtype>& x, Blob<Dtype>& out) {
+	size_t planes = (size_t)x.getN() * x.getC();
+	size_t HW = (size_t)x.getH() * x.getW();
+	Dtype scale = Dtype(1.0 / HW);
+	parallelFor((int)planes, [&](int i0, int i1, int) {
+		for (size_t i = i0; i < (size_t)i1; i++)
+			*planeOf(out, i, 1) = sumOf(planeOf(x, i, HW), HW) * scale;
+	});
+}
+
+template<typename Dtype>
+void globalAvgPoolBackward(const Blob<Dtype>& din, Blob<Dtype>& dx) {
+	size_t planes = (size_t)dx.getN() * dx.getC();
+	size_t HW = (size_t)dx.getH() * dx.getW();
+	Dtype scale = Dtype(1.0 / HW);
+	parallelFor((int)planes, [&](int i0, int i1, int) {
+		for (size_t i = i0; i < (size_t)i1; i++)
+			std::fill(planeOf(dx, i, HW), planeOf(dx, i, HW) + HW, *planeOf(din, i, 1) * scale);
+	});
+}
+
+template void maxPoolForward<float>(const Blob<float>&, Blob<float>&, unsigned char*, int, int, int, bool);
+template void maxPoolForward<double>(const Blob<double>&, Blob<double>&, unsigned char*, int, int, int, bool);
+template void maxPoolBackward<float>(const Blob<float>&, const unsigned char*, Blob<float>&, int, int, int);
+template void maxPoolBackward<double>(const Blob<double>&, const unsigned char*, Blob<double>&, int, int, int);
+template void avgPoolForward<float>(const Blob<float>&, Blob<float>&, float*, int, int, int);
+template void avgPoolForward<double>(const Blob<double>&, Blob<double>&, double*, int, int, int);
+template void avgPoolBackward<float>(const Blob<float>&, Blob<float>&, float*, int, int, int);
+template void avgPoolBackward<double>(const Blob<double>&, Blob<double>&, double*, int, int, int);
+template void globalAvgPoolForward<float>(const Blob<float>&, Blob<float>&);
+template void globalAvgPoolForward<double>(const Blob<double>&, Blob<double>&);
+template void globalAvgPoolBackward<float>(const Blob<float>&, Blob<float>&);
+template void globalAvgPoolBackward<double>(const Blob<double>&, Blob<double>&);
@@ -0,0 +1,49 @@
+#ifndef __MYPOOL_HPP__
+#define __MYPOOL_HPP__
+#include "myBlob.hpp"
+
+// Max pooling keeps, for every output value, the tap of the window it came from (kw * Hp + kh,
+// the first one on ties) in one byte, so windows are limited to POOL_MAX_TAPS taps.
+// POOL_NO_TAP marks an output that passes no gradient back (a max clipped to 0 or RELU_CLIP by a fused ReLU).
+#define POOL_MAX_TAPS 255
+#define POOL_NO_TAP 255
+
+// Shape of a Dtype scratch Blob holding one tap byte per element of outShape
+template<typename Dtype>
+inline BlobShape poolTapShape(const BlobShape& outShape) {
+	size_t n = (size_t)outShape[0] * outShape[1] * outShape[2] * outShape[3];
+	return {1, 1, 1, (int)((n + sizeof(Dtype) - 1) / sizeof(Dtype))};
+}
+
+// The pooling kernels here and in myBlocked.hpp split the channel planes (blocks) of the batch over the threads.
+
+// Max pooling on NCHW Blobs; taps (out-sized, may be NULL) receives the window tap of every max.
+// 2x2 and 3x3 windows with stride 1 or 2 run unrolled kernels, stride 1 vectorized over output rows.
+// relu clips the outputs to [0, RELU_CLIP], which equals max pooling the ReLU of x (the fused Conv + ReLU + Pool).
+template<typename Dtype>
+void maxPoolForward(const Blob<Dtype>& x, Blob<Dtype>& out, unsigned char* taps, int Hp, int Wp, int stride, bool relu = false);
+
+// Sends each output gradient to the input its tap points at: one scatter per output value
+template<typename Dtype>
+void maxPoolBackward(const Blob<Dtype>& din, const unsigned char* taps, Blob<Dtype>& dx, int Hp, int Wp, int stride);
+
+// Average pooling on NCHW Blobs (no padding, every window averages Hp * Wp inputs). The window is summed
+// as whole input columns first (contiguous, vectorized for any stride) and then down the rows of that
+// column sum; col is a work buffer of one input column per thread (H values each).
+template<typename Dtype>
+void avgPoolForward(const Blob<Dtype>& x, Blob<Dtype>& out, Dtype* col, int Hp, int Wp, int stride);
+
+// Adjoint of avgPoolForward: each output gradient is spread down one column of the thread's col, which is then added
+// to the Wp input columns of the window
+template<typename Dtype>
+void avgPoolBackward(const Blob<Dtype>& din, Blob<Dtype>& dx, Dtype* col, int Hp, int Wp, int stride);
+
+// Global average pooling: out {N, C, 1, 1} holds the mean of every channel plane of x
+template<typename Dtype>
+void globalAvgPoolForward(const Blob<Dtype>& x, Blob<Dtype>& out);
+
+// Every input of a plane gets 1 / (H * W) of the plane's output gradient
+template<typename Dtype>
+void globalAvgPoolBackward(const Blob<Dtype>& din, Blob<Dtype>& dx);
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef __MYSIMD_HPP__
+#define __MYSIMD_HPP__
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include <cmath>
+
+// Channel block of the NCHWc layout: as many channels as one native vector register holds floats
+#if defined(__AVX512F__)
+#define CBLOCK 16
+#else
+#define CBLOCK 8
+#endif
+
+// Every AVX2 target MSVC builds for has FMA, GCC and Clang announce it on its own
+#if defined(__FMA__) || defined(_MSC_VER)
+#define SIMD_FMA
+#endif
+
+// CBLOCK lanes of Dtype kept in registers: one vector of floats, two vectors of doubles.
+// Loads and stores are unaligned, so any lane group of a blocked Blob can be used.
+// Without AVX2 the plain loops below are used (the compiler may still vectorize them).
+template<typename Dtype>
+struct BlockVec {
+	Dtype v[CBLOCK];
+	static inline BlockVec zero() { BlockVec r; for (int i = 0; i < CBLOCK; i++) r.v[i] = 0; return r; }
+	static inline BlockVec set(Dtype x) { BlockVec r; for (int i = 0; i < CBLOCK; i++) r.v[i] = x; return r; }
+	static inline BlockVec load(const Dtype* p) { BlockVec r; for (int i = 0; i < CBLOCK; i++) r.v[i] = p[i]; return r; }
+	inline void store(Dtype* p) const { for (int i = 0; i < CBLOCK; i++) p[i] = v[i]; }
+	inline void madd(const BlockVec& a, Dtype x) { for (int i = 0; i < CBLOCK; i++) v[i] += a.v[i] * x; } // this += a * x
+	inline void madd(const BlockVec& a, const BlockVec& b) { for (int i = 0; i < CBLOCK; i++) v[i] += a.v[i] * b.v[i]; }
+	inline void add(const BlockVec& a) { for (int i = 0; i < CBLOCK; i++) v[i] += a.v[i]; }
+	inline void max(const BlockVec& a) { for (int i = 0; i < CBLOCK; i++) v[i] = a.v[i] > v[i] ? a.v[i] : v[i]; }
+	inline void min(const BlockVec& a) { for (int i = 0; i < CBLOCK; i++) v[i] = a.v[i] < v[i] ? a.v[i] : v[i]; }
+	// this = max(this, a), and the lanes where a is strictly larger set arg to tap (ties keep the earlier tap)
+	inline void maxArg(const BlockVec& a, Dtype tap, BlockVec& arg) {
+		for (int i = 0; i < CBLOCK; i++)
+			if (a.v[i] > v[i]) {
+				v[i] = a.v[i];
+				arg.v[i] = tap;
+			}
+	}
+};
+
+#if defined(__AVX512F__)
+template<>
+struct BlockVec<float> {
+	__m512 v;
+	static inline BlockVec zero() { BlockVec r; r.v = _mm512_setzero_ps(); return r; }
+	static inline BlockVec set(float x) { BlockVec r; r.v = _mm512_set1_ps(x); return r; }
+	static inline BlockVec load(const float* p) { BlockVec r; r.v = _mm512_loadu_ps(p); return r; }
+	inline void store(float* p) const { _mm512_storeu_ps(p, v); }
+	inline void madd(const BlockVec& a, float x) { v = _mm512_fmadd_ps(a.v, _mm512_set1_ps(x), v); }
+	inline void madd(const BlockVec& a, const BlockVec& b) { v = _mm512_fmadd_ps(a.v, b.v, v); }
+	inline void add(const BlockVec& a) { v = _mm512_add_ps(v, a.v); }
+	inline void max(const BlockVec& a) { v = _mm512_max_ps(v, a.v); }
+	inline void min(const BlockVec& a) { v = _mm512_min_ps(v, a.v); }
+	inline void maxArg(const BlockVec& a, float tap, BlockVec& arg) {
+		__mmask16 g = _mm512_cmp_ps_mask(a.v, v, _CMP_GT_OQ);
+		v = _mm512_mask_blend_ps(g, v, a.v);
+		arg.v = _mm512_mask_blend_ps(g, arg.v, _mm512_set1_ps(tap));
+	}
+};
+
+template<>
+struct BlockVec<double> {
+	__m512d lo, hi;
+	static inline BlockVec zero() { BlockVec r; r.lo = r.hi = _mm512_setzero_pd(); return r; }
+	static inline BlockVec set(double x) { BlockVec r; r.lo = r.hi = _mm512_set1_pd(x); return r; }
+	static inline BlockVec load(const double* p) { BlockVec r; r.lo = _mm512_loadu_pd(p); r.hi = _mm512_loadu_pd(p + 8); return r; }
+	inline void store(double* p) const { _mm512_storeu_pd(p, lo); _mm512_storeu_pd(p + 8, hi); }
+	inline void madd(const BlockVec& a, double x) {
+		__m512d b = _mm512_set1_pd(x);
+		lo = _mm512_fmadd_pd(a.lo, b, lo);
+		hi = _mm512_fmadd_pd(a.hi, b, hi);
+	}
+	inline void madd(const BlockVec& a, const BlockVec& b) { lo = _mm512_fmadd_pd(a.lo, b.lo, lo); hi = _mm512_fmadd_pd(a.hi, b.hi, hi); }
+	inline void add(const BlockVec& a) { lo = _mm512_add_pd(lo, a.lo); hi = _mm512_add_pd(hi, a.hi); }
+	inline void max(const BlockVec& a) { lo = _mm512_max_pd(lo, a.lo); hi = _mm512_max_pd(hi, a.hi); }
+	inline void min(const BlockVec& a) { lo = _mm512_min_pd(lo, a.lo); hi = _mm512_min_pd(hi, a.hi); }
+	inline void maxArg(const BlockVec& a, double tap, BlockVec& arg) {
+		__m512d t = _mm512_set1_pd(tap);
+		__mmask8 gl = _mm512_cmp_pd_mask(a.lo, lo, _CMP_GT_OQ), gh = _mm512_cmp_pd_mask(a.hi, hi, _CMP_GT_OQ);
+		lo = _mm512_mask_blend_pd(gl, lo, a.lo);
+		hi = _mm512_mask_blend_pd(gh, hi, a.hi);
+		arg.lo = _mm512_mask_blend_pd(gl, arg.lo, t);
+		arg.hi = _mm512_mask_blend_pd(gh, arg.hi, t);
+	}
+};
+#elif defined(__AVX2__)
+#ifdef SIMD_FMA
+#define SIMD_MADD_PS(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define SIMD_MADD_PD(a, b, c) _mm256_fmadd_pd(a, b, c)
+#else
+#define SIMD_MADD_PS(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#define SIMD_MADD_PD(a, b, c) _mm256_add_pd(_mm256_mul_pd(a, b), c)
+#endif
+template<>
+struct BlockVec<float> {
+	__m256 v;
+	static inline BlockVec zero() { BlockVec r; r.v = _mm256_setzero_ps(); return r; }
+	static inline BlockVec set(float x) { BlockVec r; r.v = _mm256_set1_ps(x); return r; }
+	static inline BlockVec load(const float* p) { BlockVec r; r.v = _mm256_loadu_ps(p); return r; }
+	inline void store(float* p) const { _mm256_storeu_ps(p, v); }
+	inline void madd(const BlockVec& a, float x) { v = SIMD_MADD_PS(a.v, _mm256_set1_ps(x), v); }
+	inline void madd(const BlockVec& a, const BlockVec& b) { v = SIMD_MADD_PS(a.v, b.v, v); }
+	inline void add(const BlockVec& a) { v = _mm256_add_ps(v, a.v); }
+	inline void max(const BlockVec& a) { v = _mm256_max_ps(v, a.v); }
+	inline void min(const BlockVec& a) { v = _mm256_min_ps(v, a.v); }
+	inline void maxArg(const BlockVec& a, float tap, BlockVec& arg) {
+		__m256 g = _mm256_cmp_ps(a.v, v, _CMP_GT_OQ);
+		v = _mm256_blendv_ps(v, a.v, g);
+		arg.v = _mm256_blendv_ps(arg.v, _mm256_set1_ps(tap), g);
+	}
+};
+
+template<>
+struct BlockVec<double> {
+	__m256d lo, hi;
+	static inline BlockVec zero() { BlockVec r; r.lo = r.hi = _mm256_setzero_pd(); return r; }
+	static inline BlockVec set(double x) { BlockVec r; r.lo = r.hi = _mm256_set1_pd(x); return r; }
+	static inline BlockVec load(const double* p) { BlockVec r; r.lo = _mm256_loadu_pd(p); r.hi = _mm256_loadu_pd(p + 4); return r; }
+	inline void store(double* p) const { _mm256_storeu_pd(p, lo); _mm256_storeu_pd(p + 4, hi); }
+	inline void madd(const BlockVec& a, double x) {
+		__m256d b = _mm256_set1_pd(x);
+		lo = SIMD_MADD_PD(a.lo, b, lo);
+		hi = SIMD_MADD_PD(a.hi, b, hi);
+	}
+	inline void madd(const BlockVec& a, const BlockVec& b) { lo = SIMD_MADD_PD(a.lo, b.lo, lo); hi = SIMD_MADD_PD(a.hi, b.hi, hi); }
+	inline void add(const BlockVec& a) { lo = _mm256_add_pd(lo, a.lo); hi = _mm256_add_pd(hi, a.hi); }
+	inline void max(const BlockVec& a) { lo = _mm256_max_pd(lo, a.lo); hi = _mm256_max_pd(hi, a.hi); }
+	inline void min(const BlockVec& a) { lo = _mm256_min_pd(lo, a.lo); hi = _mm256_min_pd(hi, a.hi); }
+	inline void maxArg(const BlockVec& a, double tap, BlockVec& arg) {
+		__m256d t = _mm256_set1_pd(tap);
+		__m256d gl = _mm256_cmp_pd(a.lo, lo, _CMP_GT_OQ), gh = _mm256_cmp_pd(a.hi, hi, _CMP_GT_OQ);
+		lo = _mm256_blendv_pd(lo, a.lo, gl);
+		hi = _mm256_blendv_pd(hi, a.hi, gh);
+		arg.lo = _mm256_blendv_pd(arg.lo, t, gl);
+		arg.hi = _mm256_blendv_pd(arg.hi, t, gh);
+	}
+};
+#endif
+
+// One native vector of Dtype for the elementwise kernels (myMath, myOptim); without AVX2 it holds a single value.
+// Besides the arithmetic and sqrt the math kernels need a compare and select, 2^n of integer-valued lanes and the split of frexp.
+template<typename Dtype>
+struct MathVec {
+	typedef Dtype T;
+	enum { W = 1 };
+	Dtype v;
+	static inline MathVec set(Dtype x) { MathVec r; r.v = x; return r; }
+	static inline MathVec load(const Dtype* p) { return set(*p); }
+	inline void store(Dtype* p) const { *p = v; }
+	friend inline MathVec operator+(MathVec a, MathVec b) { return set(a.v + b.v); }
+	friend inline MathVec operator-(MathVec a, MathVec b) { return set(a.v - b.v); }
+	friend inline MathVec operator*(MathVec a, MathVec b) { return set(a.v * b.v); }
+	friend inline MathVec operator/(MathVec a, MathVec b) { return set(a.v / b.v); }
+	static inline MathVec sqrt(MathVec a) { return set(std::sqrt(a.v)); }
+	static inline MathVec madd(MathVec a, MathVec b, MathVec c) { return set(a.v * b.v + c.v); } // a * b + c
+	static inline MathVec min(MathVec a, MathVec b) { return set(a.v < b.v ? a.v : b.v); }
+	static inline MathVec max(MathVec a, MathVec b) { return set(a.v > b.v ? a.v : b.v); }
+	static inline MathVec ifLess(MathVec a, MathVec b, MathVec x, MathVec y) { return a.v < b.v ? x : y; } // a < b ? x : y
+	// 2^n for an integer n of the normal exponent range
+	static inline MathVec pow2(MathVec n) { return set(std::ldexp(Dtype(1), (int)n.v)); }
+	// x = m * 2^e with m in [0.5, 1), for a positive normal x
+	static inline MathVec frexp(MathVec x, MathVec& e) { int i; Dtype m = std::frexp(x.v, &i); e.v = Dtype(i); return set(m); }
+};
+
+// 2^n and frexp work on the bits: a rounding constant of 1.5 * 2^(mantissa bits) added to n leaves n in the low
+// bits, which are moved up into the exponent field together with the exponent bias
+#if defined(__AVX512F__)
+template<>
+struct MathVec<float> {
+	typedef float T;
+	enum { W = 16 };
+	__m512 v;
+	static inline MathVec make(__m512 x) { MathVec r; r.v = x; return r; }
+	static inline MathVec set(float x) { return make(_mm512_set1_ps(x)); }
+	static inline MathVec load(const float* p) { return make(_mm512_loadu_ps(p)); }
+	inline void store(float* p) const { _mm512_storeu_ps(p, v); }
+	friend inline MathVec operator+(MathVec a, MathVec b) { return make(_mm512_add_ps(a.v, b.v)); }
+	friend inline MathVec operator-(MathVec a, MathVec b) { return make(_mm512_sub_ps(a.v, b.v)); }
+	friend inline MathVec operator*(MathVec a, MathVec b) { return make(_mm512_mul_ps(a.v, b.v)); }
+	friend inline MathVec operator/(MathVec a, MathVec b) { return make(_mm512_div_ps(a.v, b.v)); }
+	static inline MathVec sqrt(MathVec a) { return make(_mm512_sqrt_ps(a.v)); }
+	static inline MathVec madd(MathVec a, MathVec b, MathVec c) { return make(_mm512_fmadd_ps(a.v, b.v, c.v)); }
+	static inline MathVec min(MathVec a, MathVec b) { return make(_mm512_min_ps(a.v, b.v)); }
+	static inline MathVec max(MathVec a, MathVec b) { return make(_mm512_max_ps(a.v, b.v)); }
+	static inline MathVec ifLess(MathVec a, MathVec b, MathVec x, MathVec y) { return make(_mm512_mask_blend_ps(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ), y.v, x.v)); }
+	static inline MathVec pow2(MathVec n) {
+		__m512i i = _mm512_castps_si512(_mm512_add_ps(n.v, _mm512_set1_ps(12582912.0f)));
+		return make(_mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(i, _mm512_set1_epi32(127)), 23)));
+	}
+	static inline MathVec frexp(MathVec x, MathVec& e) {
+		__m512i i = _mm512_castps_si512(x.v);
+		e.v = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_srli_epi32(i, 23), _mm512_set1_epi32(126)));
+		return make(_mm512_castsi512_ps(_mm512_or_si512(_mm512_and_si512(i, _mm512_set1_epi32(0x007FFFFF)), _mm512_set1_epi32(0x3F000000))));
+	}
+};
+
+template<>
+struct MathVec<double> {
+	typedef double T;
+	enum { W = 8 };
+	__m512d v;
+	static inline MathVec make(__m512d x) { MathVec r; r.v = x; return r; }
+	static inline MathVec set(double x) { return make(_mm512_set1_pd(x)); }
+	static inline MathVec load(const double* p) { return make(_mm512_loadu_pd(p)); }
+	inline void store(double* p) const { _mm512_storeu_pd(p, v); }
+	friend inline MathVec operator+(MathVec a, MathVec b) { return make(_mm512_add_pd(a.v, b.v)); }
+	friend inline MathVec operator-(MathVec a, MathVec b) { return make(_mm512_sub_pd(a.v, b.v)); }
+	friend inline MathVec operator*(MathVec a, MathVec b) { return make(_mm512_mul_pd(a.v, b.v)); }
+	friend inline MathVec operator/(MathVec a, MathVec b) { return make(_mm512_div_pd(a.v, b.v)); }
+	static inline MathVec sqrt(MathVec a) { return make(_mm512_sqrt_pd(a.v)); }
+	static inline MathVec madd(MathVec a, MathVec b, MathVec c) { return make(_mm512_fmadd_pd(a.v, b.v, c.v)); }
+	static inline MathVec min(MathVec a, MathVec b) { return make(_mm512_min_pd(a.v, b.v)); }
+	static inline MathVec max(MathVec a, MathVec b) { return make(_mm512_max_pd(a.v, b.v)); }
+	static inline MathVec ifLess(MathVec a, MathVec b, MathVec x, MathVec y) { return make(_mm512_mask_blend_pd(_mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ), y.v, x.v)); }
+	static inline MathVec pow2(MathVec n) {
+		__m512i i = _mm512_castpd_si512(_mm512_add_pd(n.v, _mm512_set1_pd(6755399441055744.0)));
+		return make(_mm512_castsi512_pd(_mm512_slli_epi64(_mm512_add_epi64(i, _mm512_set1_epi64(1023)), 52)));
+	}
+	static inline MathVec frexp(MathVec x, MathVec& e) {
+		// the exponent field becomes the low bits of 2^52, subtracting 2^52 turns it into a double
+		__m512i i = _mm512_castpd_si512(x.v);
+		__m512d b = _mm512_castsi512_pd(_mm512_or_si512(_mm512_srli_epi64(i, 52), _mm512_set1_epi64(0x4330000000000000LL)));
+		e.v = _mm512_sub_pd(b, _mm512_set1_pd(4503599627370496.0 + 1022));
+		return make(_mm512_castsi512_pd(_mm512_or_si512(_mm512_and_si512(i, _mm512_set1_epi64(0x000FFFFFFFFFFFFFLL)), _mm512_set1_epi64(0x3FE0000000000000LL))));
+	}
+};
+#elif defined(__AVX2__)
+template<>
+struct MathVec<float> {
+	typedef float T;
+	enum { W = 8 };
+	__m256 v;
+	static inline MathVec make(__m256 x) { MathVec r; r.v = x; return r; }
+	static inline MathVec set(float x) { return make(_mm256_set1_ps(x)); }
+	static inline MathVec load(const float* p) { return make(_mm256_loadu_ps(p)); }
+	inline void store(float* p) const { _mm256_storeu_ps(p, v); }
+	friend inline MathVec operator+(MathVec a, MathVec b) { return make(_mm256_add_ps(a.v, b.v)); }
+	friend inline MathVec operator-(MathVec a, MathVec b) { return make(_mm256_sub_ps(a.v, b.v)); }
+	friend inline MathVec operator*(MathVec a, MathVec b) { return make(_mm256_mul_ps(a.v, b.v)); }
+	friend inline MathVec operator/(MathVec a, MathVec b) { return make(_mm256_div_ps(a.v, b.v)); }
+	static inline MathVec sqrt(MathVec a) { return make(_mm256_sqrt_ps(a.v)); }
+	static inline MathVec madd(MathVec a, MathVec b, MathVec c) { return make(SIMD_MADD_PS(a.v, b.v, c.v)); }
+	static inline MathVec min(MathVec a, MathVec b) { return make(_mm256_min_ps(a.v, b.v)); }
+	static inline MathVec max(MathVec a, MathVec b) { return make(_mm256_max_ps(a.v, b.v)); }
+	static inline MathVec ifLess(MathVec a, MathVec b, MathVec x, MathVec y) { return make(_mm256_blendv_ps(y.v, x.v, _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ))); }
+	static inline MathVec pow2(MathVec n) {
+		__m256i i = _mm256_castps_si256(_mm256_add_ps(n.v, _mm256_set1_ps(12582912.0f)));
+		return make(_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(i, _mm256_set1_epi32(127)), 23)));
+	}
+	static inline MathVec frexp(MathVec x, MathVec& e) {
+		__m256i i = _mm256_castps_si256(x.v);
+		e.v = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(i, 23), _mm256_set1_epi32(126)));
+		return make(_mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(i, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3F000000))));
+	}
+};
+
+template<>
+struct MathVec<double> {
+	typedef double T;
+	enum { W = 4 };
+	__m256d v;
+	static inline MathVec make(__m256d x) { MathVec r; r.v = x; return r; }
+	static inline MathVec set(double x) { return make(_mm256_set1_pd(x)); }
+	static inline MathVec load(const double* p) { return make(_mm256_loadu_pd(p)); }
+	inline void store(double* p) const { _mm256_storeu_pd(p, v); }
+	friend inline MathVec operator+(MathVec a, MathVec b) { return make(_mm256_add_pd(a.v, b.v)); }
+	friend inline MathVec operator-(MathVec a, MathVec b) { return make(_mm256_sub_pd(a.v, b.v)); }
+	friend inline MathVec operator*(MathVec a, MathVec b) { return make(_mm256_mul_pd(a.v, b.v)); }
+	friend inline MathVec operator/(MathVec a, MathVec b) { return make(_mm256_div_pd(a.v, b.v)); }
+	static inline MathVec sqrt(MathVec a) { return make(_mm256_sqrt_pd(a.v)); }
+	static inline MathVec madd(MathVec a, MathVec b, MathVec c) { return make(SIMD_MADD_PD(a.v, b.v, c.v)); }
+	static inline MathVec min(MathVec a, MathVec b) { return make(_mm256_min_pd(a.v, b.v)); }
+	static inline MathVec max(MathVec a, MathVec b) { return make(_mm256_max_pd(a.v, b.v)); }
+	static inline MathVec ifLess(MathVec a, MathVec b, MathVec x, MathVec y) { return make(_mm256_blendv_pd(y.v, x.v, _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ))); }
+	static inline MathVec pow2(MathVec n) {
+		__m256i i = _mm256_castpd_si256(_mm256_add_pd(n.v, _mm256_set1_pd(6755399441055744.0)));
+		return make(_mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(i, _mm256_set1_epi64x(1023)), 52)));
+	}
+	static inline MathVec frexp(MathVec x, MathVec& e) {
+		// AVX2 has no int64 -> double: the exponent field becomes the low bits of 2^52, minus 2^52 gives its value
+		__m256i i = _mm256_castpd_si256(x.v);
+		__m256d b = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(i, 52), _mm256_set1_epi64x(0x4330000000000000LL)));
+		e.v = _mm256_sub_pd(b, _mm256_set1_pd(4503599627370496.0 + 1022));
+		return make(_mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(i, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)), _mm256_set1_epi64x(0x3FE0000000000000LL))));
+	}
+};
+#endif
+
+#endif
@@ -0,0 +1,104 @@
+#include "myThread.hpp"
+#include <algorithm>
+
+// Set on the workers, and on the caller while it runs its own range: a run() from there stays on the thread
+static thread_local bool inJob = false;
+
+ThreadPool& ThreadPool::get() {
+	static ThreadPool pool;
+	return pool;
+}
+
+ThreadPool::ThreadPool() :nthreads(1), generation(0), pending(0), quit(false), job(NULL), job_f(NULL), job_n(0), job_parts(0) {}
+
+ThreadPool::~ThreadPool() {
+	stop();
+}
+
+void ThreadPool::setThreads(int n) {
+	if (n <= 0)
+		n = std::max(1, (int)std::thread::hardware_concurrency());
+	if (n == nthreads)
+		return;
+	stop();
+	nthreads = n;
+	quit = false;
+	// The workers start from the generation of now, so a job published before one of them runs is not missed
+	for (int t = 1; t < n; t++)
+		workers.push_back(std::thread(&ThreadPool::work, this, t, generation.load()));
+}
+
+void ThreadPool::stop() {
+	{
+		std::lock_guard<std::mutex> g(lock);
+		quit = true;
+		generation++;
+	}
+	wake.notify_all();
+	for (auto& w : workers)
+		w.join();
+	workers.clear();
+	nthreads = 1;
+}
+
+int ThreadPool::dispatch(Job f, const void* ctx, int n) {
+	int parts = std::min(n, nthreads);
+	if (parts <= 1 || inJob || !busy.try_lock()) {
+		f(ctx, 0, n, 0);
+		return 1;
+	}
+
+	// 1. Publish the job, then wake the workers that went to sleep
+	job = f;
+	job_f = ctx;
+	job_n = n;
+	job_parts = parts;
+	pending.store(nthreads - 1);
+	{
+		std::lock_guard<std::mutex> g(lock);
+		generation++;
+	}
+	wake.notify_all();
+
+	// 2. Range 0 here, then wait for the others
+	inJob = true;
+	f(ctx, 0, rangeBegin(n, parts, 1), 0);
+	inJob = false;
+	for (int i = 0; i < POOL_SPINS && pending.load(); i++)
+		std::this_thread::yield();
+	if (pending.load()) {
+		std::unique_lock<std::mutex> l(lock);
+		done.wait(l, [this] { return pending.load() == 0; });
+	}
+	busy.unlock();
+	return parts;
+}
+
+void ThreadPool::work(int t, unsigned seen) {
+	inJob = true;
+	for (;;) {
+		// 1. Poll for the next job for a while, then sleep until one comes
+		unsigned g = generation.load();
+		for (int i = 0; i < POOL_SPINS && g == seen; i++) {
+			std::this_thread::yield();
+			g = generation.load();
+		}
+		if (g == seen) {
+			std::unique_lock<std::mutex> l(lock);
+			wake.wait(l, [&] { return generation.load() != seen; });
+			g = generation.load();
+		}
+		seen = g;
+		if (quit)
+			return;
+
+		// 2. This thread's range, if the job has that many. Every worker checks in, so the job is not
+		// replaced while one of them is still reading it
+		if (t < job_parts)
+			job(job_f, rangeBegin(job_n, job_parts, t), rangeBegin(job_n, job_parts, t + 1), t);
+		if (pending.fetch_sub(1) == 1) {
+			std::lock_guard<std::mutex> l(lock);
+			done.notify_one();
+		}
+	}
+}
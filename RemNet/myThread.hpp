@@ -0,0 +1,63 @@
+#ifndef __MYTHREAD_HPP__
+#define __MYTHREAD_HPP__
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::vector;
+
+// Times a waiting thread polls before it sleeps on a condition variable, so the fork/join between
+// two kernels that follow each other closely never goes through the kernel
+#define POOL_SPINS 4000
+
+// Persistent worker threads for the layer kernels.
+// run(n, f) splits [0, n) into contiguous ranges, at most one per thread, calls f(begin, end, t) on each
+// with t the index of the range (the calling thread takes range 0) and returns once all of them are done.
+// A run() issued from inside a range, or while another thread is running a job, runs on the calling
+// thread alone, so kernels may call each other and may be called from any thread.
+class ThreadPool {
+public:
+	static ThreadPool& get();
+	// Number of threads the kernels run on, the caller included (0: every hardware thread)
+	void setThreads(int n);
+	inline int threads() const { return nthreads; }
+	// Returns the number of ranges [0, n) was split into: t stays below it, and per-thread
+	// accumulators up to it are the ones to reduce
+	template<typename F>
+	int run(int n, const F& f) { return n > 0 ? dispatch(invoke<F>, &f, n) : 0; }
+
+private:
+	typedef void (*Job)(const void* f, int begin, int end, int t);
+	ThreadPool();
+	~ThreadPool();
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+	template<typename F>
+	static void invoke(const void* f, int begin, int end, int t) { (*static_cast<const F*>(f))(begin, end, t); }
+	int dispatch(Job job, const void* f, int n);
+	void work(int t, unsigned seen);
+	void stop();
+
+	int nthreads;
+	vector<std::thread> workers; // threads 1 .. nthreads - 1
+	std::mutex busy; // held by the thread that has a job out
+	std::mutex lock; // guards the sleeping on wake and done
+	std::condition_variable wake, done;
+	std::atomic<unsigned> generation; // bumped for every job, and to stop
+	std::atomic<int> pending; // workers that have not finished the current job
+	bool quit;
+	Job job; // the current job: f, its size and the number of ranges
+	const void* job_f;
+	int job_n, job_parts;
+};
+
+// ThreadPool::get().run(n, f)
+template<typename F>
+inline int parallelFor(int n, const F& f) { return ThreadPool::get().run(n, f); }
+
+// Range t of [0, n) split into parts
+inline int rangeBegin(int n, int parts, int t) { return (int)((long long)n * t / parts); }
+
+#endif
@@ -0,0 +1,102 @@
+#include "myTune.hpp"
+#include "mySimd.hpp"
+#include <json/json.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+using namespace std;
+
+string cpuModel() {
+	// 1. Brand string from cpuid leaves 0x80000002..4
+	char brand[49] = {0};
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuid(r, 0x80000000);
+	if ((unsigned)r[0] >= 0x80000004)
+		for (int i = 0; i < 3; i++) {
+			__cpuid(r, 0x80000002 + i);
+			memcpy(brand + 16 * i, r, 16);
+		}
+#elif defined(__x86_64__) || defined(__i386__)
+	unsigned r[4];
+	if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004)
+		for (int i = 0; i < 3; i++) {
+			__get_cpuid(0x80000002 + i, &r[0], &r[1], &r[2], &r[3]);
+			memcpy(brand + 16 * i, r, 16);
+		}
+#endif
+	string model(brand);
+	size_t b = model.find_first_not_of(' '), e = model.find_last_not_of(' ');
+	model = b == string::npos ? "unknown cpu" : model.substr(b, e - b + 1);
+
+	// 2. The same CPU runs different blocked kernels depending on the instruction set built in
+	return model + " / cblock " + to_string(CBLOCK);
+}
+
+string convTuneKey(const string& precision, const ConvShape& s, int N, int threads) {
+	ostringstream key;
+	key << precision << " N" << N << " C" << s.C << " " << s.H << "x" << s.W << " F" << s.F << " k" << s.Hw << "x" << s.Ww
+		<< " pad" << s.pad << " stride" << s.stride << " threads" << threads;
+	return key.str();
+}
+
+static Json::Value readTuneFile(const string& file) {
+	Json::Value root(Json::objectValue);
+	ifstream ifs(file);
+	if (!ifs.is_open())
+		return root;
+	Json::CharReaderBuilder reader;
+	JSONCPP_STRING errs;
+	if (!Json::parseFromStream(reader, ifs, &root, &errs) || !root.isObject()) {
+		cout << "Ignoring unreadable tune cache " << file << endl;
+		root = Json::Value(Json::objectValue);
+	}
+	return root;
+}
+
+map<string, vector<string>> loadTuneCache(const string& file, const string& cpu) {
+	map<string, vector<string>> entries;
+	Json::Value root = readTuneFile(file);
+	const Json::Value& layers = root[cpu];
+	if (!layers.isObject())
+		return entries;
+	for (const string& key : layers.getMemberNames()) {
+		const Json::Value& algos = layers[key];
+		if (!algos.isArray() || algos.size() != 3)
+			continue;
+		vector<string> picked;
+		for (int i = 0; i < 3; i++) {
+			string algo = algos[i].asString();
+			if (algo == "direct" || algo == "gemm" || algo == "winograd" || algo == "fft" || algo == "blocked")
+				picked.push_back(algo);
+		}
+		if (picked.size() == 3) // entries naming unknown algorithms are tuned again
+			entries[key] = picked;
+	}
+	return entries;
+}
+
+void saveTuneCache(const string& file, const string& cpu, const map<string, vector<string>>& entries) {
+	Json::Value root = readTuneFile(file);
+	Json::Value& layers = root[cpu];
+	for (auto& entry : entries) {
+		Json::Value algos(Json::arrayValue);
+		for (auto& algo : entry.second)
+			algos.append(algo);
+		layers[entry.first] = algos;
+	}
+	ofstream ofs(file);
+	if (!ofs.is_open()) {
+		cout << "Cannot write the tune cache " << file << endl;
+		return;
+	}
+	Json::StreamWriterBuilder writer;
+	writer["indentation"] = "  ";
+	ofs << Json::writeString(writer, root) << endl;
+}
@@ -0,0 +1,31 @@
+#ifndef __MYTUNE_HPP__
+#define __MYTUNE_HPP__
+#include <map>
+#include <string>
+#include <vector>
+#include "myConv.hpp"
+
+using std::map;
+using std::string;
+using std::vector;
+
+// Convolution autotuner settings: timed runs per pass after the warm-up, how much slower than the
+// best a warm-up may be before the candidate is dropped, and the largest scratch a candidate may use
+#define TUNE_REPS 3
+#define TUNE_CUTOFF 4.0
+#define TUNE_MAX_SCRATCH_MB 512
+
+// Name of the machine the tuned choices hold for: the CPU brand string and the SIMD width built in
+string cpuModel();
+
+// Cache key of one conv layer: element type, batch, geometry and the number of threads its kernels
+// run on (the algorithms do not scale alike, so a choice measured at one count does not carry over)
+string convTuneKey(const string& precision, const ConvShape& s, int N, int threads);
+
+// The on-disk cache is a json object of CPU models, each mapping layer keys to the forward,
+// backward-data and backward-weights algorithms. Loading a missing file gives no entries;
+// saving keeps the entries of other CPUs.
+map<string, vector<string>> loadTuneCache(const string& file, const string& cpu);
+void saveTuneCache(const string& file, const string& cpu, const map<string, vector<string>>& entries);
+
+#endif
@@ -0,0 +1,59 @@
+#include "myWorkspace.hpp"
+#include <cassert>
+using namespace std;
+
+template<typename Dtype>
+void Workspace<Dtype>::declare(const string& group, const vector<int>& shape) {
+	assert(total == 0); // no declarations after allocate()
+	vector<shared_ptr<Blob<Dtype>>>& g = groups[group];
+	owners.push_back(make_pair(group, (int)g.size()));
+	g.push_back(NULL);
+	shapes.push_back(shape);
+}
+
+template<typename Dtype>
+void Workspace<Dtype>::allocate() {
+	// 1. Lay the tensors out back to back, each one starting on a BLOB_ALIGN boundary
+	const size_t align = BLOB_ALIGN / sizeof(Dtype);
+	size_t offset = 0;
+	for (auto& shape : shapes) {
+		offsets.push_back(offset);
+		size_t num = (size_t)shape[0] * shape[1] * shape[2] * shape[3];
+		offset += (num + align - 1) / align * align;
+	}
+	total = offset;
+
+	// 2. One allocation for everything, then hand out views
+	arena = Blob<Dtype>(1, 1, 1, (int)total, TZEROS);
+	for (int i = 0; i < (int)shapes.size(); i++)
+		groups[owners[i].first][owners[i].second].reset(new Blob<Dtype>(arena.memptr() + offsets[i], shapes[i]));
+}
+
+template<typename Dtype>
+vector<shared_ptr<Blob<Dtype>>>& Workspace<Dtype>::operator[](const string& group) {
+	assert(has(group));
+	return groups[group];
+}
+
+template<typename Dtype>
+bool Workspace<Dtype>::has(const string& group) const {
+	return groups.find(group) != groups.end();
+}
+
+template<typename Dtype>
+shared_ptr<Blob<Dtype>> Workspace<Dtype>::span(const string& group) {
+	assert(total > 0 && has(group));
+	int first = -1, last = -1;
+	for (int i = 0; i < (int)owners.size(); i++)
+		if (owners[i].first == group) {
+			assert(first < 0 || last == i - 1); // declared back to back
+			last = i;
+			first = first < 0 ? i : first;
+		}
+	const vector<int>& s = shapes[last];
+	size_t end = offsets[last] + (size_t)s[0] * s[1] * s[2] * s[3];
+	return shared_ptr<Blob<Dtype>>(new Blob<Dtype>(arena.memptr() + offsets[first], {1, 1, 1, (int)(end - offsets[first])}));
+}
+
+template class Workspace<float>;
+template class Workspace<double>;
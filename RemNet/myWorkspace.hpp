@@ -0,0 +1,42 @@
+#ifndef __MYWORKSPACE_HPP__
+#define __MYWORKSPACE_HPP__
+#include <memory>
+#include <unordered_map>
+#include "myBlob.hpp"
+
+using std::shared_ptr;
+using std::unordered_map;
+
+// Arena for the activations, gradients and layer scratch of one batch size (and, in the Net, for the
+// trainable parameters, their gradients and the optimizer state).
+// Tensors are declared by group name first, then allocate() carves all of them out of a
+// single aligned Blob. The Blobs handed out are views into that block and stay valid for
+// the lifetime of the Workspace, so every iteration reuses the same memory.
+// The alignment gaps between tensors are zero, so a pass over the whole arena may include them.
+template<typename Dtype>
+class Workspace {
+public:
+	Workspace() :total(0) {}
+	void declare(const string& group, const vector<int>& shape); // append a tensor to group
+	void allocate();
+	vector<shared_ptr<Blob<Dtype>>>& operator[](const string& group);
+	bool has(const string& group) const;
+	// The whole arena as one Blob, and a view from the first to the last tensor of a group declared back to back
+	inline Blob<Dtype>& flat() { return arena; }
+	shared_ptr<Blob<Dtype>> span(const string& group);
+	inline size_t bytes() const { return total * sizeof(Dtype); }
+	inline int slots() const { return (int)shapes.size(); }
+
+private:
+	Workspace(const Workspace&);
+	Workspace& operator=(const Workspace&);
+
+	Blob<Dtype> arena; // the single allocation every tensor lives in
+	size_t total; // number of elements in the arena
+	vector<vector<int>> shapes; // declared shapes, in declaration order
+	vector<size_t> offsets; // where each of them starts in the arena
+	vector<std::pair<string, int>> owners; // (group, index in group) of every declared tensor
+	unordered_map<string, vector<shared_ptr<Blob<Dtype>>>> groups;
+};
+
+#endif